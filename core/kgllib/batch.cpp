@@ -17,10 +17,18 @@
 
 #include "batch.h"
 
+#include "geometryarena.h"
 #include "geometrybuffer.h"
+#include "instancebuffer.h"
+#include "meshoptimizer.h"
+#include "uploadqueue.h"
 
 #include <QtDebug>
 
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
 using namespace Eigen;
 
 
@@ -40,21 +48,48 @@ Batch::Batch(GeometryBuffer* buffer, int offset, int indexoffset)
 
 void Batch::init()
 {
-    mDirty = true;
-    mVertices = mColors = mNormals = mTexcoords = 0;
-    mVertexSize = mColorSize = mNormalSize = mTexcoordSize = 0;
+    mDirtyAttributes = 0;
+    mDirtyVertexFirst = mDirtyVertexEnd = 0;
+    mDirtyIndexFirst = mDirtyIndexEnd = 0;
+    mVertices = mColors = mNormals = 0;
+    mVertexSize = mColorSize = mNormalSize = 0;
 
     mIndices = 0;
     mIndexCount = 0;
+    mCurrentLod = 0;
+    mLodPixelError = 1.0f;
+    mBoundsDirty = true;
+    mBoundingBoxMin = Eigen::Vector3f(0, 0, 0);
+    mBoundingBoxMax = Eigen::Vector3f(0, 0, 0);
+    mBoundingSphereCenter = Eigen::Vector3f(0, 0, 0);
+    mBoundingSphereRadius = 0;
+    mReleaseData = false;
+    mVertexCount = 0;
     mPrimitiveType = GL_TRIANGLES;
+    mPrimitiveRestart = false;
+    mBufferLayout = GeometryBufferFormat::Planar;
+    mBufferUsage = GeometryBufferFormat::StaticUsage;
+    mCompactEncoding = false;
     mBuffer = 0;
     mBufferOffset = 0;
     mBufferIndexOffset = 0;
+    mBaseVertex = 0;
     mOwnBuffer = true;
+    mArena = 0;
+    mUploadQueue = 0;
+    mInstanceBuffer = 0;
+    mAttributeProgram = 0;
 }
 
 Batch::~Batch()
 {
+    if (mUploadQueue) {
+        mUploadQueue->cancel(this);
+    }
+    qDeleteAll(mOwnedArrays);
+    if (mArena) {
+        mArena->releaseBatch(this);
+    }
     if (mOwnBuffer) {
         delete mBuffer;
     }
@@ -62,43 +97,276 @@ Batch::~Batch()
 
 void Batch::setVertexCount(int count)
 {
+    if (count == mVertexCount) {
+        return;
+    }
     mVertexCount = count;
-    mDirty = true;
+    markDirty(Vertices | Colors | Normals | Texcoords | GenericAttributes);
 }
 
 void Batch::setVertices(void* vertices, int size)
 {
+    releaseArray(Vertices, vertices);
     mVertices = vertices;
     mVertexSize = vertices ? size : 0;
-    mDirty = true;
+    markDirty(Vertices);
 }
 
 void Batch::setColors(void* colors, int size)
 {
+    releaseArray(Colors, colors);
     mColors = colors;
     mColorSize = colors ? size : 0;
-    mDirty = true;
+    markDirty(Colors);
 }
 
 void Batch::setNormals(Eigen::Vector3f* normals)
 {
+    releaseArray(Normals, normals);
     mNormals = normals;
     mNormalSize = normals ? 3 : 0;
-    mDirty = true;
+    markDirty(Normals);
+}
+
+void Batch::setTexcoords(int unit, void* texcoords, int size)
+{
+    if (unit >= mTexcoords.count()) {
+        if (!texcoords) {
+            return;
+        }
+        mTexcoords.resize(unit + 1);
+        mTexcoordSize.resize(unit + 1);
+    }
+    releaseArray(texcoordSlot(unit), texcoords);
+    mTexcoords[unit] = texcoords;
+    mTexcoordSize[unit] = texcoords ? size : 0;
+    markDirty(Texcoords);
+}
+
+const void* Batch::texcoordsArray(int unit) const
+{
+    return (unit < mTexcoords.count()) ? mTexcoords[unit] : 0;
+}
+
+void Batch::setAttribute(const QString& name, void* data, int size, GLenum type, bool normalized)
+{
+    int index = -1;
+    for (int i = 0; i < mAttributes.count(); i++) {
+        if (mAttributes[i].name == name) {
+            index = i;
+            break;
+        }
+    }
+
+    if (!data) {
+        if (index >= 0) {
+            mAttributes.removeAt(index);
+            markDirty(GenericAttributes);
+        }
+        return;
+    }
+    if (index < 0) {
+        mAttributes.append(AttributeArray());
+        index = mAttributes.count() - 1;
+    }
+    AttributeArray& attr = mAttributes[index];
+    attr.name = name;
+    attr.data = data;
+    attr.size = size;
+    attr.type = type;
+    attr.normalized = normalized;
+    markDirty(GenericAttributes);
 }
 
-void Batch::setTexcoords(void* texcoords, int size)
+const void* Batch::attributeArray(const QString& name) const
 {
-    mTexcoords = texcoords;
-    mTexcoordSize = texcoords ? size : 0;
-    mDirty = true;
+    foreach (const AttributeArray& attr, mAttributes) {
+        if (attr.name == name) {
+            return attr.data;
+        }
+    }
+    return 0;
 }
 
 void Batch::setIndices(unsigned int* indices, int indexCount)
 {
+    releaseArray(Indices, indices);
     mIndices = indices;
-    mIndexCount = indexCount;
-    mDirty = true;
+    mIndexCount = indices ? indexCount : 0;
+    // The ranges of the levels of detail aren't valid anymore
+    mLodLevels.clear();
+    mCurrentLod = 0;
+    markDirty(Indices);
+}
+
+template<typename T> void* Batch::adoptArray(int slot, const QVector<T>& vector)
+{
+    if (vector.isEmpty()) {
+        return 0;
+    }
+    OwnedArray* array = new OwnedVector<T>(vector);
+    releaseArray(slot);
+    mOwnedArrays.insert(slot, array);
+    return array->data();
+}
+
+void Batch::releaseArray(int slot, void* keep)
+{
+    OwnedArray* array = mOwnedArrays.value(slot);
+    if (array && array->data() != keep) {
+        delete mOwnedArrays.take(slot);
+    }
+}
+
+void*& Batch::arrayPointer(int slot)
+{
+    switch (slot) {
+        case Vertices:
+            return mVertices;
+        case Colors:
+            return mColors;
+        case Normals:
+            return mNormals;
+        case Indices:
+            return mIndices;
+        default:
+            return mTexcoords[slot >> 8];
+    }
+}
+
+void Batch::setVertices(const QVector<Eigen::Vector2f>& vertices)
+{
+    setVertices(adoptArray(Vertices, vertices), 2);
+    setVertexCount(vertices.count());
+}
+
+void Batch::setVertices(const QVector<Eigen::Vector3f>& vertices)
+{
+    setVertices(adoptArray(Vertices, vertices), 3);
+    setVertexCount(vertices.count());
+}
+
+void Batch::setColors(const QVector<Eigen::Vector3f>& colors)
+{
+    setColors(adoptArray(Colors, colors), 3);
+}
+
+void Batch::setNormals(const QVector<Eigen::Vector3f>& normals)
+{
+    setNormals(reinterpret_cast<Eigen::Vector3f*>(adoptArray(Normals, normals)));
+}
+
+void Batch::setTexcoords(int unit, const QVector<float>& texcoords)
+{
+    setTexcoords(unit, adoptArray(texcoordSlot(unit), texcoords), 1);
+}
+
+void Batch::setTexcoords(int unit, const QVector<Eigen::Vector2f>& texcoords)
+{
+    setTexcoords(unit, adoptArray(texcoordSlot(unit), texcoords), 2);
+}
+
+void Batch::setTexcoords(int unit, const QVector<Eigen::Vector3f>& texcoords)
+{
+    setTexcoords(unit, adoptArray(texcoordSlot(unit), texcoords), 3);
+}
+
+void Batch::setIndices(const QVector<unsigned int>& indices)
+{
+    setIndices(reinterpret_cast<unsigned int*>(adoptArray(Indices, indices)), indices.count());
+}
+
+void Batch::releaseData()
+{
+    foreach (int slot, mOwnedArrays.keys()) {
+        arrayPointer(slot) = 0;
+    }
+    qDeleteAll(mOwnedArrays);
+    mOwnedArrays.clear();
+}
+
+bool Batch::hasReleasedData() const
+{
+    // Released arrays keep their size so that the format doesn't change
+    if ((mVertexSize && !mVertices) || (mColorSize && !mColors) || (mNormalSize && !mNormals) ||
+            (mIndexCount && !mIndices)) {
+        return true;
+    }
+    for (int i = 0; i < mTexcoords.count(); i++) {
+        if (mTexcoordSize[i] && !mTexcoords[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Batch::remapVertices(const QVector<unsigned int>& remap)
+{
+    if (!mVertexCount || remap.count() != mVertexCount || !mAttributes.isEmpty() || hasReleasedData()) {
+        return false;
+    }
+
+    // Slots of the vertex arrays and the number of floats in each element
+    QVector<int> arraySlots;
+    QVector<int> sizes;
+    arraySlots << Vertices << Colors << Normals;
+    sizes << mVertexSize << mColorSize << mNormalSize;
+    for (int i = 0; i < mTexcoords.count(); i++) {
+        arraySlots << texcoordSlot(i);
+        sizes << mTexcoordSize[i];
+    }
+    for (int i = 0; i < arraySlots.count(); i++) {
+        void* data = arrayPointer(arraySlots[i]);
+        OwnedArray* owned = mOwnedArrays.value(arraySlots[i]);
+        if (data && (!owned || owned->data() != data)) {
+            return false;
+        }
+    }
+
+    // The owned vectors may share their data with the caller's copies, so
+    //  the reordered data goes into new arrays
+    for (int i = 0; i < arraySlots.count(); i++) {
+        const char* data = reinterpret_cast<const char*>(arrayPointer(arraySlots[i]));
+        if (!data) {
+            continue;
+        }
+        const int elemsize = sizes[i] * sizeof(float);
+        QVector<char> remapped(mVertexCount * elemsize);
+        for (int v = 0; v < mVertexCount; v++) {
+            memcpy(remapped.data() + remap[v] * elemsize, data + v * elemsize, elemsize);
+        }
+        arrayPointer(arraySlots[i]) = adoptArray(arraySlots[i], remapped);
+    }
+    markDirty(Vertices | Colors | Normals | Texcoords);
+    return true;
+}
+
+void Batch::markDirty(int attributes, int first, int count)
+{
+    if (attributes & (Vertices | Colors | Normals | Texcoords | GenericAttributes)) {
+        int end = (count < 0) ? INT_MAX : first + count;
+        if (mDirtyVertexFirst >= mDirtyVertexEnd) {
+            mDirtyVertexFirst = first;
+            mDirtyVertexEnd = end;
+        } else {
+            mDirtyVertexFirst = qMin(mDirtyVertexFirst, first);
+            mDirtyVertexEnd = qMax(mDirtyVertexEnd, end);
+        }
+    }
+    if (attributes & Indices) {
+        int end = (count < 0) ? INT_MAX : first + count;
+        if (mDirtyIndexFirst >= mDirtyIndexEnd) {
+            mDirtyIndexFirst = first;
+            mDirtyIndexEnd = end;
+        } else {
+            mDirtyIndexFirst = qMin(mDirtyIndexFirst, first);
+            mDirtyIndexEnd = qMax(mDirtyIndexEnd, end);
+        }
+    }
+    if (attributes & Vertices) {
+        mBoundsDirty = true;
+    }
+    mDirtyAttributes |= attributes;
 }
 
 GLenum Batch::primitiveType() const
@@ -109,11 +377,209 @@ GLenum Batch::primitiveType() const
 void Batch::setPrimitiveType(GLenum type)
 {
     mPrimitiveType = type;
-    if (mBuffer) {
+    if (mArena) {
+        // Arena blocks are shared with other batches, so move to another one
+        markDirty(AllAttributes);
+    } else if (mBuffer) {
         mBuffer->setPrimitiveType(type);
     }
 }
 
+void Batch::setPrimitiveRestart(bool restart)
+{
+    if (restart == mPrimitiveRestart) {
+        return;
+    }
+    mPrimitiveRestart = restart;
+    markDirty(AllAttributes);
+}
+
+void Batch::setBufferLayout(GeometryBufferFormat::Layout layout)
+{
+    if (layout == mBufferLayout) {
+        return;
+    }
+    mBufferLayout = layout;
+    markDirty(AllAttributes);
+}
+
+void Batch::setBufferUsage(GeometryBufferFormat::Usage usage)
+{
+    if (usage == mBufferUsage) {
+        return;
+    }
+    mBufferUsage = usage;
+    markDirty(AllAttributes);
+}
+
+void Batch::setCompactEncoding(bool compact)
+{
+    if (compact == mCompactEncoding) {
+        return;
+    }
+    mCompactEncoding = compact;
+    markDirty(AllAttributes);
+}
+
+int Batch::generateLods(int levelCount, float reduction)
+{
+    if (mPrimitiveType != GL_TRIANGLES || !mIndices || !mVertices || mVertexSize < 2) {
+        qCritical() << "Batch::generateLods(): only indexed triangles can be simplified";
+        return 0;
+    }
+
+    // Positions for the simplification, 2d vertices lie in the z=0 plane
+    QVector<Eigen::Vector3f> positions(mVertexCount);
+    const float* vertices = reinterpret_cast<const float*>(mVertices);
+    for (int i = 0; i < mVertexCount; i++) {
+        const float* v = vertices + i * mVertexSize;
+        positions[i] = Eigen::Vector3f(v[0], v[1], (mVertexSize > 2) ? v[2] : 0.0f);
+    }
+
+    // Existing levels are replaced, starting from the full detail one
+    int fullCount = mLodLevels.isEmpty() ? mIndexCount : mLodLevels[0].indexCount;
+    const unsigned int* full = reinterpret_cast<const unsigned int*>(mIndices) + (mLodLevels.isEmpty() ? 0 : mLodLevels[0].indexOffset);
+    QVector<unsigned int> indices(fullCount);
+    memcpy(indices.data(), full, fullCount * sizeof(unsigned int));
+
+    QList<LodLevel> levels;
+    LodLevel level;
+    level.indexOffset = 0;
+    level.indexCount = fullCount;
+    level.error = 0;
+    levels.append(level);
+
+    int targetCount = fullCount;
+    for (int i = 1; i < levelCount; i++) {
+        targetCount = int(targetCount * reduction) / 3 * 3;
+        float error;
+        QVector<unsigned int> simplified = MeshOptimizer::simplify(indices.constData(), fullCount, positions.constData(),
+                                                                   mVertexCount, targetCount, &error);
+        // Stop if the mesh couldn't be simplified noticeably
+        if (simplified.isEmpty() || simplified.count() > levels.last().indexCount * 0.9f) {
+            break;
+        }
+        MeshOptimizer::optimizeVertexCache(simplified.data(), simplified.count(), mVertexCount);
+
+        level.indexOffset = indices.count();
+        level.indexCount = simplified.count();
+        level.error = qMax(error, levels.last().error);
+        levels.append(level);
+        indices += simplified;
+    }
+
+    qDebug() << "Batch::generateLods(): created" << levels.count() << "levels, smallest has" << levels.last().indexCount / 3 << "triangles";
+    setIndices(indices);
+    setLodLevels(levels);
+    return levels.count();
+}
+
+void Batch::setLodLevels(const QList<LodLevel>& levels)
+{
+    mLodLevels = levels;
+    mCurrentLod = 0;
+}
+
+void Batch::setCurrentLod(int level)
+{
+    mCurrentLod = qBound(0, level, qMax(mLodLevels.count() - 1, 0));
+}
+
+int Batch::selectLod(float projectedSize)
+{
+    float radius = boundingSphereRadius();
+    int level = 0;
+    if (radius > 0) {
+        float pixelsPerUnit = projectedSize / (2 * radius);
+        while (level + 1 < mLodLevels.count() && mLodLevels[level+1].error * pixelsPerUnit <= mLodPixelError) {
+            level++;
+        }
+    }
+    setCurrentLod(level);
+    return mCurrentLod;
+}
+
+int Batch::lodIndexCount() const
+{
+    return (mCurrentLod < mLodLevels.count()) ? mLodLevels[mCurrentLod].indexCount : mIndexCount;
+}
+
+int Batch::lodIndexOffset() const
+{
+    return mBufferIndexOffset + ((mCurrentLod < mLodLevels.count()) ? mLodLevels[mCurrentLod].indexOffset : 0);
+}
+
+Eigen::Vector3f Batch::boundingBoxMin() const
+{
+    if (mBoundsDirty) {
+        updateBounds();
+    }
+    return mBoundingBoxMin;
+}
+
+Eigen::Vector3f Batch::boundingBoxMax() const
+{
+    if (mBoundsDirty) {
+        updateBounds();
+    }
+    return mBoundingBoxMax;
+}
+
+Eigen::Vector3f Batch::boundingSphereCenter() const
+{
+    if (mBoundsDirty) {
+        updateBounds();
+    }
+    return mBoundingSphereCenter;
+}
+
+float Batch::boundingSphereRadius() const
+{
+    if (mBoundsDirty) {
+        updateBounds();
+    }
+    return mBoundingSphereRadius;
+}
+
+void Batch::updateBounds() const
+{
+    mBoundsDirty = false;
+    if (!mVertices || !mVertexCount) {
+        return;
+    }
+
+    const float* vertices = reinterpret_cast<const float*>(mVertices);
+    int components = qMin(mVertexSize, 3);
+    Eigen::Vector3f minpos(0, 0, 0), maxpos(0, 0, 0);
+    for (int c = 0; c < components; c++) {
+        minpos[c] = maxpos[c] = vertices[c];
+    }
+    for (int i = 1; i < mVertexCount; i++) {
+        const float* v = vertices + i * mVertexSize;
+        for (int c = 0; c < components; c++) {
+            minpos[c] = qMin(minpos[c], v[c]);
+            maxpos[c] = qMax(maxpos[c], v[c]);
+        }
+    }
+
+    // The sphere is centered on the bounding box, which is cheaper than the
+    //  minimal sphere and close enough for culling and LOD selection
+    mBoundingBoxMin = minpos;
+    mBoundingBoxMax = maxpos;
+    mBoundingSphereCenter = (minpos + maxpos) / 2;
+    float radius2 = 0;
+    for (int i = 0; i < mVertexCount; i++) {
+        const float* v = vertices + i * mVertexSize;
+        float d2 = 0;
+        for (int c = 0; c < components; c++) {
+            float d = v[c] - mBoundingSphereCenter[c];
+            d2 += d * d;
+        }
+        radius2 = qMax(radius2, d2);
+    }
+    mBoundingSphereRadius = sqrt(radius2);
+}
+
 void Batch::render()
 {
     bind();
@@ -123,17 +589,23 @@ void Batch::render()
 
 void Batch::bind()
 {
-    if (mDirty) {
-        update();
+    update();
+    if (mInstanceBuffer) {
+        // Uploading binds the instance buffer, so it's done before the
+        //  geometry is bound
+        mInstanceBuffer->setProgram(mAttributeProgram);
+        mInstanceBuffer->update();
     }
 
+    mBuffer->setProgram(mAttributeProgram);
+    mBuffer->setInstanceBuffer(mInstanceBuffer);
     mBuffer->bind();
 }
 
 void Batch::renderOnce()
 {
     if (mBuffer->format().isIndexed()) {
-        mBuffer->renderIndexedSubset(mIndexCount, mBufferIndexOffset);
+        mBuffer->renderIndexedSubset(lodIndexCount(), lodIndexOffset(), mBaseVertex);
     } else {
         mBuffer->renderSubset(mVertexCount, mBufferOffset);
     }
@@ -144,8 +616,40 @@ void Batch::unbind()
     mBuffer->unbind();
 }
 
+void Batch::renderInstanced(int count)
+{
+    bind();
+    renderOnceInstanced(count);
+    unbind();
+}
+
+void Batch::renderOnceInstanced(int count)
+{
+    bool emulate = !GeometryBuffer::isInstancingSupported() ||
+            (mInstanceBuffer && !InstanceBuffer::isDivisorSupported());
+    if (emulate) {
+        for (int i = 0; i < count; i++) {
+            if (mInstanceBuffer) {
+                mInstanceBuffer->setCurrentInstance(i);
+            }
+            renderOnce();
+        }
+        return;
+    }
+
+    if (mBuffer->format().isIndexed()) {
+        mBuffer->renderIndexedSubsetInstanced(lodIndexCount(), lodIndexOffset(), count, mBaseVertex);
+    } else {
+        mBuffer->renderSubsetInstanced(mVertexCount, mBufferOffset, count);
+    }
+}
+
 void Batch::setBuffer(GeometryBuffer* buffer, int offset, int indexOffset)
 {
+    if (mUploadQueue) {
+        // Pending data was prepared for the old location
+        mUploadQueue->cancel(this);
+    }
     if (mOwnBuffer) {
         delete mBuffer;
     }
@@ -155,18 +659,50 @@ void Batch::setBuffer(GeometryBuffer* buffer, int offset, int indexOffset)
     mBufferOffset = offset;
     mBufferIndexOffset = indexOffset;
 
-    mDirty = true;
+    markDirty(AllAttributes);
+}
+
+void Batch::setArena(GeometryArena* arena)
+{
+    if (arena == mArena) {
+        return;
+    }
+    if (mArena) {
+        mArena->releaseBatch(this);
+        mArena = 0;
+        setBuffer(0, 0, 0);
+    }
+    mArena = arena;
+    markDirty(AllAttributes);
 }
 
 GeometryBufferFormat Batch::bestBufferFormat() const
 {
-    GeometryBufferFormat bufferformat(mVertexCount, mIndices ? mIndexCount : 0);
+    GeometryBufferFormat bufferformat(mVertexCount, mIndexCount);
     bufferformat.addVertices(mVertexSize);
     bufferformat.addColors(mColorSize);
-    if (mNormals) {
+    if (mNormalSize) {
         bufferformat.addNormals();
     }
-    bufferformat.addTexCoords(mTexcoordSize);
+    for (int i = 0; i < mTexcoords.count(); i++) {
+        bufferformat.addTexCoords(i, mTexcoordSize[i]);
+    }
+    if (mCompactEncoding) {
+        bufferformat.setColorType(GL_UNSIGNED_BYTE);
+        if (GeometryBufferFormat::isTypeSupported(GL_INT_2_10_10_10_REV)) {
+            bufferformat.setNormalType(GL_INT_2_10_10_10_REV);
+        }
+        if (GeometryBufferFormat::isTypeSupported(GL_HALF_FLOAT)) {
+            bufferformat.setTexCoordType(GL_HALF_FLOAT);
+        }
+    }
+    foreach (const AttributeArray& attr, mAttributes) {
+        bufferformat.addAttribute(attr.name, attr.size, attr.type, attr.normalized);
+    }
+    bufferformat.setLayout(mBufferLayout);
+    bufferformat.setUsage(mBufferUsage);
+    bufferformat.setPrimitiveRestart(mPrimitiveRestart);
+    bufferformat.setIndexType(GeometryBufferFormat::bestIndexType(mVertexCount, mPrimitiveRestart));
 
     return bufferformat;
 }
@@ -179,14 +715,23 @@ GeometryBuffer* Batch::createSharedBuffer(const QList<Batch*>& batches)
 
     int vertexcount = 0;
     int indexcount = 0;
+    int maxvertexcount = 0;
     foreach (Batch* b, batches) {
         vertexcount += b->vertexCount();
         indexcount += b->indicesCount();
+        maxvertexcount = qMax(maxvertexcount, b->vertexCount());
     }
 
     GeometryBufferFormat format = batches.first()->bestBufferFormat();
     format.setVertexCount(vertexcount);
     format.setIndexCount(indexcount);
+    // With base vertex, indices are relative to the batch's own vertices.
+    //  Otherwise they're offset to point into the whole buffer.
+    if (GeometryBuffer::isBaseVertexSupported()) {
+        format.setIndexType(GeometryBufferFormat::bestIndexType(maxvertexcount, format.primitiveRestart()));
+    } else {
+        format.setIndexType(GeometryBufferFormat::bestIndexType(vertexcount, format.primitiveRestart()));
+    }
 
     GeometryBuffer* buffer = GeometryBuffer::createBuffer(format);
 
@@ -201,53 +746,192 @@ GeometryBuffer* Batch::createSharedBuffer(const QList<Batch*>& batches)
     return buffer;
 }
 
+namespace
+{
+// Returns pointer to the element at position first in an array of elements
+//  consisting of size floats.
+void* elementPointer(void* array, int size, int first)
+{
+    return reinterpret_cast<float*>(array) + size * first;
+}
+}
+
 void Batch::update()
 {
-    if (!mDirty) {
+    if (mUploadQueue) {
+        // Apply the prepared data before anything newer
+        mUploadQueue->finish(this);
+    }
+
+    UploadRange range;
+    if (!beginUpload(&range)) {
         return;
     }
 
-    mDirty = false;
+    //qDebug() << "Batch::update(): add data";
+    mBuffer->bind();
+    if (range.orphan) {
+        mBuffer->orphan();
+    }
+    writeData(mBuffer, range);
+    mBuffer->unbind();
+    uploadDone();
+    //qDebug() << "Batch::update(): all done";
+}
 
-    if (mOwnBuffer) {
-        //qDebug() << "Batch::update(): deleting old buffer";
-        delete mBuffer;
+void Batch::uploadDone()
+{
+    if (mReleaseData && !mDirtyAttributes && !mBuffer->isTransient()) {
+        // The bounds can't be computed anymore once the vertices are gone
+        if (mBoundsDirty) {
+            updateBounds();
+        }
+        releaseData();
+    }
+}
 
-        //qDebug() << "Batch::update(): create GeometryBufferFormat";
+bool Batch::beginUpload(UploadRange* range)
+{
+    // Transient buffers lose their contents every frame
+    if (mBuffer && mBuffer->isTransient()) {
+        markDirty(AllAttributes);
+    }
+    if (!mDirtyAttributes && mBuffer) {
+        return false;
+    }
+    if (mArena && !mArena->placeBatch(this)) {
+        // Use an internal buffer if the arena couldn't fit the batch
+        mArena = 0;
+        setBuffer(0, 0, 0);
+    }
 
-        //qDebug() << "Batch::update(): create GeometryBuffer";
-        mBuffer = GeometryBuffer::createBuffer(bestBufferFormat());
-        mBuffer->setPrimitiveType(mPrimitiveType);
+    range->orphan = false;
+    if (mOwnBuffer) {
+        GeometryBufferFormat format = bestBufferFormat();
+        if (!mBuffer || !mBuffer->format().canStore(format)) {
+            // Format or capacity has changed, so we need a new buffer
+            //qDebug() << "Batch::update(): deleting old buffer";
+            delete mBuffer;
+
+            //qDebug() << "Batch::update(): create GeometryBuffer";
+            mBuffer = GeometryBuffer::createBuffer(format);
+            mBuffer->setPrimitiveType(mPrimitiveType);
+            markDirty(AllAttributes);
+        } else {
+            // Attributes which are actually stored in the buffer. The others
+            //  never become dirty unless they're set, which also changes the
+            //  format.
+            const GeometryBufferFormat& stored = mBuffer->format();
+            int storedAttributes = 0;
+            if (stored.vertexSize()) {
+                storedAttributes |= Vertices;
+            }
+            if (stored.colorSize()) {
+                storedAttributes |= Colors;
+            }
+            if (stored.normalSize()) {
+                storedAttributes |= Normals;
+            }
+            for (int i = 0; i < stored.texCoordSetCount(); i++) {
+                if (stored.texCoordSize(i)) {
+                    storedAttributes |= Texcoords;
+                }
+            }
+            if (stored.attributeCount()) {
+                storedAttributes |= GenericAttributes;
+            }
+            bool indicesRewritten = !stored.isIndexed() ||
+                    ((mDirtyAttributes & Indices) && mDirtyIndexFirst <= 0 && mDirtyIndexEnd >= mIndexCount);
+            if ((mDirtyAttributes & storedAttributes) == storedAttributes && mDirtyVertexFirst <= 0 &&
+                    mDirtyVertexEnd >= mVertexCount && indicesRewritten) {
+                // The entire contents of the buffer will be rewritten, so let
+                //  the old storage go.
+                range->orphan = true;
+            }
+        }
     }
-    //qDebug() << "Batch::update(): add data";
-    mBuffer->bind();
-    mBuffer->addVertices(mVertices, mVertexCount, mBufferOffset);
-    if (mColors) {
-        mBuffer->addColors(mColors, mVertexCount, mBufferOffset);
+
+    // Clamp the dirty ranges to the actual data
+    range->first = qMax(mDirtyVertexFirst, 0);
+    range->count = qMin(mDirtyVertexEnd, mVertexCount) - range->first;
+    range->indexFirst = qMax(mDirtyIndexFirst, 0);
+    range->indexCount = qMin(mDirtyIndexEnd, mIndexCount) - range->indexFirst;
+    range->attributes = mDirtyAttributes;
+    range->bufferOffset = mBufferOffset;
+    range->bufferIndexOffset = mBufferIndexOffset;
+    // If our vertices have offset, then we must add this offset to every
+    //  index unless the offset can be applied when rendering.
+    range->offsetIndices = mBufferOffset && !GeometryBuffer::isBaseVertexSupported();
+
+    mDirtyAttributes = 0;
+    mDirtyVertexFirst = mDirtyVertexEnd = 0;
+    mDirtyIndexFirst = mDirtyIndexEnd = 0;
+
+    if (hasReleasedData() && (range->count > 0 || range->indexCount > 0)) {
+        qCritical() << "Batch::update(): data has been released, buffer contents will be incomplete";
     }
-    if (mNormals) {
-        mBuffer->addNormals(mNormals, mVertexCount, mBufferOffset);
+    if (mIndices && (range->attributes & Indices) && range->indexCount > 0) {
+        mBaseVertex = range->offsetIndices ? 0 : mBufferOffset;
     }
-    if (mTexcoords) {
-        mBuffer->addTexCoords(mTexcoords, mVertexCount, mBufferOffset);
+    return true;
+}
+
+void Batch::writeData(GeometryBuffer* target, const UploadRange& range) const
+{
+    const int first = range.first;
+    const int count = range.count;
+    const int dirty = range.attributes;
+    const int offset = range.bufferOffset + first;
+    if (count > 0) {
+        if (mVertices && (dirty & Vertices)) {
+            target->addVertices(elementPointer(mVertices, mVertexSize, first), count, offset);
+        }
+        if (mColors && (dirty & Colors)) {
+            target->addColors(elementPointer(mColors, mColorSize, first), count, offset);
+        }
+        if (mNormals && (dirty & Normals)) {
+            target->addNormals(elementPointer(mNormals, mNormalSize, first), count, offset);
+        }
+        if (dirty & Texcoords) {
+            for (int i = 0; i < mTexcoords.count(); i++) {
+                if (mTexcoords[i]) {
+                    target->addTexCoords(i, elementPointer(mTexcoords[i], mTexcoordSize[i], first), count, offset);
+                }
+            }
+        }
+        if (dirty & GenericAttributes) {
+            foreach (const AttributeArray& attr, mAttributes) {
+                int index = target->format().attributeIndex(attr.name);
+                if (index < 0) {
+                    qCritical() << "Batch::update(): buffer has no attribute" << attr.name;
+                    continue;
+                }
+                int elemsize = GeometryBufferFormat::elementSize(attr.size, attr.type);
+                void* data = reinterpret_cast<char*>(attr.data) + elemsize * first;
+                target->addAttribute(index, data, count, offset);
+            }
+        }
     }
-    if (mIndices) {
-        if (mBufferOffset) {
-            // If our vertices have offset, then we must add this offset to every index.
+    if (mIndices && (dirty & Indices) && range.indexCount > 0) {
+        const int indexCount = range.indexCount;
+        unsigned int* indices = reinterpret_cast<unsigned int*>(mIndices) + range.indexFirst;
+        if (range.offsetIndices) {
             // Create temporary index array
-            unsigned int* offsetIndices = new unsigned int[mIndexCount];
-            for (int i = 0; i < mIndexCount; i++) {
-                offsetIndices[i] = reinterpret_cast<unsigned int*>(mIndices)[i] + mBufferOffset;
+            unsigned int* offsetIndices = new unsigned int[indexCount];
+            for (int i = 0; i < indexCount; i++) {
+                if (mPrimitiveRestart && indices[i] == GeometryBufferFormat::RestartIndex) {
+                    offsetIndices[i] = indices[i];
+                } else {
+                    offsetIndices[i] = indices[i] + range.bufferOffset;
+                }
             }
-            mBuffer->addIndices(offsetIndices, mIndexCount, mBufferIndexOffset);
+            target->addIndices(offsetIndices, indexCount, range.bufferIndexOffset + range.indexFirst);
             delete[] offsetIndices;
         } else {
-            mBuffer->addIndices(reinterpret_cast<unsigned int*>(mIndices), mIndexCount, mBufferIndexOffset);
+            // Indices are stored as they are, the offset is applied when rendering
+            target->addIndices(indices, indexCount, range.bufferIndexOffset + range.indexFirst);
         }
     }
-    mBuffer->unbind();
-    //qDebug() << "Batch::update(): all done";
 }
 
 }
-
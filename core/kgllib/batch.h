@@ -21,14 +21,21 @@
 #include "kgllib.h"
 #include "geometrybuffer.h"
 
+#include <QtCore/QHash>
 #include <QtCore/QList>
+#include <QtCore/QString>
+#include <QtCore/QVector>
 
 #include <Eigen/Core>
 
 
 namespace KGLLib
 {
+class GeometryArena;
 class GeometryBuffer;
+class InstanceBuffer;
+class Program;
+class UploadQueue;
 
 /**
  * @brief A set of geometry.
@@ -97,11 +104,37 @@ class GeometryBuffer;
  * models.first()-> unbind();
  * @endcode
  *
- * @see Mesh, GeometryBuffer
+ * If base vertex rendering is supported (see
+ *  @ref GeometryBuffer::isBaseVertexSupported()), indices are stored in the
+ *  shared buffer as they are and the batch's vertex offset is applied when
+ *  rendering. Thus batches with different vertex offsets can share the same
+ *  index data by using the same index offset. Otherwise the vertex offset is
+ *  added to every index when the data is uploaded.
+ *
+ * To render many batches sharing a buffer with a single draw call, see
+ *  @ref BatchGroup.
+ *
+ * @see Mesh, GeometryBuffer, BatchGroup
  **/
 class KGLLIB_EXPORT Batch
 {
 public:
+    /**
+     * Kinds of data stored in a Batch.
+     *
+     * @see markDirty()
+     **/
+    enum Attribute
+    {
+        Vertices  = 1 << 0,
+        Colors    = 1 << 1,
+        Normals   = 1 << 2,
+        Texcoords = 1 << 3,
+        Indices   = 1 << 4,
+        GenericAttributes = 1 << 5,
+        AllAttributes = Vertices | Colors | Normals | Texcoords | Indices | GenericAttributes
+    };
+
     /**
      * Constructs new Batch object.
      *
@@ -154,6 +187,49 @@ public:
      */
     virtual void unbind();
 
+    /**
+     * Renders @p count instances of the batch.
+     *
+     * This is same as calling first @ref bind(), then
+     *  @ref renderOnceInstanced() and finally @ref unbind().
+     **/
+    virtual void renderInstanced(int count);
+    /**
+     * Renders @p count instances of the batch without doing bind and unbind
+     *  operations on the geometry buffer.
+     *
+     * If instanced rendering is supported, all instances are rendered using
+     *  a single draw call and per-instance attributes from the
+     *  @ref InstanceBuffer (if any) are advanced once per instance. Otherwise
+     *  the instances are rendered one by one.
+     **/
+    virtual void renderOnceInstanced(int count);
+
+    /**
+     * Sets the Program used to look up locations of generic vertex
+     *  attributes and per-instance attributes to @p program.
+     *
+     * @ref Mesh sets this automatically to its program.
+     **/
+    void setAttributeProgram(Program* program)  { mAttributeProgram = program; }
+    /**
+     * @return Program used to look up attribute locations.
+     **/
+    Program* attributeProgram() const  { return mAttributeProgram; }
+
+    /**
+     * Sets the InstanceBuffer containing per-instance attributes used by
+     *  @ref renderInstanced() to @p instances.
+     *
+     * The batch doesn't take ownership of the InstanceBuffer, so it can be
+     *  shared between multiple batches.
+     **/
+    void setInstanceBuffer(InstanceBuffer* instances)  { mInstanceBuffer = instances; }
+    /**
+     * @return InstanceBuffer used by this batch.
+     **/
+    InstanceBuffer* instanceBuffer() const  { return mInstanceBuffer; }
+
     /**
      * Set the number of vertices in the batch to @p count.
      * Each specified array must contain at least @p count entries (if they
@@ -175,6 +251,10 @@ public:
      * @return array of vertices used for this batch
      **/
     const void* verticesArray() const  { return mVertices; }
+    /**
+     * @return number of components of each vertex
+     **/
+    int vertexSize() const  { return mVertexSize; }
     /**
      * Sets the per-vertex colors array to @p colors.
      **/
@@ -195,14 +275,41 @@ public:
     /**
      * Sets the texture coordinates array to @p texcoords.
      **/
-    void setTexcoords(float* texcoords)  { setTexcoords(texcoords, 1); }
-    void setTexcoords(Eigen::Vector2f* texcoords)  { setTexcoords(texcoords, 2); }
-    void setTexcoords(Eigen::Vector3f* texcoords)  { setTexcoords(texcoords, 3); }
-    void setTexcoords(Eigen::Vector4f* texcoords)  { setTexcoords(texcoords, 4); }
+    void setTexcoords(float* texcoords)  { setTexcoords(0, texcoords, 1); }
+    void setTexcoords(Eigen::Vector2f* texcoords)  { setTexcoords(0, texcoords, 2); }
+    void setTexcoords(Eigen::Vector3f* texcoords)  { setTexcoords(0, texcoords, 3); }
+    void setTexcoords(Eigen::Vector4f* texcoords)  { setTexcoords(0, texcoords, 4); }
+    /**
+     * Sets the texture coordinates array used for texture unit @p unit to
+     *  @p texcoords.
+     *
+     * This makes it possible to e.g. render a lightmapped mesh in a single
+     *  pass, using different coordinates for the base texture and the
+     *  lightmap (see @ref Mesh::setTexture()).
+     **/
+    void setTexcoords(int unit, float* texcoords)  { setTexcoords(unit, texcoords, 1); }
+    void setTexcoords(int unit, Eigen::Vector2f* texcoords)  { setTexcoords(unit, texcoords, 2); }
+    void setTexcoords(int unit, Eigen::Vector3f* texcoords)  { setTexcoords(unit, texcoords, 3); }
+    void setTexcoords(int unit, Eigen::Vector4f* texcoords)  { setTexcoords(unit, texcoords, 4); }
     /**
-     * @return array of texture coordinates used for this batch
+     * @return array of texture coordinates used for texture unit @p unit
      **/
-    const void* texcoordsArray() const  { return mTexcoords; }
+    const void* texcoordsArray(int unit = 0) const;
+    /**
+     * Sets the array of the generic vertex attribute with the given name to
+     *  @p data. If @p data is 0, the attribute is removed.
+     *
+     * Generic attributes are accessed by name in the vertex shader. See
+     *  @ref GeometryBufferFormat::addAttribute() for description of the
+     *  parameters. Note that the attribute locations are looked up in the
+     *  program set using @ref setAttributeProgram().
+     **/
+    void setAttribute(const QString& name, void* data, int size, GLenum type = GL_FLOAT, bool normalized = false);
+    /**
+     * @return array of the generic vertex attribute with the given name, or 0
+     *  if there's no such attribute.
+     **/
+    const void* attributeArray(const QString& name) const;
     /**
      * Sets the indices array to @p indices. The array must contain at least
      *  @p count entries (if it contains more, then the remaining ones will be
@@ -213,11 +320,184 @@ public:
      * @return array of indices used for this batch
      **/
     const void* indicesArray() const  { return mIndices; }
+
+    /**
+     * Sets the vertices array to @p vertices and the vertex count to its
+     *  size.
+     *
+     * Unlike the pointer variants, these methods make the batch own the data,
+     *  so the caller doesn't have to keep it alive. QVector is implicitly
+     *  shared, so nothing is copied: if the caller lets go of its own copy,
+     *  the batch is the only owner of the data.
+     **/
+    void setVertices(const QVector<Eigen::Vector2f>& vertices);
+    void setVertices(const QVector<Eigen::Vector3f>& vertices);
+    /**
+     * Sets the per-vertex colors array to @p colors, which is owned by the
+     *  batch.
+     **/
+    void setColors(const QVector<Eigen::Vector3f>& colors);
+    /**
+     * Sets the normals array to @p normals, which is owned by the batch.
+     **/
+    void setNormals(const QVector<Eigen::Vector3f>& normals);
+    /**
+     * Sets the texture coordinates array used for texture unit @p unit to
+     *  @p texcoords, which is owned by the batch.
+     **/
+    void setTexcoords(const QVector<Eigen::Vector2f>& texcoords)  { setTexcoords(0, texcoords); }
+    void setTexcoords(int unit, const QVector<float>& texcoords);
+    void setTexcoords(int unit, const QVector<Eigen::Vector2f>& texcoords);
+    void setTexcoords(int unit, const QVector<Eigen::Vector3f>& texcoords);
+    /**
+     * Sets the indices array to @p indices and the index count to its size.
+     * The array is owned by the batch.
+     **/
+    void setIndices(const QVector<unsigned int>& indices);
+
+    /**
+     * Sets whether the arrays owned by the batch are released once their
+     *  data has been uploaded into a GeometryBuffer. This way the data only
+     *  stays in the GPU memory.
+     *
+     * Arrays given as pointers aren't owned by the batch and are thus never
+     *  released.
+     *
+     * Note that once the data is released, it can't be uploaded again. So
+     *  the batch's format and vertex count must not change, it can't be moved
+     *  to another buffer and it can't use a transient buffer (see
+     *  @ref GeometryBuffer::isTransient()). Set new arrays if you need to do
+     *  any of those.
+     **/
+    void setReleaseDataAfterUpload(bool release)  { mReleaseData = release; }
+    /**
+     * @return whether owned arrays are released after upload.
+     **/
+    bool releaseDataAfterUpload() const  { return mReleaseData; }
+    /**
+     * Releases all arrays owned by the batch. The corresponding array
+     *  pointers are reset to 0, but the batch keeps its format.
+     **/
+    void releaseData();
+    /**
+     * @return whether some of the data of this batch has been released
+     *  using @ref releaseData().
+     **/
+    bool hasReleasedData() const;
+    /**
+     * Reorders the vertices so that old vertex i becomes vertex @p remap[i],
+     *  e.g. using the table returned by
+     *  @ref MeshOptimizer::optimizeVertexFetch(). Indices aren't changed.
+     *
+     * Only arrays owned by the batch can be reordered, so nothing is done if
+     *  some vertex array was given as a pointer or generic attributes are
+     *  used.
+     *
+     * @return whether the vertices were reordered.
+     **/
+    bool remapVertices(const QVector<unsigned int>& remap);
     /**
      * @return number of indices in this batch
      **/
     int indicesCount() const  { return mIndexCount; }
 
+    /**
+     * A level of detail, which is a range of the indices array.
+     **/
+    struct LodLevel
+    {
+        int indexOffset;
+        int indexCount;
+        /**
+         * Largest distance between the level's surface and the full detail
+         *  one, in object space units.
+         **/
+        float error;
+    };
+    /**
+     * Generates @p levelCount levels of detail by simplifying the batch's
+     *  triangles (see @ref MeshOptimizer::simplify()). Each level has about
+     *  @p reduction times the triangles of the previous one.
+     *
+     * All levels use the same vertices, their indices are stored one after
+     *  another in a new indices array, full detail level first. Fewer levels
+     *  are created if the mesh can't be simplified further.
+     *
+     * Only batches with indexed GL_TRIANGLES geometry can be simplified.
+     *
+     * @return number of created levels, including the full detail one.
+     **/
+    int generateLods(int levelCount = 4, float reduction = 0.5f);
+    /**
+     * Sets the levels of detail of this batch. The levels must be sorted by
+     *  their error, full detail level first.
+     * Setting the indices removes all levels.
+     **/
+    void setLodLevels(const QList<LodLevel>& levels);
+    /**
+     * @return levels of detail of this batch.
+     **/
+    QList<LodLevel> lodLevels() const  { return mLodLevels; }
+    /**
+     * @return number of levels of detail. Batches without levels of detail
+     *  return 0.
+     **/
+    int lodCount() const  { return mLodLevels.count(); }
+    /**
+     * Sets the level of detail used for rendering, 0 being full detail.
+     **/
+    void setCurrentLod(int level);
+    /**
+     * @return level of detail used for rendering.
+     **/
+    int currentLod() const  { return mCurrentLod; }
+    /**
+     * Selects the coarsest level of detail whose error is at most
+     *  @ref lodPixelError() pixels on screen.
+     *
+     * @param projectedSize size of the batch's bounding sphere on screen, in
+     *  pixels (see @ref Camera::projectedSize()).
+     * @return selected level.
+     **/
+    int selectLod(float projectedSize);
+    /**
+     * Sets the largest error, in pixels, which is allowed when selecting the
+     *  level of detail. Default value is 1.
+     **/
+    void setLodPixelError(float pixels)  { mLodPixelError = pixels; }
+    float lodPixelError() const  { return mLodPixelError; }
+    /**
+     * @return number of indices rendered for the current level of detail.
+     **/
+    int lodIndexCount() const;
+    /**
+     * @return offset of the current level of detail's indices in the buffer.
+     **/
+    int lodIndexOffset() const;
+
+    /**
+     * @return minimum corner of the batch's axis-aligned bounding box in
+     *  object space.
+     *
+     * The bounds are computed from the vertices when they're needed and kept
+     *  until the vertices change. If the batch releases its data after
+     *  uploading (see @ref setReleaseDataAfterUpload()), the bounds are
+     *  computed before that and remain valid.
+     **/
+    Eigen::Vector3f boundingBoxMin() const;
+    /**
+     * @return maximum corner of the batch's axis-aligned bounding box.
+     **/
+    Eigen::Vector3f boundingBoxMax() const;
+    /**
+     * @return center of the batch's bounding sphere in object space.
+     **/
+    Eigen::Vector3f boundingSphereCenter() const;
+    /**
+     * @return radius of the batch's bounding sphere.
+     **/
+    float boundingSphereRadius() const;
+
     /**
      * Sets the primitive type used to render this batch (e.g. GL_QUADS).
      *
@@ -228,6 +508,40 @@ public:
      * @return OpenGL primitive mode used to render this batch.
      **/
     GLenum primitiveType() const;
+    /**
+     * Enables primitive restart for this batch's indices, so that
+     *  @ref GeometryBufferFormat::RestartIndex can be used in the indices
+     *  array to start a new primitive, e.g. a new triangle strip.
+     *
+     * Check @ref GeometryBuffer::isPrimitiveRestartSupported() before using
+     *  it, otherwise the restart indices are rendered as ordinary indices.
+     *
+     * Default value is false.
+     **/
+    void setPrimitiveRestart(bool restart);
+    /**
+     * @return whether primitive restart is enabled.
+     **/
+    bool primitiveRestart() const  { return mPrimitiveRestart; }
+
+    /**
+     * Tells the batch that contents of some of its arrays have changed.
+     *
+     * Batch doesn't make copies of the arrays given to it, so if you modify
+     *  an array in-place, you need to call this method to get the changes to
+     *  the GeometryBuffer. Only the changed parts are uploaded on the next
+     *  @ref update().
+     *
+     * @param attributes combination of @ref Attribute flags specifying which
+     *  arrays have changed.
+     * @param first first changed element. For vertex attributes this is a
+     *  vertex index, for @ref Indices it is a position in the indices array.
+     * @param count number of changed elements. If it's negative, then all
+     *  elements starting from @p first have changed.
+     *
+     * Note that the range is shared between all vertex attributes.
+     **/
+    void markDirty(int attributes, int first = 0, int count = -1);
 
     /**
      * Updates the used GeometryBuffer if something has changed.
@@ -235,6 +549,16 @@ public:
      * This method is automatically called from @ref bind() in case something
      *  has changed, but you can also call it manually to remove the delay at
      *  first rendering.
+     *
+     * Only the attributes and ranges which have changed are uploaded (see
+     *  @ref markDirty()). An internal buffer is only recreated when the format
+     *  changes or the data doesn't fit into it anymore. If all of its contents
+     *  are rewritten then it is orphaned (see @ref GeometryBuffer::orphan())
+     *  first, so that the update doesn't have to wait until the GPU has
+     *  finished using the old data.
+     *
+     * If the batch has data pending in an @ref UploadQueue, then the batch
+     *  waits for it and uploads it first.
      **/
     virtual void update();
 
@@ -259,6 +583,19 @@ public:
      * @param indexOffset offset for the index data in the buffer.
      **/
     void setBuffer(GeometryBuffer* buffer, int offset, int indexOffset);
+    /**
+     * @return offset of this batch's vertex data in the buffer.
+     **/
+    int bufferOffset() const  { return mBufferOffset; }
+    /**
+     * @return offset of this batch's index data in the buffer.
+     **/
+    int bufferIndexOffset() const  { return mBufferIndexOffset; }
+    /**
+     * @return base vertex used when rendering this batch's indices (see
+     *  @ref GeometryBuffer::renderIndexedSubset()).
+     **/
+    int baseVertex() const  { return mBaseVertex; }
 
     /**
      * Returns GeometryBufferFormat object that could be used to create a
@@ -269,6 +606,57 @@ public:
      **/
     GeometryBufferFormat bestBufferFormat() const;
 
+    /**
+     * Sets the layout used for the vertex data in the internal buffer.
+     *
+     * Interleaved layout usually renders faster, especially for large
+     *  batches with many attributes, but partial updates of a single
+     *  attribute are more expensive. Default is
+     *  @ref GeometryBufferFormat::Planar.
+     *
+     * This is also used by @ref bestBufferFormat(), thus it affects shared
+     *  buffers created by @ref createSharedBuffer() as well.
+     **/
+    void setBufferLayout(GeometryBufferFormat::Layout layout);
+    /**
+     * @return layout used for the vertex data.
+     **/
+    GeometryBufferFormat::Layout bufferLayout() const  { return mBufferLayout; }
+
+    /**
+     * Sets the usage hint for the internal buffer.
+     *
+     * If you change the batch's data often (e.g. every frame), use
+     *  @ref GeometryBufferFormat::DynamicUsage or
+     *  @ref GeometryBufferFormat::StreamUsage. Default is
+     *  @ref GeometryBufferFormat::StaticUsage.
+     **/
+    void setBufferUsage(GeometryBufferFormat::Usage usage);
+    /**
+     * @return usage hint for the internal buffer.
+     **/
+    GeometryBufferFormat::Usage bufferUsage() const  { return mBufferUsage; }
+
+    /**
+     * Sets whether compact types should be used to store the data in the
+     *  buffer.
+     *
+     * If enabled, colors are stored as normalized bytes, normals are packed
+     *  into GL_INT_2_10_10_10_REV and texture coordinates are stored as half
+     *  floats, where supported by the hardware. The data is converted
+     *  automatically when it's uploaded. Vertices are always stored as
+     *  floats since half floats are too imprecise for most models.
+     *
+     * Default is false.
+     *
+     * @see GeometryBufferFormat::setColorType()
+     **/
+    void setCompactEncoding(bool compact);
+    /**
+     * @return whether compact types are used to store the data.
+     **/
+    bool compactEncoding() const  { return mCompactEncoding; }
+
     /**
      * Creates a GeometryBuffer object shared by the given list of Batch
      *  objects.
@@ -282,37 +670,152 @@ public:
      **/
     static GeometryBuffer* createSharedBuffer(const QList<Batch*>& batches);
 
+    /**
+     * Makes this batch allocate its buffer space from the given
+     *  @ref GeometryArena. The space is allocated the next time the batch is
+     *  updated and reallocated whenever the format or size of the data
+     *  changes.
+     *
+     * If @p arena is 0, then the batch releases its space in the current arena
+     *  and goes back to using an internal buffer.
+     **/
+    void setArena(GeometryArena* arena);
+    /**
+     * @return GeometryArena used by this batch.
+     **/
+    GeometryArena* arena() const  { return mArena; }
+
+    /**
+     * @return whether the batch's data is being prepared for upload by an
+     *  @ref UploadQueue.
+     * Rendering such batch makes it wait until the data is ready.
+     **/
+    bool isUploadPending() const  { return mUploadQueue != 0; }
+
 protected:
     void setVertices(void* vertices, int size);
     void setColors(void* colors, int size);
-    void setTexcoords(void* texcoords, int size);
+    void setTexcoords(void* texcoords, int size)  { setTexcoords(0, texcoords, size); }
+    void setTexcoords(int unit, void* texcoords, int size);
 
     void init();
 
+    /**
+     * Called after an @ref UploadQueue has uploaded the data of this batch.
+     * The default implementation does nothing.
+     **/
+    virtual void uploadFinished()  {}
+
+    // Called after data has been uploaded, releases the owned arrays if
+    //  requested
+    void uploadDone();
+    // Recomputes the bounding volumes from the vertices
+    void updateBounds() const;
+
+    // Dirty ranges taken from the batch for a single upload
+    struct UploadRange
+    {
+        int first;
+        int count;
+        int indexFirst;
+        int indexCount;
+        // Combination of Attribute flags
+        int attributes;
+        int bufferOffset;
+        int bufferIndexOffset;
+        // Whether bufferOffset is added to the indices
+        bool offsetIndices;
+        // Whether the old storage can be discarded before uploading
+        bool orphan;
+    };
+    // Creates or reallocates the buffer if necessary and takes the dirty
+    //  ranges. Must be called from the rendering thread. Returns false if
+    //  there's nothing to upload.
+    bool beginUpload(UploadRange* range);
+    // Writes the data of the given range into target. Doesn't use any GL
+    //  state of its own, so it can also be used from other threads.
+    void writeData(GeometryBuffer* target, const UploadRange& range) const;
+
 private:
+    friend class UploadQueue;
+
     // Pointers to corresponding arrays
     void* mVertices;
     void* mColors;
     void* mNormals;
-    void* mTexcoords;
+    // One texcoords array per texture unit
+    QVector<void*> mTexcoords;
     // How many float components does each element have
     int mVertexSize;
     int mColorSize;
     int mNormalSize;
-    int mTexcoordSize;
+    QVector<int> mTexcoordSize;
     // Indices array
     void* mIndices;
+    // Arrays owned by the batch, keyed by slot (see texcoordSlot())
+    struct OwnedArray
+    {
+        virtual ~OwnedArray()  {}
+        virtual void* data() const = 0;
+    };
+    template<typename T> struct OwnedVector : public OwnedArray
+    {
+        OwnedVector(const QVector<T>& v) : vector(v)  {}
+        virtual void* data() const  { return const_cast<T*>(vector.constData()); }
+        QVector<T> vector;
+    };
+    QHash<int, OwnedArray*> mOwnedArrays;
+    bool mReleaseData;
+    template<typename T> void* adoptArray(int slot, const QVector<T>& vector);
+    // Deletes the owned array of the slot unless it holds the given data
+    void releaseArray(int slot, void* keep = 0);
+    void*& arrayPointer(int slot);
+    static int texcoordSlot(int unit)  { return Texcoords | (unit << 8); }
+    // Generic vertex attributes
+    struct AttributeArray
+    {
+        QString name;
+        void* data;
+        int size;
+        GLenum type;
+        bool normalized;
+    };
+    QList<AttributeArray> mAttributes;
+    Program* mAttributeProgram;
 
     int mVertexCount;
     int mIndexCount;
 
-    bool mDirty;
+    QList<LodLevel> mLodLevels;
+    int mCurrentLod;
+    float mLodPixelError;
+    // Bounding volumes are computed lazily
+    mutable bool mBoundsDirty;
+    mutable Eigen::Vector3f mBoundingBoxMin;
+    mutable Eigen::Vector3f mBoundingBoxMax;
+    mutable Eigen::Vector3f mBoundingSphereCenter;
+    mutable float mBoundingSphereRadius;
+
+    // Combination of Attribute flags that need to be uploaded
+    int mDirtyAttributes;
+    // Ranges of vertices and indices that need to be uploaded ([first; end[)
+    int mDirtyVertexFirst, mDirtyVertexEnd;
+    int mDirtyIndexFirst, mDirtyIndexEnd;
     GLenum mPrimitiveType;
+    bool mPrimitiveRestart;
+    GeometryBufferFormat::Layout mBufferLayout;
+    GeometryBufferFormat::Usage mBufferUsage;
+    bool mCompactEncoding;
 
     GeometryBuffer* mBuffer;
     int mBufferOffset;
     int mBufferIndexOffset;
+    // Base vertex used for indexed rendering, see GeometryBuffer::renderIndexedSubset()
+    int mBaseVertex;
     bool mOwnBuffer;
+    GeometryArena* mArena;
+    UploadQueue* mUploadQueue;
+    InstanceBuffer* mInstanceBuffer;
 };
 
 }
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "batchgroup.h"
+
+#include "batch.h"
+#include "camera.h"
+#include "geometrybuffer.h"
+
+#include <QtDebug>
+
+
+namespace KGLLib
+{
+
+BatchGroup::BatchGroup()
+{
+    mCamera = 0;
+    mFrustumCulling = false;
+}
+
+BatchGroup::BatchGroup(const QList<Batch*>& batches)
+{
+    mCamera = 0;
+    mFrustumCulling = false;
+    foreach (Batch* b, batches) {
+        addBatch(b);
+    }
+}
+
+BatchGroup::~BatchGroup()
+{
+}
+
+void BatchGroup::addBatch(Batch* batch)
+{
+    if (!mBatches.isEmpty() && batch->buffer() != buffer()) {
+        qCritical() << "BatchGroup::addBatch(): batch doesn't use the same buffer as the group";
+        return;
+    }
+    mBatches.append(batch);
+}
+
+void BatchGroup::removeBatch(Batch* batch)
+{
+    mBatches.removeAll(batch);
+}
+
+void BatchGroup::clear()
+{
+    mBatches.clear();
+}
+
+GeometryBuffer* BatchGroup::buffer() const
+{
+    if (mBatches.isEmpty()) {
+        return 0;
+    }
+    return mBatches.first()->buffer();
+}
+
+void BatchGroup::render()
+{
+    bind();
+    renderOnce();
+    unbind();
+}
+
+void BatchGroup::bind()
+{
+    if (mBatches.isEmpty()) {
+        return;
+    }
+    // Each batch uploads its own part of the shared buffer if necessary
+    foreach (Batch* b, mBatches) {
+        b->update();
+    }
+    buffer()->bind();
+}
+
+void BatchGroup::renderOnce()
+{
+    renderOnce(mBatches);
+}
+
+void BatchGroup::renderOnce(const QList<Batch*>& batches)
+{
+    GeometryBuffer* buf = buffer();
+    if (!buf || batches.isEmpty()) {
+        return;
+    }
+
+    bool cull = mFrustumCulling && mCamera;
+    mCounts.resize(batches.count());
+    mOffsets.resize(batches.count());
+    int count = 0;
+    if (buf->format().isIndexed()) {
+        mBaseVertices.resize(batches.count());
+        bool useBaseVertices = false;
+        foreach (Batch* b, batches) {
+            if (cull && !mCamera->isBoxVisible(b->boundingBoxMin(), b->boundingBoxMax())) {
+                continue;
+            }
+            mCounts[count] = b->lodIndexCount();
+            mOffsets[count] = b->lodIndexOffset();
+            mBaseVertices[count] = b->baseVertex();
+            useBaseVertices = useBaseVertices || mBaseVertices[count];
+            count++;
+        }
+        if (count) {
+            buf->renderIndexedSubsets(mCounts.data(), mOffsets.data(), useBaseVertices ? mBaseVertices.data() : 0, count);
+        }
+    } else {
+        foreach (Batch* b, batches) {
+            if (cull && !mCamera->isBoxVisible(b->boundingBoxMin(), b->boundingBoxMax())) {
+                continue;
+            }
+            mCounts[count] = b->vertexCount();
+            mOffsets[count] = b->bufferOffset();
+            count++;
+        }
+        if (count) {
+            buf->renderSubsets(mCounts.data(), mOffsets.data(), count);
+        }
+    }
+}
+
+void BatchGroup::unbind()
+{
+    if (mBatches.isEmpty()) {
+        return;
+    }
+    buffer()->unbind();
+}
+
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KGLLIB_BATCHGROUP_H
+#define KGLLIB_BATCHGROUP_H
+
+#include "kgllib.h"
+
+#include <QtCore/QList>
+#include <QtCore/QVector>
+
+
+namespace KGLLib
+{
+class Batch;
+class Camera;
+class GeometryBuffer;
+
+/**
+ * @brief Renders multiple batches sharing a buffer with a single draw call.
+ *
+ * BatchGroup contains a list of Batch objects which all use the same shared
+ *  @ref GeometryBuffer (e.g. one created by @ref Batch::createSharedBuffer())
+ *  and the same primitive type. When rendering, the vertex/index ranges of the
+ *  batches are gathered and submitted using a single glMultiDrawElements() or
+ *  glMultiDrawArrays() call instead of one draw call per batch.
+ *
+ * @code
+ * Batch::createSharedBuffer(models);
+ * BatchGroup* group = new BatchGroup(models);
+ * ...
+ * // In your rendering loop:
+ * group->render();
+ * @endcode
+ *
+ * If only some of the batches should be rendered, use
+ *  @ref renderOnce(const QList<Batch*>&) between @ref bind() and
+ *  @ref unbind(). Batches outside of the view frustum can also be skipped
+ *  automatically by setting a camera and enabling frustum culling, see
+ *  @ref setFrustumCulling().
+ *
+ * BatchGroup doesn't take ownership of the batches.
+ *
+ * @see Batch, GeometryBuffer::renderIndexedSubsets()
+ **/
+class KGLLIB_EXPORT BatchGroup
+{
+public:
+    /**
+     * Constructs an empty BatchGroup.
+     **/
+    BatchGroup();
+    /**
+     * Constructs a BatchGroup containing the given batches.
+     **/
+    BatchGroup(const QList<Batch*>& batches);
+    virtual ~BatchGroup();
+
+    /**
+     * Adds @p batch to this group.
+     * The batch must use the same buffer as other batches in the group.
+     **/
+    void addBatch(Batch* batch);
+    /**
+     * Removes @p batch from this group.
+     **/
+    void removeBatch(Batch* batch);
+    /**
+     * Removes all batches from this group.
+     **/
+    void clear();
+    /**
+     * @return list of batches in this group.
+     **/
+    const QList<Batch*>& batches() const  { return mBatches; }
+
+    /**
+     * @return GeometryBuffer shared by the batches, or 0 if the group is
+     *  empty.
+     **/
+    GeometryBuffer* buffer() const;
+
+    /**
+     * Sets the camera used for frustum culling. The batches' vertices are
+     *  assumed to be in the world coordinates of the camera.
+     **/
+    void setCamera(KGLLib::Camera* camera)  { mCamera = camera; }
+    /**
+     * @return camera used for frustum culling
+     **/
+    KGLLib::Camera* camera() const  { return mCamera; }
+    /**
+     * Enables or disables frustum culling. If it's enabled and a camera is
+     *  set, batches whose bounding box is outside the camera's view frustum
+     *  are left out of the draw call.
+     *
+     * Default value is false.
+     **/
+    void setFrustumCulling(bool enabled)  { mFrustumCulling = enabled; }
+    /**
+     * @return whether frustum culling is enabled.
+     **/
+    bool frustumCulling() const  { return mFrustumCulling; }
+
+    /**
+     * Renders all batches in the group.
+     *
+     * This is same as calling first @ref bind(), then @ref renderOnce() and
+     *  finally @ref unbind().
+     **/
+    virtual void render();
+
+    /**
+     * Updates all batches in the group and binds the shared buffer.
+     **/
+    virtual void bind();
+    /**
+     * Renders all batches in the group without binding or unbinding the
+     *  buffer.
+     **/
+    virtual void renderOnce();
+    /**
+     * Renders the given batches without binding or unbinding the buffer.
+     * All of them must use the same buffer as this group.
+     **/
+    virtual void renderOnce(const QList<Batch*>& batches);
+    /**
+     * Unbinds the shared buffer.
+     **/
+    virtual void unbind();
+
+private:
+    QList<Batch*> mBatches;
+    KGLLib::Camera* mCamera;
+    bool mFrustumCulling;
+
+    // Per-draw parameters, kept around to avoid reallocating every frame
+    QVector<int> mCounts;
+    QVector<int> mOffsets;
+    QVector<int> mBaseVertices;
+};
+
+}
+
+#endif
@@ -17,15 +17,178 @@
 
 #include "camera.h"
 
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QRunnable>
+#include <QtCore/QThreadPool>
+#include <QtCore/QWaitCondition>
+
+#include <float.h>
 #include <math.h>
 
 #include <Eigen/LU>
 
+#ifdef EIGEN_VECTORIZE_SSE
+#include <xmmintrin.h>
+#endif
+
 using namespace Eigen;
 
 namespace KGLLib
 {
 
+namespace
+{
+// Frustum planes in the form used by the bulk tests
+struct PlaneSet
+{
+    float a[Frustum::PlaneCount], b[Frustum::PlaneCount], c[Frustum::PlaneCount], d[Frustum::PlaneCount];
+};
+
+// Input of a bulk test, along with the state shared by its parallel tasks
+struct CullJob
+{
+    PlaneSet planes;
+    bool boxes;
+    // Center coordinates and radius of spheres or minimum and maximum
+    //  coordinates of boxes
+    const float* arrays[6];
+    unsigned int* visible;
+
+    QMutex mutex;
+    QWaitCondition done;
+    int remaining;
+    int visibleCount;
+};
+
+void fillPlaneSet(const Frustum& frustum, PlaneSet* planes)
+{
+    for (int k = 0; k < Frustum::PlaneCount; k++) {
+        planes->a[k] = frustum.planes[k][0];
+        planes->b[k] = frustum.planes[k][1];
+        planes->c[k] = frustum.planes[k][2];
+        planes->d[k] = frustum.planes[k][3];
+    }
+}
+
+int countBits(unsigned int bits)
+{
+    int count = 0;
+    while (bits) {
+        bits &= bits - 1;
+        count++;
+    }
+    return count;
+}
+
+// Tests objects [first, end) of the job. first must be a multiple of 32, so
+//  that every element of the bitmask is written by only one thread.
+int cullRange(const CullJob& job, int first, int end)
+{
+    const PlaneSet& p = job.planes;
+    const float* x[Frustum::PlaneCount];
+    const float* y[Frustum::PlaneCount];
+    const float* z[Frustum::PlaneCount];
+    const float* r = 0;
+    for (int k = 0; k < Frustum::PlaneCount; k++) {
+        if (job.boxes) {
+            // Only the box corner furthest along the plane's normal matters
+            x[k] = p.a[k] >= 0 ? job.arrays[3] : job.arrays[0];
+            y[k] = p.b[k] >= 0 ? job.arrays[4] : job.arrays[1];
+            z[k] = p.c[k] >= 0 ? job.arrays[5] : job.arrays[2];
+        } else {
+            x[k] = job.arrays[0];
+            y[k] = job.arrays[1];
+            z[k] = job.arrays[2];
+            r = job.arrays[3];
+        }
+    }
+
+    int visibleCount = 0;
+    for (int base = first; base < end; base += 32) {
+        int blockEnd = qMin(base + 32, end);
+        unsigned int bits = 0;
+        int i = base;
+#ifdef EIGEN_VECTORIZE_SSE
+        const __m128 zero = _mm_setzero_ps();
+        for (; i + 4 <= blockEnd; i += 4) {
+            __m128 inside = _mm_cmpeq_ps(zero, zero);
+            for (int k = 0; k < Frustum::PlaneCount; k++) {
+                __m128 dist = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(p.a[k]), _mm_loadu_ps(x[k] + i)),
+                                         _mm_mul_ps(_mm_set1_ps(p.b[k]), _mm_loadu_ps(y[k] + i)));
+                dist = _mm_add_ps(dist, _mm_mul_ps(_mm_set1_ps(p.c[k]), _mm_loadu_ps(z[k] + i)));
+                dist = _mm_add_ps(dist, _mm_set1_ps(p.d[k]));
+                __m128 limit = r ? _mm_sub_ps(zero, _mm_loadu_ps(r + i)) : zero;
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(dist, limit));
+            }
+            bits |= (unsigned int)_mm_movemask_ps(inside) << (i - base);
+        }
+#endif
+        for (; i < blockEnd; i++) {
+            bool inside = true;
+            for (int k = 0; k < Frustum::PlaneCount; k++) {
+                float dist = p.a[k] * x[k][i] + p.b[k] * y[k][i] + p.c[k] * z[k][i] + p.d[k];
+                inside = inside && dist >= (r ? -r[i] : 0.0f);
+            }
+            bits |= (unsigned int)inside << (i - base);
+        }
+        job.visible[base / 32] = bits;
+        visibleCount += countBits(bits);
+    }
+    return visibleCount;
+}
+
+class CullTask : public QRunnable
+{
+public:
+    CullTask(CullJob* job, int first, int end) : mJob(job), mFirst(first), mEnd(end)  {}
+    virtual void run()
+    {
+        int count = cullRange(*mJob, mFirst, mEnd);
+        QMutexLocker locker(&mJob->mutex);
+        mJob->visibleCount += count;
+        if (--mJob->remaining == 0) {
+            mJob->done.wakeAll();
+        }
+    }
+
+private:
+    CullJob* mJob;
+    int mFirst, mEnd;
+};
+
+// Objects tested by a single task. Smaller chunks aren't worth the
+//  synchronization.
+const int MinChunkSize = 4096;
+
+int runCullJob(CullJob* job, int count, QThreadPool* pool)
+{
+    int chunks = 1;
+    if (pool) {
+        chunks = qBound(1, count / MinChunkSize, pool->maxThreadCount() + 1);
+    }
+    // Chunks are aligned to the elements of the bitmask
+    int chunkSize = ((count + chunks - 1) / chunks + 31) & ~31;
+
+    job->visibleCount = 0;
+    job->remaining = 0;
+    for (int first = chunkSize; first < count; first += chunkSize) {
+        QMutexLocker locker(&job->mutex);
+        job->remaining++;
+        locker.unlock();
+        pool->start(new CullTask(job, first, qMin(first + chunkSize, count)));
+    }
+    // The calling thread takes the first chunk
+    int visibleCount = cullRange(*job, 0, qMin(chunkSize, count));
+
+    QMutexLocker locker(&job->mutex);
+    while (job->remaining > 0) {
+        job->done.wait(&job->mutex);
+    }
+    return visibleCount + job->visibleCount;
+}
+}
+
 Camera::Camera()
 {
     mFoV = 45.0f;
@@ -37,6 +200,7 @@ Camera::Camera()
     mUp = Vector3f(0, 1, 0);
     mModelviewMatrixDirty = true;
     mProjectionMatrixDirty = true;
+    mFrustumDirty = true;
 }
 
 Camera::~Camera()
@@ -126,6 +290,7 @@ void Camera::recalculateModelviewMatrix()
 {
     // Code from Mesa project, src/glu/sgi/libutil/project.c
     mModelviewMatrixDirty = false;
+    mFrustumDirty = true;
     // Our looking direction
     Vector3f forward = (mLookAt - mPosition).normalized();
 
@@ -143,6 +308,7 @@ void Camera::recalculateProjectionMatrix()
 {
     // Code from Mesa project, src/glu/sgi/libutil/project.c
     mProjectionMatrixDirty = false;
+    mFrustumDirty = true;
     mProjectionMatrix.setIdentity();
     float radians = mFoV / 2 * M_PI / 180;
 
@@ -165,12 +331,14 @@ void Camera::setModelviewMatrix(const Eigen::Transform3f& modelview)
 {
     mModelviewMatrix = modelview;
     mModelviewMatrixDirty = false;
+    mFrustumDirty = true;
 }
 
 void Camera::setProjectionMatrix(const Eigen::Transform3f& projection)
 {
     mProjectionMatrix = projection;
     mProjectionMatrixDirty = false;
+    mFrustumDirty = true;
 }
 
 Eigen::Transform3f Camera::modelviewMatrix() const
@@ -208,6 +376,112 @@ Eigen::Vector3f Camera::project(const Eigen::Vector3f& v, bool* ok) const
     return res;
 }
 
+float Camera::projectedSize(const Eigen::Vector3f& center, float radius) const
+{
+    // Distance from the camera along the viewing direction
+    float depth = -(modelviewMatrix() * center).z();
+    if (depth <= radius) {
+        return FLT_MAX;
+    }
+    // Element (1, 1) of a perspective projection is cot(fov/2), which maps
+    //  the vertical extent at depth 1 to normalized device coordinates
+    return radius / depth * projectionMatrix()(1, 1) * mViewport[3];
+}
+
+const Frustum& Camera::frustum() const
+{
+    if (mFrustumDirty || mModelviewMatrixDirty || mProjectionMatrixDirty) {
+        const_cast<Camera*>(this)->recalculateFrustum();
+    }
+    return mFrustum;
+}
+
+void Camera::recalculateFrustum()
+{
+    // Gribb and Hartmann, "Fast Extraction of Viewing Frustum Planes from the
+    //  World-View-Projection Matrix"
+    Matrix4f m = projectionMatrix().matrix() * modelviewMatrix().matrix();
+    mFrustumDirty = false;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            mFrustum.planes[2*i][j] = m(3, j) + m(i, j);
+            mFrustum.planes[2*i+1][j] = m(3, j) - m(i, j);
+        }
+    }
+    for (int k = 0; k < Frustum::PlaneCount; k++) {
+        Vector4f& plane = mFrustum.planes[k];
+        float length = sqrt(plane[0]*plane[0] + plane[1]*plane[1] + plane[2]*plane[2]);
+        if (length > 0) {
+            plane /= length;
+        }
+    }
+}
+
+bool Camera::isSphereVisible(const Eigen::Vector3f& center, float radius) const
+{
+    const Frustum& f = frustum();
+    for (int k = 0; k < Frustum::PlaneCount; k++) {
+        const Vector4f& plane = f.planes[k];
+        if (plane[0]*center.x() + plane[1]*center.y() + plane[2]*center.z() + plane[3] < -radius) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Camera::isBoxVisible(const Eigen::Vector3f& min, const Eigen::Vector3f& max) const
+{
+    const Frustum& f = frustum();
+    for (int k = 0; k < Frustum::PlaneCount; k++) {
+        const Vector4f& plane = f.planes[k];
+        // The box is outside if its corner furthest along the plane's normal is
+        float x = plane[0] >= 0 ? max.x() : min.x();
+        float y = plane[1] >= 0 ? max.y() : min.y();
+        float z = plane[2] >= 0 ? max.z() : min.z();
+        if (plane[0]*x + plane[1]*y + plane[2]*z + plane[3] < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int Camera::cullSpheres(const float* x, const float* y, const float* z, const float* radius, int count,
+                        unsigned int* visible, QThreadPool* pool) const
+{
+    if (count <= 0) {
+        return 0;
+    }
+    CullJob job;
+    fillPlaneSet(frustum(), &job.planes);
+    job.boxes = false;
+    job.arrays[0] = x;
+    job.arrays[1] = y;
+    job.arrays[2] = z;
+    job.arrays[3] = radius;
+    job.visible = visible;
+    return runCullJob(&job, count, pool);
+}
+
+int Camera::cullAABBs(const float* minX, const float* minY, const float* minZ,
+                      const float* maxX, const float* maxY, const float* maxZ, int count,
+                      unsigned int* visible, QThreadPool* pool) const
+{
+    if (count <= 0) {
+        return 0;
+    }
+    CullJob job;
+    fillPlaneSet(frustum(), &job.planes);
+    job.boxes = true;
+    job.arrays[0] = minX;
+    job.arrays[1] = minY;
+    job.arrays[2] = minZ;
+    job.arrays[3] = maxX;
+    job.arrays[4] = maxY;
+    job.arrays[5] = maxZ;
+    job.visible = visible;
+    return runCullJob(&job, count, pool);
+}
+
 Eigen::Vector3f Camera::unProject(const Eigen::Vector3f& v, bool* ok) const
 {
     // TODO add unit test
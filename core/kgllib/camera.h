@@ -23,9 +23,27 @@
 
 #include <Eigen/Geometry>
 
+class QThreadPool;
+
 namespace KGLLib
 {
 
+/**
+ * @brief View frustum, described by six planes.
+ *
+ * Each plane is stored as a vector (a, b, c, d) where (a, b, c) is the unit
+ *  normal pointing into the frustum, so that a*x + b*y + c*z + d is the
+ *  signed distance of point (x, y, z) from the plane. Points for which it's
+ *  non-negative for all planes are inside the frustum.
+ *
+ * @see Camera::frustum()
+ **/
+struct Frustum
+{
+    enum Plane { Left, Right, Bottom, Top, Near, Far, PlaneCount };
+    Eigen::Vector4f planes[PlaneCount];
+};
+
 /**
  * @brief Camera class.
  *
@@ -56,6 +74,11 @@ namespace KGLLib
  *  projecting points from world coordinates to window coordinates and vice
  *  versa. Obviously it only works if you don't modify OpenGL matrices or
  *  viewport manually but use the methods of this class instead.
+ *
+ * For visibility tests, @ref frustum() returns the planes of the view
+ *  frustum. Single objects can be tested using @ref isSphereVisible() and
+ *  @ref isBoxVisible(), large numbers of objects using @ref cullSpheres()
+ *  and @ref cullAABBs().
  **/
 class KGLLIB_EXPORT Camera
 {
@@ -197,9 +220,70 @@ public:
      **/
     Eigen::Vector3f unProject(const Eigen::Vector3f& v, bool* ok = 0) const;
 
+    /**
+     * @return approximate diameter in pixels of a sphere with the given
+     *  center and radius (in world coordinates) when it's projected onto the
+     *  viewport. If the camera is inside the sphere, a very large value is
+     *  returned.
+     *
+     * This is useful e.g. for selecting the level of detail of an object.
+     **/
+    float projectedSize(const Eigen::Vector3f& center, float radius) const;
+
+    /**
+     * @return planes of the camera's view frustum in world coordinates.
+     *
+     * The planes are computed from the modelview and projection matrices and
+     *  kept until either of them changes.
+     **/
+    const Frustum& frustum() const;
+
+    /**
+     * @return whether any part of the sphere with the given center and radius
+     *  (in world coordinates) may be inside the camera's view frustum.
+     *
+     * The test is conservative: spheres which are near a corner of the
+     *  frustum may be reported as visible even though they're outside of it.
+     **/
+    bool isSphereVisible(const Eigen::Vector3f& center, float radius) const;
+    /**
+     * @return whether any part of the axis-aligned box with the given corners
+     *  (in world coordinates) may be inside the camera's view frustum.
+     *
+     * The test is conservative in the same way as @ref isSphereVisible().
+     **/
+    bool isBoxVisible(const Eigen::Vector3f& min, const Eigen::Vector3f& max) const;
+
+    /**
+     * Tests @p count spheres against the view frustum. The spheres are given
+     *  as separate arrays of center coordinates and radii, which allows
+     *  testing several spheres at once using SIMD instructions.
+     *
+     * @param visible bitmask which is set to the results: bit (i % 32) of
+     *  element (i / 32) is set if sphere i may be visible. It must have room
+     *  for (count + 31) / 32 elements.
+     * @param pool if not null, the spheres are split into chunks which are
+     *  tested in parallel by the threads of @p pool and the calling thread.
+     *  This is only worth it for many thousands of objects.
+     * @return number of possibly visible spheres.
+     **/
+    int cullSpheres(const float* x, const float* y, const float* z, const float* radius, int count,
+                    unsigned int* visible, QThreadPool* pool = 0) const;
+    /**
+     * Tests @p count axis-aligned boxes against the view frustum. The boxes
+     *  are given as separate arrays of minimum and maximum corner
+     *  coordinates.
+     *
+     * See @ref cullSpheres() for the other parameters.
+     **/
+    int cullAABBs(const float* minX, const float* minY, const float* minZ,
+                  const float* maxX, const float* maxY, const float* maxZ, int count,
+                  unsigned int* visible, QThreadPool* pool = 0) const;
+
 protected:
     void recalculateModelviewMatrix();
     void recalculateProjectionMatrix();
+    void recalculateFrustum();
 
 protected:
     Eigen::Vector3f mPosition;
@@ -211,6 +295,8 @@ protected:
     bool mModelviewMatrixDirty;
     Eigen::Transform3f mProjectionMatrix;
     bool mProjectionMatrixDirty;
+    Frustum mFrustum;
+    bool mFrustumDirty;
     int mViewport[4];
 };
 
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "drawcommandbuffer.h"
+
+#include "batch.h"
+#include "geometrybuffer.h"
+
+#include <QtDebug>
+
+// Indirect rendering needs the draw indirect buffer target and the multi-draw
+//  variant of the indirect draw call
+#if defined(GL_ARB_draw_indirect) && defined(GL_ARB_multi_draw_indirect)
+#define KGLLIB_HAVE_DRAW_INDIRECT
+#endif
+
+
+namespace KGLLib
+{
+
+DrawCommandBuffer::DrawCommandBuffer(GeometryBuffer* buffer, int capacity)
+{
+    mBuffer = buffer;
+    mCapacity = qMax(capacity, 0);
+    mCommandCount = 0;
+    mDirtyFirst = mDirtyEnd = 0;
+    mId = 0;
+
+    if (!mBuffer->format().isIndexed()) {
+        qCritical() << "DrawCommandBuffer: geometry buffer must be indexed";
+    }
+
+#ifdef KGLLIB_HAVE_DRAW_INDIRECT
+    if (isSupported()) {
+        glGenBuffers(1, &mId);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mId);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, mCapacity * sizeof(DrawElementsIndirectCommand), 0, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
+#endif
+}
+
+DrawCommandBuffer::~DrawCommandBuffer()
+{
+    if (mId) {
+        glDeleteBuffers(1, &mId);
+    }
+}
+
+bool DrawCommandBuffer::isSupported()
+{
+#ifdef KGLLIB_HAVE_DRAW_INDIRECT
+    return GLEW_ARB_draw_indirect && GLEW_ARB_multi_draw_indirect;
+#else
+    return false;
+#endif
+}
+
+void DrawCommandBuffer::setCommandCount(int count)
+{
+    mCommandCount = qBound(0, count, mCapacity);
+}
+
+void DrawCommandBuffer::clear()
+{
+    mCommands.clear();
+    mBatches.clear();
+    mCommandCount = 0;
+    mDirtyFirst = mDirtyEnd = 0;
+}
+
+int DrawCommandBuffer::addCommand(const DrawElementsIndirectCommand& command)
+{
+    if (mCommands.count() >= mCapacity) {
+        qCritical() << "DrawCommandBuffer::addCommand(): buffer is full, capacity is" << mCapacity;
+        return -1;
+    }
+
+    int index = mCommands.count();
+    mCommands.append(command);
+    mBatches.append(0);
+    mCommandCount = mCommands.count();
+    markDirty(index);
+    return index;
+}
+
+int DrawCommandBuffer::addBatch(Batch* batch, int instanceCount)
+{
+    if (batch->buffer() != mBuffer) {
+        qCritical() << "DrawCommandBuffer::addBatch(): batch doesn't use the same buffer";
+        return -1;
+    }
+    // Make sure the batch's data and base vertex are up to date
+    batch->update();
+
+    // Only the batch's current level of detail is rendered
+    DrawElementsIndirectCommand command;
+    command.count = batch->lodIndexCount();
+    command.instanceCount = instanceCount;
+    command.firstIndex = batch->lodIndexOffset();
+    command.baseVertex = batch->baseVertex();
+    command.baseInstance = 0;
+    int index = addCommand(command);
+    if (index >= 0) {
+        mBatches[index] = batch;
+    }
+    return index;
+}
+
+void DrawCommandBuffer::setCommand(int index, const DrawElementsIndirectCommand& command)
+{
+    mCommands[index] = command;
+    mBatches[index] = 0;
+    markDirty(index);
+}
+
+void DrawCommandBuffer::updateBatchCommands()
+{
+    for (int i = 0; i < mBatches.count(); i++) {
+        Batch* batch = mBatches[i];
+        if (!batch) {
+            continue;
+        }
+        // The level of detail may have been changed using Batch::selectLod()
+        DrawElementsIndirectCommand& c = mCommands[i];
+        GLuint count = batch->lodIndexCount();
+        GLuint first = batch->lodIndexOffset();
+        if (c.count != count || c.firstIndex != first) {
+            c.count = count;
+            c.firstIndex = first;
+            markDirty(i);
+        }
+    }
+}
+
+void DrawCommandBuffer::markDirty(int index)
+{
+    if (mDirtyFirst == mDirtyEnd) {
+        mDirtyFirst = index;
+        mDirtyEnd = index + 1;
+    } else {
+        mDirtyFirst = qMin(mDirtyFirst, index);
+        mDirtyEnd = qMax(mDirtyEnd, index + 1);
+    }
+}
+
+void DrawCommandBuffer::update()
+{
+    updateBatchCommands();
+    if (mDirtyFirst == mDirtyEnd) {
+        return;
+    }
+
+#ifdef KGLLIB_HAVE_DRAW_INDIRECT
+    if (mId) {
+        int size = sizeof(DrawElementsIndirectCommand);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mId);
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, mDirtyFirst * size, (mDirtyEnd - mDirtyFirst) * size, mCommands.data() + mDirtyFirst);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
+#endif
+    mDirtyFirst = mDirtyEnd = 0;
+}
+
+void DrawCommandBuffer::render()
+{
+    bind();
+    renderOnce();
+    unbind();
+}
+
+void DrawCommandBuffer::bind()
+{
+    update();
+
+    mBuffer->bind();
+#ifdef KGLLIB_HAVE_DRAW_INDIRECT
+    if (mId) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mId);
+    }
+#endif
+}
+
+void DrawCommandBuffer::renderOnce()
+{
+    if (!mCommandCount) {
+        return;
+    }
+    if (mId && mBuffer->renderIndexedIndirect(mCommandCount, 0)) {
+        return;
+    }
+
+    // Fall back to rendering the commands we know about one by one. The
+    //  base instance can't be emulated.
+    bool instancing = GeometryBuffer::isInstancingSupported();
+    int count = qMin(mCommandCount, mCommands.count());
+    for (int i = 0; i < count; i++) {
+        const DrawElementsIndirectCommand& c = mCommands[i];
+        if (c.instanceCount > 1 && instancing) {
+            mBuffer->renderIndexedSubsetInstanced(c.count, c.firstIndex, c.instanceCount, c.baseVertex);
+        } else {
+            for (GLuint instance = 0; instance < c.instanceCount; instance++) {
+                mBuffer->renderIndexedSubset(c.count, c.firstIndex, c.baseVertex);
+            }
+        }
+    }
+}
+
+void DrawCommandBuffer::unbind()
+{
+#ifdef KGLLIB_HAVE_DRAW_INDIRECT
+    if (mId) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
+#endif
+    mBuffer->unbind();
+}
+
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KGLLIB_DRAWCOMMANDBUFFER_H
+#define KGLLIB_DRAWCOMMANDBUFFER_H
+
+#include "kgllib.h"
+
+#include <QtCore/QVector>
+
+
+namespace KGLLib
+{
+class Batch;
+class GeometryBuffer;
+
+/**
+ * @brief Single indexed draw command.
+ *
+ * The layout matches the one expected by glMultiDrawElementsIndirect(), so
+ *  commands can also be written directly into the command buffer by shaders.
+ **/
+struct DrawElementsIndirectCommand
+{
+    /// Number of indices to render
+    GLuint count;
+    /// Number of instances to render
+    GLuint instanceCount;
+    /// Array index of the first index to use
+    GLuint firstIndex;
+    /// Value added to every index before fetching the vertex
+    GLint baseVertex;
+    /// First instance, used for fetching per-instance attributes
+    GLuint baseInstance;
+};
+
+/**
+ * @brief Stores draw commands in a buffer object for indirect rendering.
+ *
+ * DrawCommandBuffer keeps a list of @ref DrawElementsIndirectCommand records
+ *  referencing ranges of a shared, indexed @ref GeometryBuffer and renders
+ *  all of them using a single glMultiDrawElementsIndirect() call.
+ *
+ * Commands can be added on the CPU, e.g. one for each Batch using the buffer:
+ * @code
+ * Batch::createSharedBuffer(models);
+ * DrawCommandBuffer* commands = new DrawCommandBuffer(models.first()->buffer(), models.count());
+ * foreach (Batch* b, models) {
+ *     commands->addBatch(b);
+ * }
+ * ...
+ * // In your rendering loop:
+ * commands->render();
+ * @endcode
+ *
+ * Since the commands are stored in a buffer object (see @ref glId()), they
+ *  can also be written on the GPU, e.g. by a culling pass using transform
+ *  feedback or a compute shader. In that case use @ref setCommandCount() to
+ *  specify how many commands should be rendered.
+ *
+ * If indirect rendering isn't supported (see @ref isSupported()) or the
+ *  geometry buffer doesn't use buffer objects, commands added on the CPU are
+ *  rendered one by one instead. Commands with several instances use
+ *  instanced rendering if it's supported and are otherwise rendered once per
+ *  instance. The base instance is ignored in this case.
+ *
+ * @see BatchGroup, GeometryBuffer::renderIndexedIndirect()
+ **/
+class KGLLIB_EXPORT DrawCommandBuffer
+{
+public:
+    /**
+     * Constructs new DrawCommandBuffer object which can store up to
+     *  @p capacity commands for rendering data from @p buffer.
+     **/
+    DrawCommandBuffer(GeometryBuffer* buffer, int capacity);
+    virtual ~DrawCommandBuffer();
+
+    /**
+     * @return whether indirect rendering is supported by the hardware.
+     **/
+    static bool isSupported();
+
+    /**
+     * @return GeometryBuffer which the commands refer to.
+     **/
+    GeometryBuffer* buffer() const  { return mBuffer; }
+    /**
+     * @return maximum number of commands in this buffer.
+     **/
+    int capacity() const  { return mCapacity; }
+    /**
+     * @return number of commands which will be rendered.
+     **/
+    int commandCount() const  { return mCommandCount; }
+    /**
+     * Sets the number of commands which will be rendered to @p count.
+     *
+     * This is only necessary if the commands are written to the buffer on
+     *  the GPU, since adding commands on the CPU updates the count
+     *  automatically.
+     **/
+    void setCommandCount(int count);
+    /**
+     * @return OpenGL id of the buffer object containing the commands, or 0 if
+     *  indirect rendering isn't supported.
+     **/
+    GLuint glId() const  { return mId; }
+
+    /**
+     * Removes all commands.
+     **/
+    void clear();
+    /**
+     * Adds @p command to the buffer.
+     *
+     * @return index of the added command or -1 if the buffer is full.
+     **/
+    int addCommand(const DrawElementsIndirectCommand& command);
+    /**
+     * Adds a command rendering @p batch.
+     * The batch must use the same GeometryBuffer as this command buffer.
+     *
+     * The command renders the batch's current level of detail. It's updated
+     *  by @ref update() when another level is selected, until it's replaced
+     *  using @ref setCommand() or the buffer is cleared.
+     *
+     * @return index of the added command or -1 if it couldn't be added.
+     **/
+    int addBatch(Batch* batch, int instanceCount = 1);
+    /**
+     * @return command with the given index.
+     **/
+    const DrawElementsIndirectCommand& command(int index) const  { return mCommands[index]; }
+    /**
+     * Replaces the command with the given index by @p command.
+     **/
+    void setCommand(int index, const DrawElementsIndirectCommand& command);
+
+    /**
+     * Updates the commands of batches whose level of detail has changed and
+     *  uploads commands which were changed on the CPU to the buffer object.
+     *
+     * This method is automatically called from @ref bind().
+     **/
+    void update();
+
+    /**
+     * Renders all commands.
+     *
+     * This is same as calling first @ref bind(), then @ref renderOnce() and
+     *  finally @ref unbind().
+     **/
+    virtual void render();
+    /**
+     * Binds the geometry buffer and the command buffer.
+     **/
+    virtual void bind();
+    /**
+     * Renders all commands without doing bind and unbind operations.
+     **/
+    virtual void renderOnce();
+    /**
+     * Unbinds the geometry buffer and the command buffer.
+     **/
+    virtual void unbind();
+
+protected:
+    void markDirty(int index);
+    void updateBatchCommands();
+
+private:
+    GeometryBuffer* mBuffer;
+    GLuint mId;
+    int mCapacity;
+    int mCommandCount;
+    QVector<DrawElementsIndirectCommand> mCommands;
+    // Batch rendered by each command, or 0 for commands added directly
+    QVector<Batch*> mBatches;
+    // Range of commands that need to be uploaded ([first; end[)
+    int mDirtyFirst, mDirtyEnd;
+};
+
+}
+
+#endif
@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "geometryarena.h"
+
+#include "batch.h"
+
+#include <QtDebug>
+
+#include <limits.h>
+
+
+namespace KGLLib
+{
+
+GeometryArena::GeometryArena(int blockVertexCount, int blockIndexCount)
+{
+    mBlockVertexCount = qMax(blockVertexCount, 1);
+    mBlockIndexCount = qMax(blockIndexCount, 1);
+}
+
+GeometryArena::~GeometryArena()
+{
+    foreach (Batch* b, mAllocations.keys()) {
+        b->setArena(0);
+    }
+    foreach (Block* block, mBlocks) {
+        delete block->buffer;
+        delete block;
+    }
+}
+
+void GeometryArena::addBatch(Batch* batch)
+{
+    batch->setArena(this);
+}
+
+void GeometryArena::removeBatch(Batch* batch)
+{
+    if (batch->arena() == this) {
+        batch->setArena(0);
+    }
+}
+
+int GeometryArena::freeVertexCount() const
+{
+    int count = 0;
+    foreach (Block* block, mBlocks) {
+        foreach (const Range& r, block->freeVertices) {
+            count += r.size;
+        }
+    }
+    return count;
+}
+
+GeometryBufferFormat GeometryArena::formatKey(const GeometryBufferFormat& format)
+{
+    // Batches can share a block if their formats only differ in counts
+    GeometryBufferFormat key = format;
+    key.setVertexCount(0);
+    key.setIndexCount(format.isIndexed() ? 1 : 0);
+    key.setIndexType(GL_UNSIGNED_INT);
+    return key;
+}
+
+int GeometryArena::allocate(FreeList& list, int size)
+{
+    // Best fit: use the smallest free range that is large enough
+    int best = -1;
+    for (int i = 0; i < list.count(); i++) {
+        if (list[i].size >= size && (best < 0 || list[i].size < list[best].size)) {
+            best = i;
+        }
+    }
+    if (best < 0) {
+        return -1;
+    }
+
+    int offset = list[best].offset;
+    if (list[best].size == size) {
+        list.remove(best);
+    } else {
+        list[best].offset += size;
+        list[best].size -= size;
+    }
+    return offset;
+}
+
+void GeometryArena::release(FreeList& list, int offset, int size)
+{
+    if (size <= 0) {
+        return;
+    }
+    int i = 0;
+    while (i < list.count() && list[i].offset < offset) {
+        i++;
+    }
+    Range r;
+    r.offset = offset;
+    r.size = size;
+    list.insert(i, r);
+
+    // Merge with the following and the preceding range if they're adjacent
+    if (i + 1 < list.count() && list[i].offset + list[i].size == list[i+1].offset) {
+        list[i].size += list[i+1].size;
+        list.remove(i + 1);
+    }
+    if (i > 0 && list[i-1].offset + list[i-1].size == list[i].offset) {
+        list[i-1].size += list[i].size;
+        list.remove(i);
+    }
+}
+
+bool GeometryArena::take(FreeList& list, int offset, int size)
+{
+    if (size <= 0) {
+        return true;
+    }
+    for (int i = 0; i < list.count(); i++) {
+        Range r = list[i];
+        if (r.offset <= offset && offset + size <= r.offset + r.size) {
+            // Split the free range around the taken one
+            list.remove(i);
+            int tail = r.offset + r.size - (offset + size);
+            if (tail > 0) {
+                release(list, offset + size, tail);
+            }
+            if (offset > r.offset) {
+                release(list, r.offset, offset - r.offset);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+GeometryArena::Block* GeometryArena::createBlock(const GeometryBufferFormat& key, GLenum primitiveType, int vertexCount, int indexCount)
+{
+    GeometryBufferFormat format = key;
+    format.setVertexCount(qMax(vertexCount, mBlockVertexCount));
+    format.setIndexCount(key.isIndexed() ? qMax(indexCount, mBlockIndexCount) : 0);
+    format.setIndexType(GeometryBufferFormat::bestIndexType(format.vertexCount(), format.primitiveRestart()));
+    qDebug() << "GeometryArena: creating block for" << format.vertexCount() << "vertices and" << format.indexCount() << "indices";
+
+    Block* block = new Block;
+    block->buffer = GeometryBuffer::createBuffer(format);
+    block->buffer->setPrimitiveType(primitiveType);
+    block->key = key;
+    block->primitiveType = primitiveType;
+    block->batchCount = 0;
+    release(block->freeVertices, 0, format.vertexCount());
+    release(block->freeIndices, 0, format.indexCount());
+    mBlocks.append(block);
+    return block;
+}
+
+bool GeometryArena::allocateIn(Block* block, Allocation* alloc)
+{
+    int vertexOffset = alloc->vertexCount ? allocate(block->freeVertices, alloc->vertexCount) : 0;
+    if (vertexOffset < 0) {
+        return false;
+    }
+    int indexOffset = alloc->indexCount ? allocate(block->freeIndices, alloc->indexCount) : 0;
+    if (indexOffset < 0) {
+        release(block->freeVertices, vertexOffset, alloc->vertexCount);
+        return false;
+    }
+
+    alloc->block = block;
+    alloc->vertexOffset = vertexOffset;
+    alloc->indexOffset = indexOffset;
+    block->batchCount++;
+    return true;
+}
+
+void GeometryArena::releaseAllocation(const Allocation& alloc)
+{
+    release(alloc.block->freeVertices, alloc.vertexOffset, alloc.vertexCount);
+    release(alloc.block->freeIndices, alloc.indexOffset, alloc.indexCount);
+    alloc.block->batchCount--;
+}
+
+bool GeometryArena::placeBatch(Batch* batch)
+{
+    GeometryBufferFormat format = batch->bestBufferFormat();
+    GeometryBufferFormat key = formatKey(format);
+
+    if (mAllocations.contains(batch)) {
+        const Allocation& alloc = mAllocations[batch];
+        if (alloc.block->key == key && alloc.block->primitiveType == batch->primitiveType() &&
+                alloc.vertexCount == format.vertexCount() && alloc.indexCount == format.indexCount() &&
+                batch->buffer() == alloc.block->buffer) {
+            return true;
+        }
+        // Format or size has changed, so the batch has to be moved
+        releaseBatch(batch);
+    }
+
+    Allocation alloc;
+    alloc.vertexCount = format.vertexCount();
+    alloc.indexCount = format.indexCount();
+    bool placed = false;
+    foreach (Block* block, mBlocks) {
+        if (block->key == key && block->primitiveType == batch->primitiveType() && allocateIn(block, &alloc)) {
+            placed = true;
+            break;
+        }
+    }
+    if (!placed) {
+        Block* block = createBlock(key, batch->primitiveType(), alloc.vertexCount, alloc.indexCount);
+        placed = allocateIn(block, &alloc);
+    }
+    if (!placed) {
+        qCritical() << "GeometryArena::placeBatch(): couldn't allocate" << alloc.vertexCount << "vertices";
+        return false;
+    }
+
+    mAllocations.insert(batch, alloc);
+    batch->setBuffer(alloc.block->buffer, alloc.vertexOffset, alloc.indexOffset);
+    return true;
+}
+
+void GeometryArena::releaseBatch(Batch* batch)
+{
+    if (!mAllocations.contains(batch)) {
+        return;
+    }
+    releaseAllocation(mAllocations.take(batch));
+}
+
+QList<Batch*> GeometryArena::sortedBatches(Block* block, bool byIndexOffset) const
+{
+    QList<Batch*> batches;
+    foreach (Batch* b, mAllocations.keys()) {
+        const Allocation& alloc = mAllocations[b];
+        if (alloc.block != block) {
+            continue;
+        }
+        int offset = byIndexOffset ? alloc.indexOffset : alloc.vertexOffset;
+        int i = 0;
+        while (i < batches.count()) {
+            const Allocation& other = mAllocations[batches[i]];
+            if ((byIndexOffset ? other.indexOffset : other.vertexOffset) >= offset) {
+                break;
+            }
+            i++;
+        }
+        batches.insert(i, b);
+    }
+    return batches;
+}
+
+int GeometryArena::compact(int maxMoves)
+{
+    int moves = 0;
+    if (maxMoves < 0) {
+        maxMoves = INT_MAX;
+    }
+
+    foreach (Block* block, mBlocks) {
+        if (moves >= maxMoves) {
+            break;
+        }
+
+        // Ranges are moved down one by one. Everything between the end of the
+        //  previous range and the moved one is free, so the target range is
+        //  always available once the old one is released.
+        QList<Batch*> moved;
+        int packed = 0;
+        foreach (Batch* b, sortedBatches(block, false)) {
+            Allocation& alloc = mAllocations[b];
+            // Batches which have released their arrays can't upload their
+            //  data again, so they stay where they are.
+            if (alloc.vertexOffset != packed && !b->hasReleasedData() && moves + moved.count() < maxMoves) {
+                release(block->freeVertices, alloc.vertexOffset, alloc.vertexCount);
+                take(block->freeVertices, packed, alloc.vertexCount);
+                alloc.vertexOffset = packed;
+                moved.append(b);
+            }
+            packed = alloc.vertexOffset + alloc.vertexCount;
+        }
+
+        packed = 0;
+        foreach (Batch* b, sortedBatches(block, true)) {
+            Allocation& alloc = mAllocations[b];
+            if (!alloc.indexCount) {
+                continue;
+            }
+            bool wasMoved = moved.contains(b);
+            if (alloc.indexOffset != packed && !b->hasReleasedData() &&
+                    (wasMoved || moves + moved.count() < maxMoves)) {
+                release(block->freeIndices, alloc.indexOffset, alloc.indexCount);
+                take(block->freeIndices, packed, alloc.indexCount);
+                alloc.indexOffset = packed;
+                if (!wasMoved) {
+                    moved.append(b);
+                }
+            }
+            packed = alloc.indexOffset + alloc.indexCount;
+        }
+
+        // Moved batches upload their data again from their arrays
+        foreach (Batch* b, moved) {
+            const Allocation& alloc = mAllocations[b];
+            b->setBuffer(block->buffer, alloc.vertexOffset, alloc.indexOffset);
+        }
+        moves += moved.count();
+    }
+
+    // Delete blocks which aren't used anymore
+    for (int i = mBlocks.count() - 1; i >= 0; i--) {
+        if (!mBlocks[i]->batchCount) {
+            delete mBlocks[i]->buffer;
+            delete mBlocks[i];
+            mBlocks.removeAt(i);
+        }
+    }
+
+    return moves;
+}
+
+}
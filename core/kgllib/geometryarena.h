@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KGLLIB_GEOMETRYARENA_H
+#define KGLLIB_GEOMETRYARENA_H
+
+#include "kgllib.h"
+#include "geometrybuffer.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QVector>
+
+
+namespace KGLLib
+{
+class Batch;
+
+/**
+ * @brief Shares a few large GeometryBuffers between many batches.
+ *
+ * GeometryArena owns large GeometryBuffer objects (blocks) and hands out
+ *  vertex and index ranges inside them to Batch objects. Unlike
+ *  @ref Batch::createSharedBuffer(), batches can be added and removed at any
+ *  time, and their data can change size: ranges are allocated from free lists
+ *  using best-fit allocation and returned to them when they're no longer
+ *  used.
+ *
+ * Every block stores batches with one format and primitive type. A new block
+ *  is created when none of the existing ones has a large enough free range.
+ *
+ * @code
+ * GeometryArena* arena = new GeometryArena();
+ * foreach (Batch* b, models) {
+ *     arena->addBatch(b);
+ * }
+ * // Batches are placed into the arena the next time they're updated
+ * @endcode
+ *
+ * Over time the free lists get fragmented. @ref compact() moves batches to
+ *  close the gaps and deletes empty blocks. It can be limited to a number of
+ *  moved batches per call, so that the work can be spread over several
+ *  frames. Moved batches re-upload their data from their arrays, so these
+ *  must still be valid. Batches which have released their data (see
+ *  @ref Batch::releaseData()) are never moved.
+ *
+ * The arena doesn't take ownership of the batches. Batches which are deleted
+ *  are removed from the arena automatically.
+ *
+ * @see Batch::setArena()
+ **/
+class KGLLIB_EXPORT GeometryArena
+{
+public:
+    /**
+     * Constructs new GeometryArena object.
+     *
+     * @param blockVertexCount number of vertices in each block. Batches with
+     *  more vertices get a block of their own.
+     * @param blockIndexCount number of indices in each block.
+     **/
+    GeometryArena(int blockVertexCount = 65536, int blockIndexCount = 3 * 65536);
+    /**
+     * Deletes the arena and all of its buffers.
+     * Batches which still use the arena go back to using internal buffers.
+     **/
+    virtual ~GeometryArena();
+
+    /**
+     * Adds @p batch to the arena. Same as calling batch->setArena(this).
+     **/
+    void addBatch(Batch* batch);
+    /**
+     * Removes @p batch from the arena. Same as calling batch->setArena(0).
+     **/
+    void removeBatch(Batch* batch);
+    /**
+     * @return list of batches which currently have space allocated in the
+     *  arena.
+     **/
+    QList<Batch*> batches() const  { return mAllocations.keys(); }
+
+    /**
+     * @return number of blocks, i.e. GeometryBuffer objects, in the arena.
+     **/
+    int blockCount() const  { return mBlocks.count(); }
+    /**
+     * @return number of vertices which are allocated in blocks but not used
+     *  by any batch.
+     **/
+    int freeVertexCount() const;
+
+    /**
+     * Moves batches so that free space in every block is contiguous and
+     *  deletes blocks which are no longer used. Batches with released data
+     *  keep their ranges, so gaps in front of them may remain.
+     *
+     * @param maxMoves maximum number of batches to move. If it's negative,
+     *  then all blocks are fully compacted.
+     * @return number of batches which were moved.
+     **/
+    int compact(int maxMoves = -1);
+
+protected:
+    struct Range
+    {
+        int offset;
+        int size;
+    };
+    // Sorted list of free ranges
+    typedef QVector<Range> FreeList;
+
+    struct Block
+    {
+        GeometryBuffer* buffer;
+        // Format of the stored batches, with counts normalized
+        GeometryBufferFormat key;
+        GLenum primitiveType;
+        FreeList freeVertices;
+        FreeList freeIndices;
+        int batchCount;
+    };
+
+    struct Allocation
+    {
+        Block* block;
+        int vertexOffset;
+        int vertexCount;
+        int indexOffset;
+        int indexCount;
+    };
+
+    static GeometryBufferFormat formatKey(const GeometryBufferFormat& format);
+    static int allocate(FreeList& list, int size);
+    static void release(FreeList& list, int offset, int size);
+    static bool take(FreeList& list, int offset, int size);
+
+    Block* createBlock(const GeometryBufferFormat& key, GLenum primitiveType, int vertexCount, int indexCount);
+    bool allocateIn(Block* block, Allocation* alloc);
+    void releaseAllocation(const Allocation& alloc);
+    // Batches stored in the block, sorted by vertex or index offset
+    QList<Batch*> sortedBatches(Block* block, bool byIndexOffset) const;
+
+private:
+    friend class Batch;
+    // Makes sure that the batch has a large enough range allocated in the
+    //  arena, called by Batch::update(). Returns false if it couldn't be
+    //  placed into the arena.
+    bool placeBatch(Batch* batch);
+    // Frees the range used by the batch without touching the batch itself
+    void releaseBatch(Batch* batch);
+
+    int mBlockVertexCount;
+    int mBlockIndexCount;
+    QList<Block*> mBlocks;
+    QHash<Batch*, Allocation> mAllocations;
+};
+
+}
+
+#endif
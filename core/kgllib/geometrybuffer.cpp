@@ -17,11 +17,242 @@
 
 #include "geometrybuffer.h"
 
+#include "instancebuffer.h"
+#include "program.h"
+
 #include <QDebug>
 
+#ifdef __F16C__
+#include <immintrin.h>
+#elif defined(EIGEN_VECTORIZE_SSE)
+#include <emmintrin.h>
+#endif
+#include <QVector>
+
+// GeometryBufferRing needs fences and mapping of buffer ranges
+#if defined(GL_ARB_sync) && defined(GL_ARB_map_buffer_range)
+#define KGLLIB_HAVE_BUFFER_RANGES
+#endif
+
 namespace KGLLib
 {
 
+namespace
+{
+// Converts a float to a half float, rounding to nearest even. Based on the
+//  well-known bit manipulation approach which avoids table lookups.
+inline GLushort floatToHalf(float value)
+{
+    union { float f; GLuint u; } v;
+    v.f = value;
+    GLuint sign = v.u & 0x80000000u;
+    v.u ^= sign;
+
+    GLuint half;
+    if (v.u >= (127 + 16) << 23) {
+        // Too large for a half, becomes infinity (or NaN)
+        half = (v.u > 255u << 23) ? 0x7e00 : 0x7c00;
+    } else if (v.u < 113 << 23) {
+        // Subnormal half or zero, let the FPU do the rounding
+        union { float f; GLuint u; } magic;
+        magic.u = ((127 - 15) + (23 - 10) + 1) << 23;
+        v.f += magic.f;
+        half = v.u - magic.u;
+    } else {
+        GLuint mantissaOdd = (v.u >> 13) & 1;
+        // Rebias the exponent from 127 to 15 and round
+        v.u -= (127u - 15u) << 23;
+        v.u += 0xfff + mantissaOdd;
+        half = v.u >> 13;
+    }
+    return half | (sign >> 16);
+}
+
+#if !defined(__F16C__) && defined(EIGEN_VECTORIZE_SSE)
+// Converts four floats to half floats at once, giving the same results as
+//  floatToHalf(). All three cases are computed for every value and the right
+//  one is selected using masks.
+inline __m128i floatToHalf4(__m128 value)
+{
+    __m128i v = _mm_castps_si128(value);
+    __m128i sign = _mm_and_si128(v, _mm_set1_epi32(0x80000000));
+    v = _mm_xor_si128(v, sign);
+
+    // Normalized halves. The sign bit is cleared, so signed comparisons work.
+    __m128i mantissaOdd = _mm_and_si128(_mm_srli_epi32(v, 13), _mm_set1_epi32(1));
+    __m128i normal = _mm_add_epi32(v, _mm_set1_epi32(0xfff - ((127 - 15) << 23)));
+    normal = _mm_srli_epi32(_mm_add_epi32(normal, mantissaOdd), 13);
+
+    // Subnormal halves and zero
+    __m128i magic = _mm_set1_epi32(((127 - 15) + (23 - 10) + 1) << 23);
+    __m128i subnormal = _mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(v), _mm_castsi128_ps(magic)));
+    subnormal = _mm_sub_epi32(subnormal, magic);
+
+    // Infinity and NaN
+    __m128i isNaN = _mm_cmpgt_epi32(v, _mm_set1_epi32(255 << 23));
+    __m128i infinite = _mm_or_si128(_mm_set1_epi32(0x7c00), _mm_and_si128(isNaN, _mm_set1_epi32(0x0200)));
+
+    __m128i isSmall = _mm_cmplt_epi32(v, _mm_set1_epi32(113 << 23));
+    __m128i isLarge = _mm_cmpgt_epi32(v, _mm_set1_epi32(((127 + 16) << 23) - 1));
+    __m128i half = _mm_or_si128(_mm_and_si128(isSmall, subnormal), _mm_andnot_si128(isSmall, normal));
+    half = _mm_or_si128(_mm_and_si128(isLarge, infinite), _mm_andnot_si128(isLarge, half));
+    half = _mm_or_si128(half, _mm_srli_epi32(sign, 16));
+
+    // Sign-extend so that the saturating pack keeps all 16 bits
+    half = _mm_srai_epi32(_mm_slli_epi32(half, 16), 16);
+    return _mm_packs_epi32(half, half);
+}
+#endif
+
+// Packs a float in [-1; 1] into a signed normalized integer of the given
+//  number of bits.
+inline GLuint packSnorm(float value, int bits)
+{
+    float scale = (1 << (bits - 1)) - 1;
+    int packed = qRound(qBound(-1.0f, value, 1.0f) * scale);
+    return packed & ((1 << bits) - 1);
+}
+
+// Value of component c of an element which has only the given number of
+//  components. Missing w (or q) components default to 1, others to 0.
+inline float componentValue(const float* element, int components, int c)
+{
+    return (c < components) ? element[c] : (c == 3 ? 1.0f : 0.0f);
+}
+
+// Converts count elements of srcComponents floats each into elements of
+//  dstComponents components of the given type.
+void convertFloats(const float* src, int srcComponents, int count, GLenum type, int dstComponents, char* dst)
+{
+    if (type == GL_INT_2_10_10_10_REV) {
+        GLuint* out = reinterpret_cast<GLuint*>(dst);
+        for (int i = 0; i < count; i++) {
+            const float* e = src + i * srcComponents;
+            out[i] = packSnorm(componentValue(e, srcComponents, 0), 10) |
+                    packSnorm(componentValue(e, srcComponents, 1), 10) << 10 |
+                    packSnorm(componentValue(e, srcComponents, 2), 10) << 20 |
+                    packSnorm(srcComponents > 3 ? e[3] : 0.0f, 2) << 30;
+        }
+    } else if (type == GL_HALF_FLOAT) {
+        GLushort* out = reinterpret_cast<GLushort*>(dst);
+        if (srcComponents == dstComponents) {
+            // Without padding the data can be converted as one flat array
+            int n = count * srcComponents;
+            int i = 0;
+#ifdef __F16C__
+            for (; i + 4 <= n; i += 4) {
+                __m128i halves = _mm_cvtps_ph(_mm_loadu_ps(src + i), 0);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), halves);
+            }
+#elif defined(EIGEN_VECTORIZE_SSE)
+            for (; i + 4 <= n; i += 4) {
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), floatToHalf4(_mm_loadu_ps(src + i)));
+            }
+#endif
+            for (; i < n; i++) {
+                out[i] = floatToHalf(src[i]);
+            }
+        } else {
+            for (int i = 0; i < count; i++) {
+                for (int c = 0; c < dstComponents; c++) {
+                    out[i * dstComponents + c] = floatToHalf(componentValue(src + i * srcComponents, srcComponents, c));
+                }
+            }
+        }
+    } else if (type == GL_UNSIGNED_BYTE) {
+        GLubyte* out = reinterpret_cast<GLubyte*>(dst);
+        for (int i = 0; i < count; i++) {
+            for (int c = 0; c < dstComponents; c++) {
+                float value = componentValue(src + i * srcComponents, srcComponents, c);
+                out[i * dstComponents + c] = qRound(qBound(0.0f, value, 1.0f) * 255.0f);
+            }
+        }
+    } else {
+        // Floats with padding
+        float* out = reinterpret_cast<float*>(dst);
+        for (int i = 0; i < count; i++) {
+            for (int c = 0; c < dstComponents; c++) {
+                out[i * dstComponents + c] = componentValue(src + i * srcComponents, srcComponents, c);
+            }
+        }
+    }
+}
+
+enum PrimitiveRestartSupport { NoRestart, FixedIndexRestart, CoreRestart, NVRestart };
+
+PrimitiveRestartSupport primitiveRestartSupport()
+{
+#ifdef GL_ARB_ES3_compatibility
+    if (GLEW_ARB_ES3_compatibility) {
+        return FixedIndexRestart;
+    }
+#endif
+#ifdef GL_VERSION_3_1
+    if (GLEW_VERSION_3_1) {
+        return CoreRestart;
+    }
+#endif
+    if (GLEW_NV_primitive_restart) {
+        return NVRestart;
+    }
+    return NoRestart;
+}
+
+// Enables primitive restart for the lifetime of the object if the format
+//  uses it. It isn't part of the VAO state, so it's set around each draw.
+class PrimitiveRestartScope
+{
+public:
+    PrimitiveRestartScope(const GeometryBufferFormat& format)
+    {
+        mSupport = format.primitiveRestart() ? primitiveRestartSupport() : NoRestart;
+        switch (mSupport) {
+#ifdef GL_ARB_ES3_compatibility
+            case FixedIndexRestart:
+                // The restart index is always the largest value of the type
+                glEnable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+                break;
+#endif
+#ifdef GL_VERSION_3_1
+            case CoreRestart:
+                glPrimitiveRestartIndex(format.primitiveRestartIndex());
+                glEnable(GL_PRIMITIVE_RESTART);
+                break;
+#endif
+            case NVRestart:
+                glPrimitiveRestartIndexNV(format.primitiveRestartIndex());
+                glEnableClientState(GL_PRIMITIVE_RESTART_NV);
+                break;
+            default:
+                break;
+        }
+    }
+    ~PrimitiveRestartScope()
+    {
+        switch (mSupport) {
+#ifdef GL_ARB_ES3_compatibility
+            case FixedIndexRestart:
+                glDisable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+                break;
+#endif
+#ifdef GL_VERSION_3_1
+            case CoreRestart:
+                glDisable(GL_PRIMITIVE_RESTART);
+                break;
+#endif
+            case NVRestart:
+                glDisableClientState(GL_PRIMITIVE_RESTART_NV);
+                break;
+            default:
+                break;
+        }
+    }
+
+private:
+    PrimitiveRestartSupport mSupport;
+};
+}
+
 /**  GeometryBufferFormat  **/
 GeometryBufferFormat::GeometryBufferFormat()
 {
@@ -51,7 +282,7 @@ GeometryBufferFormat::GeometryBufferFormat(Format fmt, int vertexCount, int inde
         mNormalSize = 3;
     }
     if (fmt & TexCoord2) {
-        mTexCoordSize = 2;
+        addTexCoords(2);
     }
 }
 
@@ -59,11 +290,19 @@ void GeometryBufferFormat::init(int vertexCount, int indexCount)
 {
     mVertexCount = vertexCount;
     mIndexCount = indexCount;
+    mLayout = Planar;
+    mUsage = StaticUsage;
+    mIndexType = GL_UNSIGNED_INT;
+    mPrimitiveRestart = false;
 
     mVertexSize = 0;
     mColorSize = 0;
     mNormalSize = 0;
-    mTexCoordSize = 0;
+    mTexCoordSizes.clear();
+    mVertexType = GL_FLOAT;
+    mColorType = GL_FLOAT;
+    mNormalType = GL_FLOAT;
+    mTexCoordType = GL_FLOAT;
 }
 
 void GeometryBufferFormat::setVertexCount(int count)
@@ -76,6 +315,147 @@ void GeometryBufferFormat::setIndexCount(int count)
     mIndexCount = count;
 }
 
+bool GeometryBufferFormat::operator==(const GeometryBufferFormat& other) const
+{
+    return mVertexCount == other.mVertexCount && mIndexCount == other.mIndexCount &&
+            mLayout == other.mLayout && mUsage == other.mUsage && mIndexType == other.mIndexType &&
+            mPrimitiveRestart == other.mPrimitiveRestart &&
+            mVertexSize == other.mVertexSize && mColorSize == other.mColorSize &&
+            mNormalSize == other.mNormalSize && mTexCoordSizes == other.mTexCoordSizes &&
+            mVertexType == other.mVertexType && mColorType == other.mColorType &&
+            mNormalType == other.mNormalType && mTexCoordType == other.mTexCoordType &&
+            mAttributes == other.mAttributes;
+}
+
+bool GeometryBufferFormat::canStore(const GeometryBufferFormat& other) const
+{
+    return mVertexCount >= other.mVertexCount && mIndexCount >= other.mIndexCount &&
+            isIndexed() == other.isIndexed() &&
+            mLayout == other.mLayout && mUsage == other.mUsage && mIndexType == other.mIndexType &&
+            mPrimitiveRestart == other.mPrimitiveRestart &&
+            mVertexSize == other.mVertexSize && mColorSize == other.mColorSize &&
+            mNormalSize == other.mNormalSize && mTexCoordSizes == other.mTexCoordSizes &&
+            mVertexType == other.mVertexType && mColorType == other.mColorType &&
+            mNormalType == other.mNormalType && mTexCoordType == other.mTexCoordType &&
+            mAttributes == other.mAttributes;
+}
+
+int GeometryBufferFormat::addAttribute(const QString& name, int size, GLenum type, bool normalized)
+{
+    VertexAttribute attr;
+    attr.name = name;
+    attr.size = size;
+    attr.type = type;
+    attr.normalized = normalized;
+    mAttributes.append(attr);
+    return mAttributes.count() - 1;
+}
+
+void GeometryBufferFormat::addTexCoords(int unit, int size)
+{
+    if (unit >= mTexCoordSizes.count()) {
+        if (!size) {
+            return;
+        }
+        mTexCoordSizes.resize(unit + 1);
+    }
+    mTexCoordSizes[unit] = size;
+    // Trailing unused sets aren't counted
+    while (!mTexCoordSizes.isEmpty() && !mTexCoordSizes.last()) {
+        mTexCoordSizes.resize(mTexCoordSizes.count() - 1);
+    }
+}
+
+int GeometryBufferFormat::attributeIndex(const QString& name) const
+{
+    for (int i = 0; i < mAttributes.count(); i++) {
+        if (mAttributes[i].name == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int GeometryBufferFormat::typeSize(GLenum type)
+{
+    switch (type) {
+        case GL_BYTE:
+        case GL_UNSIGNED_BYTE:
+            return 1;
+        case GL_SHORT:
+        case GL_UNSIGNED_SHORT:
+        case GL_HALF_FLOAT:
+            return 2;
+        case GL_DOUBLE:
+            return 8;
+        default:
+            return 4;
+    }
+}
+
+int GeometryBufferFormat::elementSize(int size, GLenum type)
+{
+    if (type == GL_INT_2_10_10_10_REV || type == GL_UNSIGNED_INT_2_10_10_10_REV) {
+        // All components are packed into a single 32-bit integer
+        return size ? 4 : 0;
+    }
+    return size * typeSize(type);
+}
+
+bool GeometryBufferFormat::isTypeSupported(GLenum type)
+{
+    switch (type) {
+        case GL_HALF_FLOAT:
+#ifdef GL_ARB_half_float_vertex
+            if (GLEW_ARB_half_float_vertex) {
+                return true;
+            }
+#endif
+            return GLEW_NV_half_float;
+        case GL_INT_2_10_10_10_REV:
+#ifdef GL_ARB_vertex_type_2_10_10_10_rev
+            return GLEW_ARB_vertex_type_2_10_10_10_rev;
+#else
+            return false;
+#endif
+        default:
+            return true;
+    }
+}
+
+int GeometryBufferFormat::indexSize() const
+{
+    switch (mIndexType) {
+        case GL_UNSIGNED_BYTE:
+            return sizeof(GLubyte);
+        case GL_UNSIGNED_SHORT:
+            return sizeof(GLushort);
+        default:
+            return sizeof(GLuint);
+    }
+}
+
+GLuint GeometryBufferFormat::primitiveRestartIndex() const
+{
+    switch (mIndexType) {
+        case GL_UNSIGNED_BYTE:
+            return 0xff;
+        case GL_UNSIGNED_SHORT:
+            return 0xffff;
+        default:
+            return 0xffffffff;
+    }
+}
+
+GLenum GeometryBufferFormat::bestIndexType(int vertexCount, bool primitiveRestart)
+{
+    if (vertexCount <= (primitiveRestart ? 0xffff : 0x10000)) {
+        return GL_UNSIGNED_SHORT;
+    } else {
+        return GL_UNSIGNED_INT;
+    }
+}
+
 
 /**  Static buffer creation helper methods  **/
 GeometryBuffer* GeometryBuffer::createBuffer(const GeometryBufferFormat& format)
@@ -93,6 +473,30 @@ GeometryBuffer* GeometryBuffer::createBuffer(GeometryBufferFormat::Format format
     return createBuffer(fmt);
 }
 
+bool GeometryBuffer::isBaseVertexSupported()
+{
+#ifdef GL_ARB_draw_elements_base_vertex
+    return GLEW_ARB_draw_elements_base_vertex;
+#else
+    return false;
+#endif
+}
+
+bool GeometryBuffer::isInstancingSupported()
+{
+#ifdef GL_ARB_draw_instanced
+    if (GLEW_ARB_draw_instanced) {
+        return true;
+    }
+#endif
+    return GLEW_EXT_draw_instanced;
+}
+
+bool GeometryBuffer::isPrimitiveRestartSupported()
+{
+    return primitiveRestartSupport() != NoRestart;
+}
+
 /**  GeometryBuffer  **/
 GeometryBuffer::GeometryBuffer(const GeometryBufferFormat& format)
 {
@@ -107,27 +511,83 @@ void GeometryBuffer::init(const GeometryBufferFormat& format)
 {
     mFormat = format;
     mPrimitiveType = GL_TRIANGLES;
+    mProgram = 0;
+    mLocationsValid = false;
+    mInstanceBuffer = 0;
+    mInstanceRevision = 0;
+    mInstanceLayoutValid = false;
+
+    initAttributeData(&mVertexData, format.vertexSize(), format.vertexType());
+    initAttributeData(&mColorData, format.colorSize(), format.colorType());
+    initAttributeData(&mNormalData, format.normalSize(), format.normalType());
+    mTexCoordData.resize(format.texCoordSetCount());
+    for (int i = 0; i < mTexCoordData.count(); i++) {
+        initAttributeData(&mTexCoordData[i], format.texCoordSize(i), format.texCoordType());
+    }
+
+    mAttributeData.resize(format.attributeCount());
+    mAttributeLocations.fill(-1, format.attributeCount());
+    for (int i = 0; i < format.attributeCount(); i++) {
+        // Data of generic attributes is given in the final type, so it's not padded
+        int size = GeometryBufferFormat::elementSize(format.attributeSize(i), format.attributeType(i));
+        mAttributeData[i] = AttributeData(size, 0, 0);
+        mAttributeData[i].type = format.attributeType(i);
+        mAttributeData[i].components = format.attributeSize(i);
+    }
 
-    int offset = 0;
-    if (format.vertexSize()) {
-        mVertexData.size = format.vertexSize() * sizeof(float);
-        offset += format.vertexSize() * format.vertexCount() * sizeof(float);
+    QVector<AttributeData*> attributes;
+    attributes << &mVertexData << &mColorData << &mNormalData;
+    for (int i = 0; i < mTexCoordData.count(); i++) {
+        attributes << &mTexCoordData[i];
     }
-    if (format.colorSize()) {
-        mColorData.size = format.colorSize() * sizeof(float);
-        mColorData.offset = offset;
-        offset += format.colorSize() * format.vertexCount() * sizeof(float);
+    for (int i = 0; i < mAttributeData.count(); i++) {
+        attributes << &mAttributeData[i];
+    }
+    const int attributeCount = attributes.count();
+
+    if (format.isInterleaved()) {
+        // All attributes of a vertex are packed together, so offsets are
+        //  relative to the start of the vertex record and stride is the size
+        //  of the whole record.
+        int stride = 0;
+        for (int i = 0; i < attributeCount; i++) {
+            attributes[i]->offset = stride;
+            stride += attributes[i]->size;
+        }
+        for (int i = 0; i < attributeCount; i++) {
+            if (attributes[i]->size) {
+                attributes[i]->stride = stride;
+            }
+        }
+    } else {
+        // Every attribute has its own tightly packed block
+        int offset = 0;
+        for (int i = 0; i < attributeCount; i++) {
+            attributes[i]->offset = offset;
+            offset += attributes[i]->size * format.vertexCount();
+        }
+    }
+}
+
+void GeometryBuffer::initAttributeData(AttributeData* attr, int components, GLenum type)
+{
+    *attr = AttributeData();
+    attr->type = type;
+    if (!components) {
+        return;
     }
-    if (format.normalSize()) {
-        mNormalData.size = format.normalSize() * sizeof(float);
-        mNormalData.offset = offset;
-        offset += format.normalSize() * format.vertexCount() * sizeof(float);
+    if (type == GL_INT_2_10_10_10_REV || type == GL_UNSIGNED_INT_2_10_10_10_REV) {
+        attr->components = 4;
+        attr->size = 4;
+        return;
     }
-    if (format.texCoordSize()) {
-        mTexCoordData.size = format.texCoordSize() * sizeof(float);
-        mTexCoordData.offset = offset;
-        offset += format.texCoordSize() * format.vertexCount() * sizeof(float);
+    // Pad the elements so that following attributes stay 4-byte aligned
+    int typesize = GeometryBufferFormat::typeSize(type);
+    attr->components = components;
+    while ((attr->components * typesize) % 4) {
+        attr->components++;
     }
+    attr->size = attr->components * typesize;
 }
 
 void GeometryBuffer::setPrimitiveType(GLenum type)
@@ -138,10 +598,15 @@ void GeometryBuffer::setPrimitiveType(GLenum type)
 int GeometryBuffer::bufferSize() const
 {
     int elemsize = 0;
-    elemsize += format().vertexSize() * sizeof(float);
-    elemsize += format().colorSize() * sizeof(float);
-    elemsize += format().normalSize() * sizeof(float);
-    elemsize += format().texCoordSize() * sizeof(float);
+    elemsize += mVertexData.size;
+    elemsize += mColorData.size;
+    elemsize += mNormalData.size;
+    for (int i = 0; i < mTexCoordData.count(); i++) {
+        elemsize += mTexCoordData[i].size;
+    }
+    for (int i = 0; i < mAttributeData.count(); i++) {
+        elemsize += mAttributeData[i].size;
+    }
 
     return elemsize * format().vertexCount();
 }
@@ -151,8 +616,7 @@ int GeometryBuffer::indexBufferSize() const
     if (!format().isIndexed()) {
         return 0;
     }
-    // TODO: support other formats
-    return sizeof(unsigned int) * format().indexCount();
+    return format().indexSize() * format().indexCount();
 }
 
 void GeometryBuffer::render()
@@ -164,28 +628,391 @@ void GeometryBuffer::render()
     }
 }
 
+void GeometryBuffer::addAttributeData(const AttributeData& attr, void* data, int count, int offset)
+{
+    int byteoffset = attr.offset + offset * attr.elementStride();
+    if (attr.elementStride() == attr.size) {
+        addData(data, count * attr.size, byteoffset);
+    } else {
+        addStridedData(data, attr.size, count, byteoffset, attr.stride);
+    }
+}
+
+void GeometryBuffer::addFloatAttributeData(const AttributeData& attr, int components, void* data, int count, int offset)
+{
+    if (attr.type == GL_FLOAT && attr.components == components) {
+        addAttributeData(attr, data, count, offset);
+        return;
+    }
+
+    QVector<char> converted(count * attr.size);
+    convertFloats(reinterpret_cast<const float*>(data), components, count, attr.type, attr.components, converted.data());
+    addAttributeData(attr, converted.data(), count, offset);
+}
+
+void GeometryBuffer::addStridedData(void* data, int size, int count, int offset, int stride)
+{
+    char* src = reinterpret_cast<char*>(data);
+    for (int i = 0; i < count; i++) {
+        addData(src + i * size, size, offset + i * stride);
+    }
+}
+
+void GeometryBuffer::addIndices(unsigned int* indices, int count, int offset)
+{
+    qDebug() << "addIndices(): count=" << count << ", offset=" << offset;
+    int indexsize = format().indexSize();
+    // Truncating the restart index gives the largest value of the smaller
+    //  type, which is the restart index of that type
+    if (format().indexType() == GL_UNSIGNED_INT) {
+        addIndexData(indices, count * indexsize, offset * indexsize);
+    } else if (format().indexType() == GL_UNSIGNED_SHORT) {
+        GLushort* converted = new GLushort[count];
+        for (int i = 0; i < count; i++) {
+            converted[i] = indices[i];
+        }
+        addIndexData(converted, count * indexsize, offset * indexsize);
+        delete[] converted;
+    } else {
+        GLubyte* converted = new GLubyte[count];
+        for (int i = 0; i < count; i++) {
+            converted[i] = indices[i];
+        }
+        addIndexData(converted, count * indexsize, offset * indexsize);
+        delete[] converted;
+    }
+}
+
 void GeometryBuffer::addVertices(void* vertices, int count, int offset)
 {
     qDebug() << "addVertices(): count=" << count << ", offset=" << offset;
-    addData(vertices, count * mVertexData.size, mVertexData.offset + offset * mVertexData.size);
+    addFloatAttributeData(mVertexData, format().vertexSize(), vertices, count, offset);
 }
 
 void GeometryBuffer::addColors(void* colors, int count, int offset)
 {
     qDebug() << "addColors(): count=" << count << ", offset=" << offset;
-    addData(colors, count * mColorData.size, mColorData.offset + offset * mColorData.size);
+    addFloatAttributeData(mColorData, format().colorSize(), colors, count, offset);
 }
 
 void GeometryBuffer::addNormals(void* normals, int count, int offset)
 {
     qDebug() << "addNormals(): count=" << count << ", offset=" << offset;
-    addData(normals, count * mNormalData.size, mNormalData.offset + offset * mNormalData.size);
+    addFloatAttributeData(mNormalData, format().normalSize(), normals, count, offset);
 }
 
 void GeometryBuffer::addTexCoords(void* texcoords, int count, int offset)
 {
-    qDebug() << "addTexCoords(): count=" << count << ", offset=" << offset;
-    addData(texcoords, count * mTexCoordData.size, mTexCoordData.offset + offset * mTexCoordData.size);
+    addTexCoords(0, texcoords, count, offset);
+}
+
+void GeometryBuffer::addTexCoords(int unit, void* texcoords, int count, int offset)
+{
+    qDebug() << "addTexCoords(): unit=" << unit << ", count=" << count << ", offset=" << offset;
+    addFloatAttributeData(mTexCoordData[unit], format().texCoordSize(unit), texcoords, count, offset);
+}
+
+void GeometryBuffer::addAttribute(int attribute, void* data, int count, int offset)
+{
+    qDebug() << "addAttribute(): attribute=" << attribute << ", count=" << count << ", offset=" << offset;
+    addAttributeData(mAttributeData[attribute], data, count, offset);
+}
+
+void GeometryBuffer::setProgram(Program* program)
+{
+    if (program != mProgram) {
+        mProgram = program;
+        mLocationsValid = false;
+    }
+}
+
+bool GeometryBuffer::resolveAttributeLocations()
+{
+    if (mLocationsValid) {
+        return false;
+    }
+    for (int i = 0; i < mAttributeLocations.count(); i++) {
+        mAttributeLocations[i] = mProgram ? mProgram->attributeLocation(format().attributeName(i)) : -1;
+    }
+    mLocationsValid = true;
+    return true;
+}
+
+void GeometryBuffer::setInstanceBuffer(InstanceBuffer* instances)
+{
+    if (instances != mInstanceBuffer) {
+        mInstanceBuffer = instances;
+        mInstanceLayoutValid = false;
+    }
+}
+
+bool GeometryBuffer::resolveInstanceLayout()
+{
+    int revision = mInstanceBuffer ? mInstanceBuffer->layoutRevision() : 0;
+    if (mInstanceLayoutValid && revision == mInstanceRevision) {
+        return false;
+    }
+    mInstanceRevision = revision;
+    mInstanceLayoutValid = true;
+    return true;
+}
+
+void GeometryBuffer::enableArrays(char* base)
+{
+    // Enable client states
+    if (mVertexData.size) {
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(mVertexData.components, mVertexData.type, mVertexData.stride, base + mVertexData.offset);
+    }
+    if (mColorData.size) {
+        glEnableClientState(GL_COLOR_ARRAY);
+        glColorPointer(mColorData.components, mColorData.type, mColorData.stride, base + mColorData.offset);
+    }
+    if (mNormalData.size) {
+        glEnableClientState(GL_NORMAL_ARRAY);
+        glNormalPointer(mNormalData.type, mNormalData.stride, base + mNormalData.offset);
+    }
+    for (int i = 0; i < mTexCoordData.count(); i++) {
+        const AttributeData& attr = mTexCoordData[i];
+        if (attr.size) {
+            // Texcoord arrays are per texture unit
+            if (mTexCoordData.count() > 1) {
+                glClientActiveTexture(GL_TEXTURE0 + i);
+            }
+            glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+            glTexCoordPointer(attr.components, attr.type, attr.stride, base + attr.offset);
+        }
+    }
+    if (mTexCoordData.count() > 1) {
+        glClientActiveTexture(GL_TEXTURE0);
+    }
+
+    resolveAttributeLocations();
+    for (int i = 0; i < mAttributeData.count(); i++) {
+        if (mAttributeLocations[i] >= 0) {
+            const AttributeData& attr = mAttributeData[i];
+            glEnableVertexAttribArray(mAttributeLocations[i]);
+            glVertexAttribPointer(mAttributeLocations[i], format().attributeSize(i), format().attributeType(i),
+                                  format().isAttributeNormalized(i), attr.stride, base + attr.offset);
+        }
+    }
+
+    if (mInstanceBuffer) {
+        mInstanceBuffer->enableArrays();
+    }
+}
+
+void GeometryBuffer::drawElements(int count, const char* indices, int baseVertex)
+{
+    PrimitiveRestartScope restart(format());
+    if (baseVertex) {
+#ifdef GL_ARB_draw_elements_base_vertex
+        if (isBaseVertexSupported()) {
+            glDrawElementsBaseVertex(mPrimitiveType, count, format().indexType(), const_cast<char*>(indices), baseVertex);
+            return;
+        }
+#endif
+        qCritical() << "GeometryBuffer::drawElements(): base vertex isn't supported";
+        return;
+    }
+    glDrawElements(mPrimitiveType, count, format().indexType(), indices);
+}
+
+void GeometryBuffer::drawElementsInstanced(int count, const char* indices, int instanceCount, int baseVertex)
+{
+    PrimitiveRestartScope restart(format());
+    if (baseVertex) {
+#ifdef GL_ARB_draw_elements_base_vertex
+        if (isBaseVertexSupported()) {
+            glDrawElementsInstancedBaseVertex(mPrimitiveType, count, format().indexType(), const_cast<char*>(indices), instanceCount, baseVertex);
+            return;
+        }
+#endif
+        qCritical() << "GeometryBuffer::drawElementsInstanced(): base vertex isn't supported";
+        return;
+    }
+#ifdef GL_ARB_draw_instanced
+    if (GLEW_ARB_draw_instanced) {
+        glDrawElementsInstancedARB(mPrimitiveType, count, format().indexType(), indices, instanceCount);
+        return;
+    }
+#endif
+    glDrawElementsInstancedEXT(mPrimitiveType, count, format().indexType(), indices, instanceCount);
+}
+
+void GeometryBuffer::drawArraysInstanced(int first, int count, int instanceCount)
+{
+#ifdef GL_ARB_draw_instanced
+    if (GLEW_ARB_draw_instanced) {
+        glDrawArraysInstancedARB(mPrimitiveType, first, count, instanceCount);
+        return;
+    }
+#endif
+    glDrawArraysInstancedEXT(mPrimitiveType, first, count, instanceCount);
+}
+
+void GeometryBuffer::multiDrawElements(const int* counts, const GLvoid** indices, const int* baseVertices, int drawCount)
+{
+    PrimitiveRestartScope restart(format());
+    if (baseVertices) {
+#ifdef GL_ARB_draw_elements_base_vertex
+        if (isBaseVertexSupported()) {
+            glMultiDrawElementsBaseVertex(mPrimitiveType, const_cast<GLsizei*>(counts), format().indexType(), indices, drawCount, const_cast<GLint*>(baseVertices));
+            return;
+        }
+#endif
+        for (int i = 0; i < drawCount; i++) {
+            if (baseVertices[i]) {
+                qCritical() << "GeometryBuffer::multiDrawElements(): base vertex isn't supported";
+                return;
+            }
+        }
+        baseVertices = 0;
+    }
+    if (GLEW_VERSION_1_4) {
+        glMultiDrawElements(mPrimitiveType, const_cast<GLsizei*>(counts), format().indexType(), indices, drawCount);
+        return;
+    }
+    for (int i = 0; i < drawCount; i++) {
+        drawElements(counts[i], reinterpret_cast<const char*>(indices[i]), 0);
+    }
+}
+
+void GeometryBuffer::renderIndexedSubsets(const int* counts, const int* offsets, const int* baseVertices, int drawCount)
+{
+    for (int i = 0; i < drawCount; i++) {
+        renderIndexedSubset(counts[i], offsets[i], baseVertices ? baseVertices[i] : 0);
+    }
+}
+
+void GeometryBuffer::renderSubsets(const int* counts, const int* offsets, int drawCount)
+{
+    for (int i = 0; i < drawCount; i++) {
+        renderSubset(counts[i], offsets[i]);
+    }
+}
+
+void GeometryBuffer::disableArrays()
+{
+    if (mVertexData.size) {
+        glDisableClientState(GL_VERTEX_ARRAY);
+    }
+    if (mColorData.size) {
+        glDisableClientState(GL_COLOR_ARRAY);
+    }
+    if (mNormalData.size) {
+        glDisableClientState(GL_NORMAL_ARRAY);
+    }
+    for (int i = 0; i < mTexCoordData.count(); i++) {
+        if (mTexCoordData[i].size) {
+            if (mTexCoordData.count() > 1) {
+                glClientActiveTexture(GL_TEXTURE0 + i);
+            }
+            glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        }
+    }
+    if (mTexCoordData.count() > 1) {
+        glClientActiveTexture(GL_TEXTURE0);
+    }
+    for (int i = 0; i < mAttributeData.count(); i++) {
+        if (mAttributeLocations[i] >= 0) {
+            glDisableVertexAttribArray(mAttributeLocations[i]);
+        }
+    }
+    if (mInstanceBuffer) {
+        mInstanceBuffer->disableArrays();
+    }
+}
+
+
+/**  GeometryBufferMapping  **/
+GeometryBufferMapping::GeometryBufferMapping(GeometryBuffer* buffer, int first, int count, int indexFirst, int indexCount,
+                                             GeometryBuffer::MapAccess access)
+{
+    mBuffer = buffer;
+    mFirst = first;
+    mCount = count;
+    mIndexCount = indexCount;
+    mData = 0;
+    mDataOffset = 0;
+    mIndexData = 0;
+
+    if (count > 0) {
+        // Map a single span which covers the given vertices of all attributes
+        QList<const GeometryBuffer::AttributeData*> attrs;
+        attrs << &buffer->mVertexData << &buffer->mColorData << &buffer->mNormalData;
+        for (int i = 0; i < buffer->mTexCoordData.count(); i++) {
+            attrs << &buffer->mTexCoordData[i];
+        }
+        for (int i = 0; i < buffer->mAttributeData.count(); i++) {
+            attrs << &buffer->mAttributeData[i];
+        }
+        int start = -1;
+        int end = 0;
+        foreach (const GeometryBuffer::AttributeData* attr, attrs) {
+            if (!attr->size) {
+                continue;
+            }
+            int attrstart = attr->offset + first * attr->elementStride();
+            int attrend = attrstart + (count - 1) * attr->elementStride() + attr->size;
+            start = (start < 0) ? attrstart : qMin(start, attrstart);
+            end = qMax(end, attrend);
+        }
+        if (start >= 0) {
+            mDataOffset = start;
+            mData = buffer->mapData(start, end - start, access);
+        }
+        if (!mData) {
+            qCritical() << "GeometryBufferMapping: couldn't map vertices" << first << "-" << first + count - 1;
+        }
+    }
+
+    if (indexCount > 0 && buffer->format().isIndexed()) {
+        int indexsize = buffer->format().indexSize();
+        mIndexData = buffer->mapIndexData(indexFirst * indexsize, indexCount * indexsize, access);
+        if (!mIndexData) {
+            qCritical() << "GeometryBufferMapping: couldn't map indices" << indexFirst << "-" << indexFirst + indexCount - 1;
+        }
+    }
+}
+
+GeometryBufferMapping::~GeometryBufferMapping()
+{
+    if (mData) {
+        mBuffer->unmapData();
+    }
+    if (mIndexData) {
+        mBuffer->unmapIndexData();
+    }
+}
+
+bool GeometryBufferMapping::isValid() const
+{
+    return (!mCount || mData) && (!mIndexCount || mIndexData);
+}
+
+char* GeometryBufferMapping::attributePointer(const GeometryBuffer::AttributeData& attr, int elementSize) const
+{
+    if (!mData || !attr.size) {
+        return 0;
+    }
+    if (elementSize > attr.size) {
+        qCritical() << "GeometryBufferMapping: element size" << elementSize << "is larger than the attribute size" << attr.size;
+        return 0;
+    }
+    return mData + attr.offset + mFirst * attr.elementStride() - mDataOffset;
+}
+
+char* GeometryBufferMapping::indexPointer(int elementSize) const
+{
+    if (!mIndexData) {
+        return 0;
+    }
+    if (elementSize != mBuffer->format().indexSize()) {
+        qCritical() << "GeometryBufferMapping: element size" << elementSize << "doesn't match the index size" << mBuffer->format().indexSize();
+        return 0;
+    }
+    return mIndexData;
 }
 
 
@@ -231,52 +1058,31 @@ void GeometryBufferVertexArray::addData(void* data, int size, int offset)
     memcpy(mBuffer + offset, data, size);
 }
 
-void GeometryBufferVertexArray::addIndices(unsigned int* indices, int count, int offset)
+void GeometryBufferVertexArray::addIndexData(void* data, int size, int offset)
 {
-    qDebug() << "VA::addIndices(): count=" << count << ", offset=" << offset;
-    int byteoffset = offset * sizeof(unsigned int);
-    int bytecount = count * sizeof(unsigned int);
-    memcpy(mIndexBuffer + byteoffset, indices, bytecount);
+    qDebug() << "  VA::addIndexData(): size=" << size << ", offset=" << offset;
+    memcpy(mIndexBuffer + offset, data, size);
 }
 
-bool GeometryBufferVertexArray::bind()
+char* GeometryBufferVertexArray::mapData(int offset, int, MapAccess)
 {
-    // Enable client states
-    if (mVertexData.size) {
-        glEnableClientState(GL_VERTEX_ARRAY);
-        glVertexPointer(mVertexData.size/sizeof(float), GL_FLOAT, 0, mBuffer + mVertexData.offset);
-    }
-    if (mColorData.size) {
-        glEnableClientState(GL_COLOR_ARRAY);
-        glColorPointer(mColorData.size/sizeof(float), GL_FLOAT, 0, mBuffer + mColorData.offset);
-    }
-    if (mNormalData.size) {
-        glEnableClientState(GL_NORMAL_ARRAY);
-        glNormalPointer(GL_FLOAT, 0, mBuffer + mNormalData.offset);
-    }
-    if (mTexCoordData.size) {
-        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-        glTexCoordPointer(mTexCoordData.size/sizeof(float), GL_FLOAT, 0, mBuffer + mTexCoordData.offset);
-    }
+    return mBuffer + offset;
+}
+
+char* GeometryBufferVertexArray::mapIndexData(int offset, int, MapAccess)
+{
+    return mIndexBuffer ? mIndexBuffer + offset : 0;
+}
 
+bool GeometryBufferVertexArray::bind()
+{
+    enableArrays(mBuffer);
     return true;
 }
 
 bool GeometryBufferVertexArray::unbind()
 {
-    if (mVertexData.size) {
-        glDisableClientState(GL_VERTEX_ARRAY);
-    }
-    if (mColorData.size) {
-        glDisableClientState(GL_COLOR_ARRAY);
-    }
-    if (mNormalData.size) {
-        glDisableClientState(GL_NORMAL_ARRAY);
-    }
-    if (mTexCoordData.size) {
-        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-    }
-
+    disableArrays();
     return true;
 }
 
@@ -286,21 +1092,139 @@ void GeometryBufferVertexArray::renderSubset(int vertices, int offset)
     glDrawArrays(mPrimitiveType, offset, vertices);
 }
 
-void GeometryBufferVertexArray::renderIndexedSubset(int indices, int offset)
+void GeometryBufferVertexArray::renderIndexedSubset(int indices, int offset, int baseVertex)
+{
+    drawElements(indices, mIndexBuffer + offset * format().indexSize(), baseVertex);
+}
+
+void GeometryBufferVertexArray::renderIndexedSubsetInstanced(int indices, int offset, int instanceCount, int baseVertex)
+{
+    drawElementsInstanced(indices, mIndexBuffer + offset * format().indexSize(), instanceCount, baseVertex);
+}
+
+void GeometryBufferVertexArray::renderSubsetInstanced(int vertices, int offset, int instanceCount)
+{
+    drawArraysInstanced(offset, vertices, instanceCount);
+}
+
+void GeometryBufferVertexArray::renderIndexedSubsets(const int* counts, const int* offsets, const int* baseVertices, int drawCount)
+{
+    QVector<const GLvoid*> indices(drawCount);
+    for (int i = 0; i < drawCount; i++) {
+        indices[i] = mIndexBuffer + offsets[i] * format().indexSize();
+    }
+    multiDrawElements(counts, indices.data(), baseVertices, drawCount);
+}
+
+void GeometryBufferVertexArray::renderSubsets(const int* counts, const int* offsets, int drawCount)
 {
-    glDrawElements(mPrimitiveType, indices, GL_UNSIGNED_INT, mIndexBuffer + offset * sizeof(unsigned int));
+    if (!GLEW_VERSION_1_4) {
+        GeometryBuffer::renderSubsets(counts, offsets, drawCount);
+        return;
+    }
+    glMultiDrawArrays(mPrimitiveType, const_cast<GLint*>(offsets), const_cast<GLsizei*>(counts), drawCount);
 }
 
 
 /**  GeometryBufferVBO  **/
+namespace
+{
+enum VAOSupport { NoVAO, ARBVAO, AppleVAO };
+
+VAOSupport vaoSupport()
+{
+#ifdef GL_ARB_vertex_array_object
+    if (GLEW_ARB_vertex_array_object) {
+        return ARBVAO;
+    }
+#endif
+    if (GLEW_APPLE_vertex_array_object) {
+        return AppleVAO;
+    }
+    return NoVAO;
+}
+
+void deleteVertexArray(VAOSupport support, GLuint id)
+{
+#ifdef GL_ARB_vertex_array_object
+    if (support == ARBVAO) {
+        glDeleteVertexArrays(1, &id);
+        return;
+    }
+#endif
+    if (support == AppleVAO) {
+        glDeleteVertexArraysAPPLE(1, &id);
+    }
+}
+
+void bindVertexArray(VAOSupport support, GLuint id)
+{
+#ifdef GL_ARB_vertex_array_object
+    if (support == ARBVAO) {
+        glBindVertexArray(id);
+        return;
+    }
+#endif
+    if (support == AppleVAO) {
+        glBindVertexArrayAPPLE(id);
+    }
+}
+
+char* mapBufferRange(GLenum target, int offset, int size, GeometryBuffer::MapAccess access)
+{
+#ifdef GL_ARB_map_buffer_range
+    if (GLEW_ARB_map_buffer_range) {
+        // Only the requested range has to be transferred or synchronized
+        GLbitfield flags = 0;
+        if (access != GeometryBuffer::WriteOnly) {
+            flags |= GL_MAP_READ_BIT;
+        }
+        if (access != GeometryBuffer::ReadOnly) {
+            flags |= GL_MAP_WRITE_BIT;
+        }
+        return reinterpret_cast<char*>(glMapBufferRange(target, offset, size, flags));
+    }
+#endif
+    GLenum glaccess = GL_READ_WRITE;
+    if (access == GeometryBuffer::ReadOnly) {
+        glaccess = GL_READ_ONLY;
+    } else if (access == GeometryBuffer::WriteOnly) {
+        glaccess = GL_WRITE_ONLY;
+    }
+    char* data = reinterpret_cast<char*>(glMapBuffer(target, glaccess));
+    return data ? data + offset : 0;
+}
+}
+
 GeometryBufferVBO::GeometryBufferVBO(const GeometryBufferFormat& format) :
     GeometryBufferVertexArray(format, false)
 {
+    mVAOId = 0;
+    mStridedOffset = mStridedCount = mStridedStride = 0;
     createArrays();
 }
 
 GeometryBufferVBO::~GeometryBufferVBO()
 {
+    if (mVAOId) {
+        deleteVertexArray(vaoSupport(), mVAOId);
+    }
+    glDeleteBuffers(1, &mVBOId);
+    if (format().isIndexed()) {
+        glDeleteBuffers(1, &mIndexVBOId);
+    }
+}
+
+GLenum GeometryBufferVBO::glUsage() const
+{
+    switch (format().usage()) {
+        case GeometryBufferFormat::DynamicUsage:
+            return GL_DYNAMIC_DRAW;
+        case GeometryBufferFormat::StreamUsage:
+            return GL_STREAM_DRAW;
+        default:
+            return GL_STATIC_DRAW;
+    }
 }
 
 void GeometryBufferVBO::createArrays()
@@ -308,53 +1232,523 @@ void GeometryBufferVBO::createArrays()
     qDebug() << "VBO: creating buffer of" << bufferSize() << "bytes";
     glGenBuffers(1, &mVBOId);
     glBindBuffer(GL_ARRAY_BUFFER, mVBOId);
-    glBufferData(GL_ARRAY_BUFFER, bufferSize(), 0, GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, bufferSize(), 0, glUsage());
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 
     if (format().isIndexed()) {
         qDebug() << "VBO: creating index buffer of" << indexBufferSize() << "bytes";
         glGenBuffers(1, &mIndexVBOId);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER_ARB, mIndexVBOId);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER_ARB, indexBufferSize(), 0, GL_STATIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER_ARB, indexBufferSize(), 0, glUsage());
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
     }
 }
 
 bool GeometryBufferVBO::bind()
 {
+    VAOSupport support = vaoSupport();
+    if (support == NoVAO) {
+        glBindBuffer(GL_ARRAY_BUFFER, mVBOId);
+        if (format().isIndexed()) {
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER_ARB, mIndexVBOId);
+        }
+        if (!GeometryBufferVertexArray::bind()) {
+            return false;
+        }
+        if (mInstanceBuffer) {
+            glBindBuffer(GL_ARRAY_BUFFER, mVBOId);
+        }
+        return true;
+    }
+
+    // Generic and per-instance attributes have to be re-recorded when the
+    //  program or the instance buffer changes
+    bool locationsChanged = resolveAttributeLocations();
+    bool instancesChanged = resolveInstanceLayout();
+    if ((locationsChanged || instancesChanged) && mVAOId) {
+        deleteVertexArray(support, mVAOId);
+        mVAOId = 0;
+    }
+    bool created = false;
+    if (!mVAOId) {
+#ifdef GL_ARB_vertex_array_object
+        if (support == ARBVAO) {
+            glGenVertexArrays(1, &mVAOId);
+        } else
+#endif
+        glGenVertexArraysAPPLE(1, &mVAOId);
+        created = true;
+    }
+    bindVertexArray(support, mVAOId);
+    // The array buffer binding isn't part of the VAO state, but it's still
+    //  needed for uploading data while the buffer is bound.
     glBindBuffer(GL_ARRAY_BUFFER, mVBOId);
-    if (format().isIndexed()) {
+    // ARB VAOs record the element array binding, APPLE ones don't.
+    if (format().isIndexed() && (created || support == AppleVAO)) {
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER_ARB, mIndexVBOId);
     }
-
-    return GeometryBufferVertexArray::bind();
+    if (created) {
+        // The array setup only depends on the format, which can't change
+        //  during the buffer's lifetime, the attribute locations and the
+        //  instance buffer's layout, so it's recorded only once for them.
+        enableArrays(0);
+        if (mInstanceBuffer) {
+            glBindBuffer(GL_ARRAY_BUFFER, mVBOId);
+        }
+    }
+    return true;
 }
 
 bool GeometryBufferVBO::unbind()
 {
-    if (!GeometryBufferVertexArray::unbind()) {
-        return false;
+    flushStridedData();
+    VAOSupport support = vaoSupport();
+    if (support == NoVAO) {
+        if (!GeometryBufferVertexArray::unbind()) {
+            return false;
+        }
+    } else {
+        bindVertexArray(support, 0);
     }
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
-    if (format().isIndexed()) {
+    if (format().isIndexed() && support != ARBVAO) {
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
     }
     return true;
 }
 
+void GeometryBufferVBO::orphan()
+{
+    // Pending writes would only end up in the discarded storage
+    mStridedData.clear();
+    // Respecifying the storage lets the driver hand us fresh memory instead
+    //  of synchronizing with draws that still use the old contents.
+    glBufferData(GL_ARRAY_BUFFER, bufferSize(), 0, glUsage());
+    if (format().isIndexed()) {
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER_ARB, indexBufferSize(), 0, glUsage());
+    }
+}
+
+bool GeometryBufferVBO::renderIndexedIndirect(int drawCount, int offset)
+{
+#ifdef GL_ARB_multi_draw_indirect
+    if (GLEW_ARB_multi_draw_indirect) {
+        PrimitiveRestartScope restart(format());
+        glMultiDrawElementsIndirect(mPrimitiveType, format().indexType(), reinterpret_cast<char*>(0) + offset, drawCount, 0);
+        return true;
+    }
+#endif
+    return false;
+}
+
 void GeometryBufferVBO::addData(void* data, int size, int offset)
 {
     qDebug() << "  VBO::addData(): size=" << size << ", offset=" << offset;
+    flushStridedData();
     glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
 }
 
-void GeometryBufferVBO::addIndices(unsigned int* indices, int count, int offset)
+void GeometryBufferVBO::addStridedData(void* data, int size, int count, int offset, int stride)
+{
+    qDebug() << "  VBO::addStridedData(): size=" << size << ", count=" << count << ", offset=" << offset << ", stride=" << stride;
+    // Records start at multiples of the stride in interleaved buffers
+    int recordoffset = offset % stride;
+    int first = offset - recordoffset;
+    if (!mStridedData.isEmpty() && (first != mStridedOffset || count != mStridedCount || stride != mStridedStride)) {
+        flushStridedData();
+    }
+    if (mStridedData.isEmpty()) {
+        mStridedOffset = first;
+        mStridedCount = count;
+        mStridedStride = stride;
+        mStridedData.resize(count * stride);
+        mStridedWritten.fill(0, stride);
+    }
+
+    char* dst = mStridedData.data() + recordoffset;
+    char* src = reinterpret_cast<char*>(data);
+    for (int i = 0; i < count; i++) {
+        memcpy(dst + i * stride, src + i * size, size);
+    }
+    memset(mStridedWritten.data() + recordoffset, 1, size);
+}
+
+void GeometryBufferVBO::flushStridedData()
+{
+    if (mStridedData.isEmpty()) {
+        return;
+    }
+    int size = mStridedCount * mStridedStride;
+    if (!mStridedWritten.contains(0)) {
+        // All attributes were written, e.g. by a full update
+        glBufferSubData(GL_ARRAY_BUFFER, mStridedOffset, size, mStridedData.constData());
+        mStridedData.clear();
+        return;
+    }
+
+    // Only some attributes were written, so the others in the same records
+    //  have to be kept. Copy the written runs of bytes through one mapping
+    //  of the touched range.
+    QList<int> runs;
+    for (int i = 0; i < mStridedStride; i++) {
+        if (mStridedWritten[i] && (i == 0 || !mStridedWritten[i-1])) {
+            int end = i;
+            while (end < mStridedStride && mStridedWritten[end]) {
+                end++;
+            }
+            runs << i << end - i;
+        }
+    }
+    char* buffer = mapBufferRange(GL_ARRAY_BUFFER, mStridedOffset, size, WriteOnly);
+    for (int i = 0; i < mStridedCount; i++) {
+        const char* src = mStridedData.constData() + i * mStridedStride;
+        for (int r = 0; r < runs.count(); r += 2) {
+            if (buffer) {
+                memcpy(buffer + i * mStridedStride + runs[r], src + runs[r], runs[r+1]);
+            } else {
+                glBufferSubData(GL_ARRAY_BUFFER, mStridedOffset + i * mStridedStride + runs[r], runs[r+1], src + runs[r]);
+            }
+        }
+    }
+    if (buffer) {
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+    mStridedData.clear();
+}
+
+void GeometryBufferVBO::addIndexData(void* data, int size, int offset)
+{
+    qDebug() << "  VBO::addIndexData(): size=" << size << ", offset=" << offset;
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER_ARB, offset, size, data);
+}
+
+char* GeometryBufferVBO::mapData(int offset, int size, MapAccess access)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, mVBOId);
+    flushStridedData();
+    char* data = mapBufferRange(GL_ARRAY_BUFFER, offset, size, access);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return data;
+}
+
+void GeometryBufferVBO::unmapData()
+{
+    glBindBuffer(GL_ARRAY_BUFFER, mVBOId);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+char* GeometryBufferVBO::mapIndexData(int offset, int size, MapAccess access)
+{
+    // The element array binding is part of the VAO state, so make sure that
+    //  no VAO is bound while it's changed.
+    VAOSupport support = vaoSupport();
+    if (support != NoVAO) {
+        bindVertexArray(support, 0);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER_ARB, mIndexVBOId);
+    char* data = mapBufferRange(GL_ELEMENT_ARRAY_BUFFER_ARB, offset, size, access);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+    return data;
+}
+
+void GeometryBufferVBO::unmapIndexData()
+{
+    // See mapIndexData()
+    VAOSupport support = vaoSupport();
+    if (support != NoVAO) {
+        bindVertexArray(support, 0);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER_ARB, mIndexVBOId);
+    glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER_ARB);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+}
+
+
+/**  GeometryBufferRing  **/
+namespace
+{
+GeometryBufferFormat ringFormat(const GeometryBufferFormat& format)
+{
+    GeometryBufferFormat fmt = format;
+    fmt.setLayout(GeometryBufferFormat::Interleaved);
+    fmt.setUsage(GeometryBufferFormat::StreamUsage);
+    fmt.setIndexType(GL_UNSIGNED_INT);
+    return fmt;
+}
+}
+
+GeometryBufferRing::GeometryBufferRing(const GeometryBufferFormat& format, int regions) :
+    GeometryBuffer(ringFormat(format))
+{
+    mRegionCount = qMax(regions, 1);
+    mRegion = 0;
+    mBound = false;
+    mVertexCursor = mIndexCursor = 0;
+    mFences = new void*[mRegionCount];
+    for (int i = 0; i < mRegionCount; i++) {
+        mFences[i] = 0;
+    }
+
+    mPersistent = false;
+#ifdef GL_ARB_buffer_storage
+    mPersistent = GLEW_ARB_buffer_storage;
+#endif
+    if (!isSupported()) {
+        qCritical() << "GeometryBufferRing: required OpenGL extensions are not supported";
+    }
+
+    qDebug() << "Ring: creating" << mRegionCount << "regions of" << bufferSize() << "bytes, persistent:" << mPersistent;
+    createStorage(mVertexStorage, GL_ARRAY_BUFFER, bufferSize());
+    createStorage(mIndexStorage, GL_ELEMENT_ARRAY_BUFFER_ARB, indexBufferSize());
+}
+
+GeometryBufferRing::~GeometryBufferRing()
+{
+#ifdef KGLLIB_HAVE_BUFFER_RANGES
+    for (int i = 0; i < mRegionCount; i++) {
+        if (mFences[i]) {
+            glDeleteSync(reinterpret_cast<GLsync>(mFences[i]));
+        }
+    }
+#endif
+    delete[] mFences;
+
+    deleteStorage(mVertexStorage);
+    deleteStorage(mIndexStorage);
+}
+
+bool GeometryBufferRing::isSupported()
+{
+#ifdef KGLLIB_HAVE_BUFFER_RANGES
+    return GLEW_ARB_sync && GLEW_ARB_map_buffer_range;
+#else
+    return false;
+#endif
+}
+
+void GeometryBufferRing::createStorage(Storage& storage, GLenum target, int regionSize)
+{
+    storage.id = 0;
+    storage.target = target;
+    storage.regionSize = regionSize;
+    storage.map = 0;
+    storage.touched = false;
+    if (!regionSize || !isSupported()) {
+        return;
+    }
+
+    int size = regionSize * mRegionCount;
+    glGenBuffers(1, &storage.id);
+    glBindBuffer(target, storage.id);
+#ifdef GL_ARB_buffer_storage
+    if (mPersistent) {
+        // Map the buffer once and keep it mapped for its whole lifetime
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(target, size, 0, flags);
+        storage.map = reinterpret_cast<char*>(glMapBufferRange(target, 0, size, flags));
+    } else
+#endif
+    {
+        glBufferData(target, size, 0, GL_STREAM_DRAW);
+    }
+    glBindBuffer(target, 0);
+}
+
+void GeometryBufferRing::deleteStorage(Storage& storage)
+{
+    if (!storage.id) {
+        return;
+    }
+    // Deleting the buffer also unmaps it
+    glDeleteBuffers(1, &storage.id);
+    storage.id = 0;
+    storage.map = 0;
+}
+
+char* GeometryBufferRing::regionPointer(Storage& storage)
+{
+    if (mPersistent) {
+        return storage.map ? storage.map + mRegion * storage.regionSize : 0;
+    }
+#ifdef KGLLIB_HAVE_BUFFER_RANGES
+    if (!storage.map && storage.id) {
+        // The fence guarantees that the GPU isn't using this region anymore,
+        //  so we can map it without synchronization. The first mapping in a
+        //  frame can also discard the old contents, later ones must keep the
+        //  data that has already been written.
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+        if (!storage.touched) {
+            flags |= GL_MAP_INVALIDATE_RANGE_BIT;
+        }
+        glBindBuffer(storage.target, storage.id);
+        storage.map = reinterpret_cast<char*>(glMapBufferRange(storage.target,
+                mRegion * storage.regionSize, storage.regionSize, flags));
+        glBindBuffer(storage.target, mBound ? storage.id : 0);
+        storage.touched = true;
+    }
+#endif
+    return storage.map;
+}
+
+void GeometryBufferRing::unmapStorage(Storage& storage)
+{
+    if (mPersistent || !storage.map) {
+        return;
+    }
+    // Buffers can't be used for rendering while they're mapped
+    glBindBuffer(storage.target, storage.id);
+    glUnmapBuffer(storage.target);
+    glBindBuffer(storage.target, mBound ? storage.id : 0);
+    storage.map = 0;
+}
+
+void GeometryBufferRing::beginFrame()
+{
+    unmapStorage(mVertexStorage);
+    unmapStorage(mIndexStorage);
+
+    mRegion = (mRegion + 1) % mRegionCount;
+    mVertexCursor = mIndexCursor = 0;
+    mVertexStorage.touched = mIndexStorage.touched = false;
+
+#ifdef KGLLIB_HAVE_BUFFER_RANGES
+    if (mFences[mRegion]) {
+        // Wait until the GPU has finished drawing from this region
+        GLsync fence = reinterpret_cast<GLsync>(mFences[mRegion]);
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {
+        }
+        glDeleteSync(fence);
+        mFences[mRegion] = 0;
+    }
+#endif
+}
+
+void GeometryBufferRing::endFrame()
+{
+    unmapStorage(mVertexStorage);
+    unmapStorage(mIndexStorage);
+
+#ifdef KGLLIB_HAVE_BUFFER_RANGES
+    if (mFences[mRegion]) {
+        glDeleteSync(reinterpret_cast<GLsync>(mFences[mRegion]));
+    }
+    mFences[mRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+#endif
+}
+
+void* GeometryBufferRing::allocateVertices(int count, int* first)
+{
+    if (count <= 0 || mVertexCursor + count > format().vertexCount()) {
+        return 0;
+    }
+    char* region = regionPointer(mVertexStorage);
+    if (!region) {
+        return 0;
+    }
+
+    if (first) {
+        *first = mVertexCursor;
+    }
+    char* data = region + mVertexCursor * mVertexData.elementStride();
+    mVertexCursor += count;
+    return data;
+}
+
+unsigned int* GeometryBufferRing::allocateIndices(int count, int* first)
+{
+    if (count <= 0 || mIndexCursor + count > format().indexCount()) {
+        return 0;
+    }
+    char* region = regionPointer(mIndexStorage);
+    if (!region) {
+        return 0;
+    }
+
+    if (first) {
+        *first = mIndexCursor;
+    }
+    unsigned int* data = reinterpret_cast<unsigned int*>(region) + mIndexCursor;
+    mIndexCursor += count;
+    return data;
+}
+
+void GeometryBufferRing::addData(void* data, int size, int offset)
+{
+    char* region = regionPointer(mVertexStorage);
+    if (region) {
+        memcpy(region + offset, data, size);
+    }
+}
+
+void GeometryBufferRing::addIndexData(void* data, int size, int offset)
+{
+    char* region = regionPointer(mIndexStorage);
+    if (region) {
+        memcpy(region + offset, data, size);
+    }
+}
+
+bool GeometryBufferRing::bind()
+{
+    unmapStorage(mVertexStorage);
+    unmapStorage(mIndexStorage);
+
+    mBound = true;
+    glBindBuffer(GL_ARRAY_BUFFER, mVertexStorage.id);
+    if (format().isIndexed()) {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER_ARB, mIndexStorage.id);
+    }
+    // Vertex pointers point to the start of the current region, so all
+    //  offsets and indices are relative to it.
+    enableArrays(reinterpret_cast<char*>(0) + mRegion * mVertexStorage.regionSize);
+    if (mInstanceBuffer) {
+        glBindBuffer(GL_ARRAY_BUFFER, mVertexStorage.id);
+    }
+
+    return true;
+}
+
+bool GeometryBufferRing::unbind()
+{
+    disableArrays();
+
+    mBound = false;
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (format().isIndexed()) {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+    }
+    return true;
+}
+
+void GeometryBufferRing::renderSubset(int vertices, int offset)
+{
+    // Data might have been written after bind()
+    unmapStorage(mVertexStorage);
+    glDrawArrays(mPrimitiveType, offset, vertices);
+}
+
+void GeometryBufferRing::renderIndexedSubset(int indices, int offset, int baseVertex)
+{
+    unmapStorage(mVertexStorage);
+    unmapStorage(mIndexStorage);
+    int byteoffset = mRegion * mIndexStorage.regionSize + offset * sizeof(unsigned int);
+    drawElements(indices, reinterpret_cast<char*>(0) + byteoffset, baseVertex);
+}
+
+void GeometryBufferRing::renderIndexedSubsetInstanced(int indices, int offset, int instanceCount, int baseVertex)
+{
+    unmapStorage(mVertexStorage);
+    unmapStorage(mIndexStorage);
+    int byteoffset = mRegion * mIndexStorage.regionSize + offset * sizeof(unsigned int);
+    drawElementsInstanced(indices, reinterpret_cast<char*>(0) + byteoffset, instanceCount, baseVertex);
+}
+
+void GeometryBufferRing::renderSubsetInstanced(int vertices, int offset, int instanceCount)
 {
-    qDebug() << "  VBO::addIndices(): count=" << count << ", offset=" << offset;
-    int byteoffset = offset * sizeof(unsigned int);
-    int bytecount = count * sizeof(unsigned int);
-    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER_ARB, byteoffset, bytecount, indices);
+    unmapStorage(mVertexStorage);
+    drawArraysInstanced(offset, vertices, instanceCount);
 }
 
 
@@ -20,11 +20,25 @@
 
 #include "kgllib.h"
 
+#include <QtCore/QList>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
 #include <Eigen/Core>
 
+// Vertex array types which are missing from older GL headers
+#ifndef GL_HALF_FLOAT
+#define GL_HALF_FLOAT 0x140B
+#endif
+#ifndef GL_INT_2_10_10_10_REV
+#define GL_INT_2_10_10_10_REV 0x8D9F
+#endif
+
 
 namespace KGLLib
 {
+class InstanceBuffer;
+class Program;
 
 /**
  * @brief Utility class to represent format of a @ref GeometryBuffer.
@@ -33,6 +47,17 @@ namespace KGLLib
  *  object. That information includes which attributes (e.g. vertices, normals,
  *  texture coordinates) are stored in the buffer as well as the size (number
  *  of components) of each coordinate.
+ *
+ * The format also specifies the @ref Layout of the data, i.e. whether
+ *  different attributes are stored in separate blocks or interleaved.
+ *
+ * Besides the fixed-function attributes, the format can contain any number
+ *  of generic vertex attributes (see @ref addAttribute()) which are accessed
+ *  by name in shaders.
+ *
+ * Fixed-function attributes are specified as floats, but they can be stored
+ *  using more compact types (see e.g. @ref setVertexType()), in which case
+ *  the data is converted when it's added to the buffer.
  **/
 class KGLLIB_EXPORT GeometryBufferFormat
 {
@@ -48,6 +73,50 @@ public:
         TexCoord2 = 1 << 5
     };
 
+    /**
+     * Specifies how the vertex attributes are laid out in the buffer.
+     **/
+    enum Layout
+    {
+        /**
+         * Every attribute is stored in a separate block: first all vertices,
+         *  then all colors, etc. This is the default.
+         **/
+        Planar,
+        /**
+         * All attributes of a vertex are packed into a single record and the
+         *  records are stored one after another. This usually gives better
+         *  vertex fetch performance, but updating a single attribute is
+         *  more expensive.
+         **/
+        Interleaved
+    };
+
+    /**
+     * Hint about how often the contents of the buffer will be changed.
+     *
+     * It is used to pick the storage type, e.g. in case of VBOs it maps
+     *  directly to the usage parameter of glBufferData().
+     **/
+    enum Usage
+    {
+        /**
+         * Data is specified once and rendered many times. This is the
+         *  default.
+         **/
+        StaticUsage,
+        /**
+         * Data is changed repeatedly and rendered many times between the
+         *  changes.
+         **/
+        DynamicUsage,
+        /**
+         * Data is changed (usually every frame) and rendered only a few
+         *  times between the changes.
+         **/
+        StreamUsage
+    };
+
     /**
      * Creates an invalid format.
      *
@@ -75,7 +144,168 @@ public:
     /**
      * Sets number of texture coordinate components to @p size.
      **/
-    void addTexCoords(int size)  { mTexCoordSize = size; }
+    void addTexCoords(int size)  { addTexCoords(0, size); }
+    /**
+     * Sets number of components of the texture coordinate set used for
+     *  texture unit @p unit to @p size.
+     *
+     * Every set is bound to its own texture unit, so e.g. a lightmap can use
+     *  different coordinates than the base texture.
+     **/
+    void addTexCoords(int unit, int size);
+    /**
+     * Adds a generic vertex attribute with the given name.
+     *
+     * Generic attributes can hold arbitrary per-vertex data, e.g. tangents or
+     *  bone weights. When the buffer is bound, each of them is bound to the
+     *  location of the attribute with the same name in the program set using
+     *  @ref GeometryBuffer::setProgram().
+     *
+     * @param name name of the attribute in the shader.
+     * @param size number of components (1-4).
+     * @param type type of the components, e.g. GL_FLOAT or GL_UNSIGNED_BYTE.
+     * @param normalized whether integer values are mapped to [0; 1] (or
+     *  [-1; 1] for signed types) when they're accessed in the shader.
+     * @return index of the added attribute.
+     **/
+    int addAttribute(const QString& name, int size, GLenum type = GL_FLOAT, bool normalized = false);
+
+    /**
+     * Sets the type used to store vertices to @p type.
+     *
+     * Can be GL_FLOAT (the default) or GL_HALF_FLOAT. Note that half floats
+     *  have only 11 bits of precision, so they're only suitable for small
+     *  models.
+     **/
+    void setVertexType(GLenum type)  { mVertexType = type; }
+    /**
+     * @return type used to store vertices.
+     **/
+    GLenum vertexType() const  { return mVertexType; }
+    /**
+     * Sets the type used to store colors to @p type.
+     *
+     * Can be GL_FLOAT (the default) or GL_UNSIGNED_BYTE, in which case the
+     *  colors are stored as normalized bytes and always have 4 components.
+     **/
+    void setColorType(GLenum type)  { mColorType = type; }
+    /**
+     * @return type used to store colors.
+     **/
+    GLenum colorType() const  { return mColorType; }
+    /**
+     * Sets the type used to store normals to @p type.
+     *
+     * Can be GL_FLOAT (the default) or GL_INT_2_10_10_10_REV, in which case
+     *  every normal is packed into 4 bytes.
+     **/
+    void setNormalType(GLenum type)  { mNormalType = type; }
+    /**
+     * @return type used to store normals.
+     **/
+    GLenum normalType() const  { return mNormalType; }
+    /**
+     * Sets the type used to store texture coordinates to @p type.
+     *
+     * Can be GL_FLOAT (the default) or GL_HALF_FLOAT.
+     **/
+    void setTexCoordType(GLenum type)  { mTexCoordType = type; }
+    /**
+     * @return type used to store texture coordinates.
+     **/
+    GLenum texCoordType() const  { return mTexCoordType; }
+    /**
+     * @return whether vertex arrays of the given type are supported by the
+     *  hardware.
+     **/
+    static bool isTypeSupported(GLenum type);
+
+    /**
+     * Sets the layout of vertex attributes to @p layout.
+     *
+     * Default layout is Planar.
+     **/
+    void setLayout(Layout layout)  { mLayout = layout; }
+    /**
+     * @return layout of the vertex attributes.
+     **/
+    Layout layout() const  { return mLayout; }
+    /**
+     * @return whether the vertex attributes are interleaved.
+     **/
+    bool isInterleaved() const  { return mLayout == Interleaved; }
+
+    /**
+     * Sets the usage hint of the buffer to @p usage.
+     *
+     * Default usage is StaticUsage.
+     **/
+    void setUsage(Usage usage)  { mUsage = usage; }
+    /**
+     * @return usage hint of the buffer.
+     **/
+    Usage usage() const  { return mUsage; }
+
+    /**
+     * Sets the type of indices to @p type.
+     *
+     * Can be one of GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+     *  (the default). Smaller types use less memory and bandwidth, but they
+     *  can only be used when all indices fit into the type.
+     *
+     * @see bestIndexType()
+     **/
+    void setIndexType(GLenum type)  { mIndexType = type; }
+    /**
+     * @return type of indices.
+     **/
+    GLenum indexType() const  { return mIndexType; }
+    /**
+     * @return size of a single index in bytes.
+     **/
+    int indexSize() const;
+    /**
+     * @return smallest index type that is recommended for indexing
+     *  @p vertexCount vertices.
+     *
+     * GL_UNSIGNED_BYTE is never returned because it's poorly supported by
+     *  hardware, but it can be set explicitly using setIndexType().
+     *
+     * If @p primitiveRestart is true, then the largest value of the type is
+     *  reserved for the restart index.
+     **/
+    static GLenum bestIndexType(int vertexCount, bool primitiveRestart = false);
+
+    /**
+     * Index value which marks a primitive restart in index arrays given to
+     *  @ref GeometryBuffer::addIndices().
+     **/
+    static const GLuint RestartIndex = 0xffffffff;
+    /**
+     * Enables or disables primitive restart for indexed rendering.
+     *
+     * With primitive restart, a @ref RestartIndex in the indices ends the
+     *  current primitive and starts a new one, so e.g. several triangle
+     *  strips can be rendered with a single draw call without stitching
+     *  them together with degenerate triangles.
+     *
+     * The restart index is stored as the largest value of the index type,
+     *  so that value can't be used for indexing vertices.
+     *
+     * Primitive restart isn't available on all hardware, see
+     *  @ref GeometryBuffer::isPrimitiveRestartSupported(). If it isn't
+     *  supported, the restart indices are rendered as ordinary indices.
+     **/
+    void setPrimitiveRestart(bool restart)  { mPrimitiveRestart = restart; }
+    /**
+     * @return whether primitive restart is enabled.
+     **/
+    bool primitiveRestart() const  { return mPrimitiveRestart; }
+    /**
+     * @return value which marks a primitive restart in the buffer, i.e. the
+     *  largest value of the index type.
+     **/
+    GLuint primitiveRestartIndex() const;
 
     /**
      * @return number of components in a vertex.
@@ -92,7 +322,56 @@ public:
     /**
      * @return number of components in a texture coordinate.
      **/
-    int texCoordSize() const  { return mTexCoordSize; }
+    int texCoordSize() const  { return texCoordSize(0); }
+    /**
+     * @return number of components in a texture coordinate of the set used
+     *  for texture unit @p unit.
+     **/
+    int texCoordSize(int unit) const  { return (unit < mTexCoordSizes.count()) ? mTexCoordSizes[unit] : 0; }
+    /**
+     * @return number of texture coordinate sets, i.e. the highest used
+     *  texture unit + 1.
+     **/
+    int texCoordSetCount() const  { return mTexCoordSizes.count(); }
+
+    /**
+     * @return number of generic vertex attributes.
+     **/
+    int attributeCount() const  { return mAttributes.count(); }
+    /**
+     * @return index of the generic attribute with the given name or -1 if
+     *  there's no such attribute.
+     **/
+    int attributeIndex(const QString& name) const;
+    /**
+     * @return name of the generic attribute with the given index.
+     **/
+    QString attributeName(int index) const  { return mAttributes[index].name; }
+    /**
+     * @return number of components of the generic attribute with the given
+     *  index.
+     **/
+    int attributeSize(int index) const  { return mAttributes[index].size; }
+    /**
+     * @return component type of the generic attribute with the given index.
+     **/
+    GLenum attributeType(int index) const  { return mAttributes[index].type; }
+    /**
+     * @return whether the generic attribute with the given index is
+     *  normalized.
+     **/
+    bool isAttributeNormalized(int index) const  { return mAttributes[index].normalized; }
+
+    /**
+     * @return size of a single component of the given type (e.g. GL_FLOAT)
+     *  in bytes.
+     **/
+    static int typeSize(GLenum type);
+    /**
+     * @return size in bytes of an element with @p size components of the
+     *  given type, taking packed types into account.
+     **/
+    static int elementSize(int size, GLenum type);
 
     /**
      * @return number of vertices.
@@ -120,18 +399,56 @@ public:
      **/
     bool isIndexed() const  { return mIndexCount > 0; }
 
+    /**
+     * @return whether this format is identical to @p other, i.e. buffers
+     *  created using either of them are interchangeable.
+     **/
+    bool operator==(const GeometryBufferFormat& other) const;
+    bool operator!=(const GeometryBufferFormat& other) const  { return !(*this == other); }
+    /**
+     * @return whether a buffer using this format can be used to store data
+     *  described by @p other.
+     *
+     * This is the case when both formats have the same attributes, layout
+     *  and usage and this format has room for at least as many vertices and
+     *  indices as @p other.
+     **/
+    bool canStore(const GeometryBufferFormat& other) const;
+
 protected:
     void init(int vertexCount, int indexCount);
 
+    struct VertexAttribute
+    {
+        QString name;
+        int size;
+        GLenum type;
+        bool normalized;
+
+        bool operator==(const VertexAttribute& other) const
+        {
+            return name == other.name && size == other.size && type == other.type && normalized == other.normalized;
+        }
+    };
+
 private:
     int mVertexCount;
     int mIndexCount;
+    Layout mLayout;
+    Usage mUsage;
+    GLenum mIndexType;
+    bool mPrimitiveRestart;
 
     int mVertexSize;
     int mColorSize;
     int mNormalSize;
-    int mTexCoordSize;  // TODO: support multiple texcoords
-    // TODO: support vertex attributes
+    // Number of texcoord components for each texture unit
+    QVector<int> mTexCoordSizes;
+    GLenum mVertexType;
+    GLenum mColorType;
+    GLenum mNormalType;
+    GLenum mTexCoordType;
+    QList<VertexAttribute> mAttributes;
 };
 
 
@@ -153,6 +470,12 @@ private:
 class KGLLIB_EXPORT GeometryBuffer
 {
 public:
+    /**
+     * Access modes for mapping the buffer's storage, see
+     *  @ref GeometryBufferMapping.
+     **/
+    enum MapAccess { ReadOnly, WriteOnly, ReadWrite };
+
     /**
      * Creates new GeometryBuffer object, using the specified format.
      *
@@ -168,6 +491,25 @@ public:
      **/
     static GeometryBuffer* createBuffer(GeometryBufferFormat::Format format, int vertexCount, int indexCount = 0);
 
+    /**
+     * @return whether indexed rendering with a base vertex is supported
+     *  (see @ref renderIndexedSubset()).
+     *
+     * If it isn't, then the offset has to be added to the indices before
+     *  they are stored in the buffer.
+     **/
+    static bool isBaseVertexSupported();
+    /**
+     * @return whether instanced rendering is supported (see
+     *  @ref renderIndexedSubsetInstanced()).
+     **/
+    static bool isInstancingSupported();
+    /**
+     * @return whether primitive restart is supported (see
+     *  @ref GeometryBufferFormat::setPrimitiveRestart()).
+     **/
+    static bool isPrimitiveRestartSupported();
+
 
     /**
      * Deletes this buffer and frees all allocated resources.
@@ -189,10 +531,14 @@ public:
      *
      * @param indices number of indices to use.
      * @param offset array index of the first index to use.
+     * @param baseVertex value added to every index before fetching the
+     *  vertex. This lets you use the same index data for geometry stored at
+     *  different positions in the buffer. Non-zero values can only be used
+     *  if @ref isBaseVertexSupported() returns true.
      *
      * @see render(), render(int, int), bind(), unbind()
      **/
-    virtual void renderIndexedSubset(int indices, int offset) = 0;
+    virtual void renderIndexedSubset(int indices, int offset, int baseVertex = 0) = 0;
     /**
      * Renders a subset of non-indexed buffer data.
      * The buffer must be bound (by calling the bind() method) before it can
@@ -204,6 +550,60 @@ public:
      * @see render(), renderIndexed(), bind(), unbind()
      **/
     virtual void renderSubset(int vertices, int offset) = 0;
+    /**
+     * Renders @p instanceCount instances of a subset of indexed buffer data
+     *  using a single draw call. Shaders can use gl_InstanceID or
+     *  per-instance attributes (see @ref InstanceBuffer) to tell the
+     *  instances apart.
+     *
+     * Can only be used if @ref isInstancingSupported() returns true.
+     *
+     * @see renderIndexedSubset()
+     **/
+    virtual void renderIndexedSubsetInstanced(int indices, int offset, int instanceCount, int baseVertex = 0) = 0;
+    /**
+     * Renders @p instanceCount instances of a subset of non-indexed buffer
+     *  data using a single draw call.
+     *
+     * Can only be used if @ref isInstancingSupported() returns true.
+     *
+     * @see renderSubset()
+     **/
+    virtual void renderSubsetInstanced(int vertices, int offset, int instanceCount) = 0;
+
+    /**
+     * Renders several subsets of indexed buffer data at once.
+     * This is equivalent to calling @ref renderIndexedSubset() for each
+     *  subset, but uses a single glMultiDrawElements() call where possible.
+     *
+     * @param counts array of index counts, one per subset.
+     * @param offsets array of index offsets, one per subset.
+     * @param baseVertices array of base vertices, one per subset. Can be 0
+     *  if no base vertices are used.
+     * @param drawCount number of subsets.
+     **/
+    virtual void renderIndexedSubsets(const int* counts, const int* offsets, const int* baseVertices, int drawCount);
+    /**
+     * Renders several subsets of non-indexed buffer data at once.
+     * This is equivalent to calling @ref renderSubset() for each subset, but
+     *  uses a single glMultiDrawArrays() call where possible.
+     *
+     * @param counts array of vertex counts, one per subset.
+     * @param offsets array of vertex offsets, one per subset.
+     * @param drawCount number of subsets.
+     **/
+    virtual void renderSubsets(const int* counts, const int* offsets, int drawCount);
+    /**
+     * Renders indexed buffer data using @p drawCount draw commands stored in
+     *  the currently bound GL_DRAW_INDIRECT_BUFFER, starting at byte
+     *  @p offset.
+     *
+     * @return false if indirect rendering isn't supported by this buffer, in
+     *  which case nothing is rendered.
+     *
+     * @see DrawCommandBuffer
+     **/
+    virtual bool renderIndexedIndirect(int drawCount, int offset)  { return false; }
 
     /**
      * Binds the buffer. The buffer must be bound before you can use any of the
@@ -219,6 +619,19 @@ public:
      **/
     virtual bool unbind()  { return true; }
 
+    /**
+     * Discards the current contents of the buffer.
+     *
+     * Call this before rewriting the entire buffer. Instead of waiting for
+     *  the GPU to finish using the old data, a new storage is allocated for
+     *  the buffer (this is often called buffer orphaning) and the old one is
+     *  freed once the GPU is done with it.
+     *
+     * The buffer must be bound before this method is called and contents of
+     *  the buffer are undefined until new data has been specified.
+     **/
+    virtual void orphan()  {}
+
     /**
      * Specifies vertex data to be used by this buffer.
      *
@@ -232,17 +645,37 @@ public:
      *
      * Each element of the specified array must consist of the same number of
      *  floats as specified in the format (GeometryBufferFormat::vertexSize()).
+     *  If the format uses a different type for the attribute (e.g.
+     *  GeometryBufferFormat::vertexType()), the data is converted first.
      **/
     void addVertices(void* vertices, int count, int offset = 0);
     void addColors(void* colors, int count, int offset = 0);
     void addNormals(void* normals, int count, int offset = 0);
     void addTexCoords(void* texcoords, int count, int offset = 0);
+    /**
+     * Specifies data of the texture coordinate set used for texture unit
+     *  @p unit.
+     **/
+    void addTexCoords(int unit, void* texcoords, int count, int offset = 0);
+    /**
+     * Specifies data of the generic vertex attribute with index @p attribute
+     *  (see @ref GeometryBufferFormat::addAttribute()).
+     *
+     * Each element of the specified array must consist of as many components
+     *  of the attribute's type as specified in the format.
+     **/
+    void addAttribute(int attribute, void* data, int count, int offset = 0);
     /**
      * Sets the indices array to @p indices. The array must contain at least
      *  @p count entries (if it contains more, then the remaining ones will be
      *  unused).
+     *
+     * The indices are converted to the index type of the buffer's format
+     *  (see @ref GeometryBufferFormat::indexType()) if necessary. If the
+     *  format uses primitive restart, then @ref GeometryBufferFormat::RestartIndex
+     *  is converted to the format's restart index.
      **/
-    virtual void addIndices(unsigned int* indices, int count, int offset = 0) = 0;
+    void addIndices(unsigned int* indices, int count, int offset = 0);
 
     /**
      * Sets the primitive type used to render this batch (e.g. GL_QUADS).
@@ -260,7 +693,54 @@ public:
      **/
     const GeometryBufferFormat& format() const  { return mFormat; }
 
+    /**
+     * Sets the Program used to look up locations of generic vertex
+     *  attributes to @p program.
+     *
+     * The locations are looked up the next time the buffer is bound and
+     *  cached until the program changes. Attributes which aren't used by the
+     *  program are not enabled.
+     **/
+    void setProgram(Program* program);
+    /**
+     * @return Program used to look up locations of generic vertex attributes.
+     **/
+    Program* program() const  { return mProgram; }
+
+    /**
+     * Sets the InstanceBuffer whose per-instance attributes are enabled
+     *  together with the vertex attributes of this buffer. @ref Batch sets
+     *  it automatically before binding the buffer.
+     *
+     * If vertex array objects are used, the instance attributes are recorded
+     *  into the buffer's VAO along with the rest of the array setup, so that
+     *  binding doesn't respecify them for every draw. The VAO is re-recorded
+     *  when the instance buffer or its layout changes, so batches sharing a
+     *  GeometryBuffer should preferably also share the InstanceBuffer.
+     *
+     * The buffer doesn't take ownership of @p instances. Reset it using
+     *  setInstanceBuffer(0) before deleting the InstanceBuffer if the
+     *  GeometryBuffer is still bound afterwards.
+     **/
+    void setInstanceBuffer(InstanceBuffer* instances);
+    /**
+     * @return InstanceBuffer used by this buffer.
+     **/
+    InstanceBuffer* instanceBuffer() const  { return mInstanceBuffer; }
+
+    /**
+     * @return whether contents of this buffer are only valid for a single
+     *  frame and thus have to be re-specified every frame.
+     *
+     * @see GeometryBufferRing
+     **/
+    virtual bool isTransient() const  { return false; }
+
 protected:
+    // Copies data prepared in worker threads using addData() and friends
+    friend class UploadQueue;
+    friend class GeometryBufferMapping;
+
     GeometryBuffer(const GeometryBufferFormat& format);
 
     virtual void init(const GeometryBufferFormat& format);
@@ -281,6 +761,93 @@ protected:
      * @param offset offset of the internal buffer in bytes
      **/
     virtual void addData(void* data, int size, int offset) = 0;
+    /**
+     * Writes index data to the internal index buffer.
+     * @param data pointer to the data, already in the format's index type
+     * @param size size of the data in bytes
+     * @param offset offset of the internal index buffer in bytes
+     **/
+    virtual void addIndexData(void* data, int size, int offset) = 0;
+    /**
+     * Writes @p count elements of @p size bytes each to the internal buffer.
+     * The elements are tightly packed in @p data, but in the internal buffer
+     *  they are @p stride bytes apart, starting at @p offset bytes.
+     *
+     * Default implementation calls addData() for every element.
+     **/
+    virtual void addStridedData(void* data, int size, int count, int offset, int stride);
+
+    /**
+     * Maps @p size bytes of the internal buffer, starting at @p offset bytes,
+     *  into client memory.
+     *
+     * @return pointer to the mapped data or 0 if the buffer can't be mapped.
+     *  Default implementation returns 0.
+     **/
+    virtual char* mapData(int offset, int size, MapAccess access)  { return 0; }
+    /**
+     * Unmaps the data mapped using mapData().
+     **/
+    virtual void unmapData()  {}
+    /**
+     * Maps @p size bytes of the internal index buffer, starting at @p offset
+     *  bytes, into client memory.
+     *
+     * @return pointer to the mapped data or 0 if the buffer can't be mapped.
+     **/
+    virtual char* mapIndexData(int offset, int size, MapAccess access)  { return 0; }
+    /**
+     * Unmaps the data mapped using mapIndexData().
+     **/
+    virtual void unmapIndexData()  {}
+
+    /**
+     * Enables client states and sets up array pointers for all attributes
+     *  in the format. Attribute offsets are relative to @p base (which is 0
+     *  when a buffer object is bound).
+     *
+     * The attributes of the @ref instanceBuffer() are enabled as well. This
+     *  changes the GL_ARRAY_BUFFER binding, so callers using buffer objects
+     *  have to rebind their own buffer afterwards.
+     **/
+    void enableArrays(char* base);
+    /**
+     * Issues an indexed draw call using @p count indices at @p indices,
+     *  using base vertex if @p baseVertex is non-zero.
+     **/
+    void drawElements(int count, const char* indices, int baseVertex);
+    /**
+     * Issues an instanced indexed draw call, see @ref drawElements().
+     **/
+    void drawElementsInstanced(int count, const char* indices, int instanceCount, int baseVertex);
+    /**
+     * Issues an instanced non-indexed draw call.
+     **/
+    void drawArraysInstanced(int first, int count, int instanceCount);
+    /**
+     * Issues an indexed draw call for each of the @p drawCount index arrays
+     *  in @p indices, preferably using a single glMultiDrawElements() call.
+     *  @p baseVertices can be 0 if no base vertices are used.
+     **/
+    void multiDrawElements(const int* counts, const GLvoid** indices, const int* baseVertices, int drawCount);
+    /**
+     * Disables client states enabled by enableArrays().
+     **/
+    void disableArrays();
+    /**
+     * Looks up the locations of generic vertex attributes if the program has
+     *  changed since the last call.
+     *
+     * @return true if the locations were looked up.
+     **/
+    bool resolveAttributeLocations();
+    /**
+     * Checks whether the instance buffer or its layout has changed since
+     *  the last call.
+     *
+     * @return true if the instance attributes have to be specified again.
+     **/
+    bool resolveInstanceLayout();
 
 protected:
     struct AttributeData
@@ -290,27 +857,202 @@ protected:
             size = _size;
             offset = _offset;
             stride = _stride;
+            type = GL_FLOAT;
+            components = 0;
         }
         AttributeData()
         {
             size = offset = stride = 0;
+            type = GL_FLOAT;
+            components = 0;
         }
 
+        // Type of the stored components
+        GLenum type;
+        // Number of stored components per element
+        int components;
         // Size of a single element, in bytes
         int size;
         // Offset of the first element in the buffer
         int offset;
-        // Number of bytes between two consecutive elements
+        // Number of bytes between two consecutive elements, 0 if they're tightly packed
         int stride;
+
+        // Number of bytes between two consecutive elements
+        int elementStride() const  { return stride ? stride : size; }
     };
 
+    void addAttributeData(const AttributeData& attr, void* data, int count, int offset);
+    /**
+     * Adds float data with @p components components per element to a
+     *  fixed-function attribute, converting it to the attribute's type if
+     *  necessary.
+     **/
+    void addFloatAttributeData(const AttributeData& attr, int components, void* data, int count, int offset);
+    /**
+     * Initializes @p attr for storing @p components components of the given
+     *  type, padding the elements to a multiple of 4 bytes.
+     **/
+    static void initAttributeData(AttributeData* attr, int components, GLenum type);
+
     GLenum mPrimitiveType;
     GeometryBufferFormat mFormat;
 
     AttributeData mVertexData;
     AttributeData mColorData;
     AttributeData mNormalData;
-    AttributeData mTexCoordData;
+    // One texcoord set per texture unit
+    QVector<AttributeData> mTexCoordData;
+    QVector<AttributeData> mAttributeData;
+    // Locations of generic attributes in mProgram, -1 for unused ones
+    QVector<int> mAttributeLocations;
+    Program* mProgram;
+    bool mLocationsValid;
+    InstanceBuffer* mInstanceBuffer;
+    // Layout revision of mInstanceBuffer the arrays were last set up with
+    int mInstanceRevision;
+    bool mInstanceLayoutValid;
+};
+
+/**
+ * @brief Typed view of an attribute in mapped buffer storage.
+ *
+ * Elements are accessed using the [] operator, index 0 being the first
+ *  mapped element. Consecutive elements are stride bytes apart, so the view
+ *  works for both planar and interleaved layouts.
+ *
+ * @see GeometryBufferMapping
+ **/
+template<typename T> class GeometryBufferView
+{
+public:
+    GeometryBufferView() : mData(0), mStride(0), mCount(0)  {}
+    GeometryBufferView(char* data, int stride, int count) : mData(data), mStride(stride), mCount(count)  {}
+
+    /**
+     * @return whether the view points to mapped data.
+     **/
+    bool isValid() const  { return mData != 0; }
+    /**
+     * @return number of elements in the view.
+     **/
+    int count() const  { return mCount; }
+    /**
+     * @return number of bytes between two consecutive elements.
+     **/
+    int stride() const  { return mStride; }
+
+    T& operator[](int i) const  { return *reinterpret_cast<T*>(mData + i * mStride); }
+
+private:
+    char* mData;
+    int mStride;
+    int mCount;
+};
+
+/**
+ * @brief Maps a range of a GeometryBuffer into client memory.
+ *
+ * The add*() methods of GeometryBuffer copy data from an array prepared by
+ *  the caller. GeometryBufferMapping instead gives direct access to the
+ *  buffer's storage, so that generated geometry can be written straight into
+ *  it without a temporary array:
+ * @code
+ * GeometryBufferMapping mapping(buffer, 0, vertexCount);
+ * GeometryBufferView<Vector3f> vertices = mapping.vertices<Vector3f>();
+ * GeometryBufferView<Vector2f> texcoords = mapping.texCoords<Vector2f>();
+ * for (int i = 0; i < vertexCount; i++) {
+ *     vertices[i] = ...;
+ *     texcoords[i] = ...;
+ * }
+ * // The buffer is unmapped when mapping goes out of scope
+ * @endcode
+ *
+ * Buffer objects are mapped using glMapBufferRange() if ARB_map_buffer_range
+ *  is supported and glMapBuffer() otherwise. Buffers using vertex arrays give
+ *  access to their memory directly. @ref GeometryBufferRing provides its own
+ *  allocation methods and can't be mapped.
+ *
+ * The type used for a view must match the type the attribute is stored in
+ *  (see e.g. @ref GeometryBufferFormat::vertexType()), so e.g. compact
+ *  normals have to be accessed as GLuint and half float texcoords as
+ *  GLushort arrays.
+ *
+ * The buffer must not be bound or used for rendering while it is mapped.
+ **/
+class KGLLIB_EXPORT GeometryBufferMapping
+{
+public:
+    /**
+     * Maps @p count vertices starting from @p first and @p indexCount
+     *  indices starting from @p indexFirst.
+     **/
+    GeometryBufferMapping(GeometryBuffer* buffer, int first, int count, int indexFirst = 0, int indexCount = 0,
+                          GeometryBuffer::MapAccess access = GeometryBuffer::WriteOnly);
+    /**
+     * Unmaps the buffer.
+     **/
+    ~GeometryBufferMapping();
+
+    /**
+     * @return whether the requested ranges could be mapped.
+     **/
+    bool isValid() const;
+
+    /**
+     * @return view of the mapped vertices.
+     **/
+    template<typename T> GeometryBufferView<T> vertices() const  { return view<T>(mBuffer->mVertexData); }
+    /**
+     * @return view of the mapped colors.
+     **/
+    template<typename T> GeometryBufferView<T> colors() const  { return view<T>(mBuffer->mColorData); }
+    /**
+     * @return view of the mapped normals.
+     **/
+    template<typename T> GeometryBufferView<T> normals() const  { return view<T>(mBuffer->mNormalData); }
+    /**
+     * @return view of the mapped texture coordinates of the given unit.
+     **/
+    template<typename T> GeometryBufferView<T> texCoords(int unit = 0) const
+    {
+        return (unit < mBuffer->mTexCoordData.count()) ? view<T>(mBuffer->mTexCoordData[unit]) : GeometryBufferView<T>();
+    }
+    /**
+     * @return view of the mapped generic attribute with the given index.
+     **/
+    template<typename T> GeometryBufferView<T> attribute(int index) const  { return view<T>(mBuffer->mAttributeData[index]); }
+    /**
+     * @return view of the mapped indices. @p T must have the size of the
+     *  format's index type.
+     **/
+    template<typename T> GeometryBufferView<T> indices() const
+    {
+        char* data = indexPointer(sizeof(T));
+        return GeometryBufferView<T>(data, sizeof(T), data ? mIndexCount : 0);
+    }
+
+private:
+    template<typename T> GeometryBufferView<T> view(const GeometryBuffer::AttributeData& attr) const
+    {
+        char* data = attributePointer(attr, sizeof(T));
+        return GeometryBufferView<T>(data, attr.elementStride(), data ? mCount : 0);
+    }
+    char* attributePointer(const GeometryBuffer::AttributeData& attr, int elementSize) const;
+    char* indexPointer(int elementSize) const;
+
+    // Not copyable
+    GeometryBufferMapping(const GeometryBufferMapping&);
+    GeometryBufferMapping& operator=(const GeometryBufferMapping&);
+
+    GeometryBuffer* mBuffer;
+    int mFirst;
+    int mCount;
+    int mIndexCount;
+    // Mapped data and its offset in the buffer, in bytes
+    char* mData;
+    int mDataOffset;
+    char* mIndexData;
 };
 
 /**
@@ -327,10 +1069,12 @@ public:
     virtual bool bind();
     virtual bool unbind();
 
-    virtual void renderIndexedSubset(int indices, int offset);
+    virtual void renderIndexedSubset(int indices, int offset, int baseVertex = 0);
     virtual void renderSubset(int vertices, int offset);
-
-    virtual void addIndices(unsigned int* indices, int count, int offset = 0);
+    virtual void renderIndexedSubsetInstanced(int indices, int offset, int instanceCount, int baseVertex = 0);
+    virtual void renderSubsetInstanced(int vertices, int offset, int instanceCount);
+    virtual void renderIndexedSubsets(const int* counts, const int* offsets, const int* baseVertices, int drawCount);
+    virtual void renderSubsets(const int* counts, const int* offsets, int drawCount);
 
 protected:
     // FIXME: ugly
@@ -338,6 +1082,9 @@ protected:
 
     virtual void createArrays();
     virtual void addData(void* data, int size, int offset);
+    virtual void addIndexData(void* data, int size, int offset);
+    virtual char* mapData(int offset, int size, MapAccess access);
+    virtual char* mapIndexData(int offset, int size, MapAccess access);
 
 private:
     char* mBuffer;
@@ -349,6 +1096,13 @@ private:
  *
  * This is the fastest way of rendering but hardware support for VBOs (vertex
  *  buffer objects) is required.
+ *
+ * If vertex array objects are supported (either ARB_vertex_array_object or
+ *  APPLE_vertex_array_object), the array setup is recorded into a VAO the
+ *  first time the buffer is bound, so that subsequent binds only need to bind
+ *  the VAO instead of re-specifying every array. Note that VAOs can't be
+ *  shared between contexts, so the buffer must always be used with the
+ *  context it was first bound in.
  **/
 class GeometryBufferVBO : public GeometryBufferVertexArray
 {
@@ -359,14 +1113,191 @@ public:
     virtual bool bind();
     virtual bool unbind();
 
-    virtual void addIndices(unsigned int* indices, int count, int offset = 0);
+    virtual void orphan();
+
+    virtual bool renderIndexedIndirect(int drawCount, int offset);
 
 protected:
     virtual void createArrays();
     virtual void addData(void* data, int size, int offset);
+    virtual void addIndexData(void* data, int size, int offset);
+    virtual void addStridedData(void* data, int size, int count, int offset, int stride);
+    virtual char* mapData(int offset, int size, MapAccess access);
+    virtual void unmapData();
+    virtual char* mapIndexData(int offset, int size, MapAccess access);
+    virtual void unmapIndexData();
+
+    /**
+     * @return OpenGL buffer usage corresponding to the format's usage hint.
+     **/
+    GLenum glUsage() const;
+
+    /**
+     * Uploads the interleaved attribute data collected by addStridedData().
+     *  The vertex buffer must be bound.
+     **/
+    void flushStridedData();
 
 private:
     GLuint mVBOId, mIndexVBOId;
+    GLuint mVAOId;
+
+    // Interleaved attributes are written one at a time. They're collected
+    //  into whole records here and uploaded together, see flushStridedData().
+    QVector<char> mStridedData;
+    // Which bytes of a record have been written
+    QVector<char> mStridedWritten;
+    int mStridedOffset;
+    int mStridedCount;
+    int mStridedStride;
+};
+
+/**
+ * @brief GeometryBuffer for geometry that is regenerated every frame.
+ *
+ * GeometryBufferRing is backed by buffer objects which are split into
+ *  several regions, each of them big enough to hold one frame's worth of
+ *  data (as specified by the vertex and index counts of the format). Every
+ *  frame, the next region is used, so that the CPU can write data for the
+ *  current frame while the GPU is still drawing the previous ones. Fences are
+ *  used to make sure that a region isn't overwritten before the GPU is done
+ *  with it.
+ *
+ * The buffers are mapped persistently if ARB_buffer_storage is supported.
+ *  Otherwise, the current region is mapped using glMapBufferRange() and
+ *  unmapped when the buffer is bound. Either way, data is written directly
+ *  into the memory used by the GPU and no synchronization with the driver is
+ *  needed. Use @ref isSupported() to check whether the required extensions
+ *  are available.
+ *
+ * Vertex data is always stored using the interleaved layout and indices are
+ *  always of type GL_UNSIGNED_INT.
+ *
+ * Rendering a frame using a ring buffer looks like this:
+ * @code
+ * ring->beginFrame();
+ * int first;
+ * float* vertices = reinterpret_cast<float*>(ring->allocateVertices(count, &first));
+ * // Write count vertices (in the interleaved format) to vertices
+ * ...
+ * ring->bind();
+ * ring->renderSubset(count, first);
+ * ring->unbind();
+ * ring->endFrame();
+ * @endcode
+ *
+ * The usual add*() methods can also be used. Their offsets are relative to
+ *  the start of the current region. Batch objects using a ring buffer as
+ *  their shared buffer re-upload their data every time they are updated.
+ **/
+class KGLLIB_EXPORT GeometryBufferRing : public GeometryBuffer
+{
+public:
+    /**
+     * Creates new ring buffer with @p regions regions.
+     *
+     * Vertex and index counts of @p format specify the capacity of a single
+     *  region.
+     **/
+    GeometryBufferRing(const GeometryBufferFormat& format, int regions = 3);
+    virtual ~GeometryBufferRing();
+
+    /**
+     * @return whether ring buffers are supported by the current OpenGL
+     *  implementation.
+     **/
+    static bool isSupported();
+
+    /**
+     * Starts a new frame.
+     *
+     * Switches to the next region, waiting for the GPU to finish using it if
+     *  necessary. All allocations from the previous frame become invalid.
+     **/
+    void beginFrame();
+    /**
+     * Ends the current frame.
+     *
+     * This must be called after all draws which use the current region have
+     *  been issued.
+     **/
+    void endFrame();
+
+    /**
+     * Allocates space for @p count vertices in the current region.
+     *
+     * @param first if not null, set to the index of the first allocated
+     *  vertex. This can be used with renderSubset() or to compute indices.
+     * @return pointer to the allocated vertex records or 0 if the current
+     *  region doesn't have enough space left.
+     **/
+    void* allocateVertices(int count, int* first = 0);
+    /**
+     * Allocates space for @p count indices in the current region.
+     *
+     * @param first if not null, set to the offset of the first allocated
+     *  index. This can be used with renderIndexedSubset().
+     * @return pointer to the allocated indices or 0 if the current region
+     *  doesn't have enough space left.
+     **/
+    unsigned int* allocateIndices(int count, int* first = 0);
+
+    /**
+     * @return number of regions in this buffer.
+     **/
+    int regionCount() const  { return mRegionCount; }
+    /**
+     * @return index of the region used for the current frame.
+     **/
+    int currentRegion() const  { return mRegion; }
+    /**
+     * @return whether buffer storage is mapped persistently.
+     **/
+    bool isPersistent() const  { return mPersistent; }
+
+    virtual bool bind();
+    virtual bool unbind();
+
+    virtual void renderIndexedSubset(int indices, int offset, int baseVertex = 0);
+    virtual void renderSubset(int vertices, int offset);
+    virtual void renderIndexedSubsetInstanced(int indices, int offset, int instanceCount, int baseVertex = 0);
+    virtual void renderSubsetInstanced(int vertices, int offset, int instanceCount);
+
+    virtual bool isTransient() const  { return true; }
+
+protected:
+    virtual void addData(void* data, int size, int offset);
+    virtual void addIndexData(void* data, int size, int offset);
+
+    struct Storage
+    {
+        GLuint id;
+        GLenum target;
+        // Size of a single region, in bytes
+        int regionSize;
+        // Pointer to the mapped memory of the whole buffer (persistent
+        //  mapping) or of the current region only
+        char* map;
+        // Whether the current region has already been mapped in this frame
+        bool touched;
+    };
+
+    void createStorage(Storage& storage, GLenum target, int regionSize);
+    void deleteStorage(Storage& storage);
+    char* regionPointer(Storage& storage);
+    void unmapStorage(Storage& storage);
+
+private:
+    int mRegionCount;
+    int mRegion;
+    bool mPersistent;
+    bool mBound;
+    int mVertexCursor;
+    int mIndexCursor;
+    Storage mVertexStorage;
+    Storage mIndexStorage;
+    // GLsync objects for every region
+    void** mFences;
 };
 
 }
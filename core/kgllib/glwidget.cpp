@@ -19,6 +19,7 @@
 
 #include <camera.h>
 #include <fpscounter.h>
+#include <renderer.h>
 #include <textrenderer.h>
 
 #include <QGLContext>
@@ -219,12 +220,15 @@ void GLWidget::paintGL()
     render();
 
     glPopAttrib();
+    renderer->invalidateState();
 
     if (mShowFps) {
         textRenderer()->begin(this);
         textRenderer()->draw(5, 0, "FPS: " + fpsCounter()->fpsString());
         textRenderer()->end();
     }
+
+    renderer->checkFrameErrors();
 }
 
 void GLWidget::render()
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "instancebuffer.h"
+
+#include "program.h"
+
+#include <QtDebug>
+
+#include <string.h>
+
+
+namespace KGLLib
+{
+
+namespace
+{
+// Revisions are unique among all buffers, so that a GeometryBuffer notices
+//  when its instance buffer is replaced by another one at the same address
+int lastLayoutRevision = 0;
+}
+
+InstanceBuffer::InstanceBuffer(int instanceCount)
+{
+    mInstanceCount = qMax(instanceCount, 0);
+    mProgram = 0;
+    mLocationsValid = false;
+    mDirty = true;
+    mLayoutRevision = ++lastLayoutRevision;
+    mId = 0;
+}
+
+InstanceBuffer::~InstanceBuffer()
+{
+    if (mId) {
+        glDeleteBuffers(1, &mId);
+    }
+}
+
+bool InstanceBuffer::isDivisorSupported()
+{
+#ifdef GL_ARB_instanced_arrays
+    return GLEW_ARB_instanced_arrays;
+#else
+    return false;
+#endif
+}
+
+void InstanceBuffer::setInstanceCount(int count)
+{
+    count = qMax(count, 0);
+    if (count != mInstanceCount) {
+        // Attributes are stored one after another, so their offsets change
+        mLayoutRevision = ++lastLayoutRevision;
+    }
+    mInstanceCount = count;
+    for (int i = 0; i < mAttributes.count(); i++) {
+        mAttributes[i].data.resize(mInstanceCount * mAttributes[i].size);
+    }
+    mDirty = true;
+}
+
+int InstanceBuffer::addAttribute(const QString& name, int size)
+{
+    if ((size < 1 || size > 4) && size != 16) {
+        qCritical() << "InstanceBuffer::addAttribute(): invalid size" << size << "for attribute" << name;
+        return -1;
+    }
+
+    Attribute attr;
+    attr.name = name;
+    attr.location = -1;
+    attr.size = size;
+    attr.data.resize(mInstanceCount * size);
+    attr.boundLocation = -1;
+    mAttributes.append(attr);
+
+    mLocationsValid = false;
+    mDirty = true;
+    mLayoutRevision = ++lastLayoutRevision;
+    return mAttributes.count() - 1;
+}
+
+int InstanceBuffer::addAttribute(int location, int size)
+{
+    int index = addAttribute(QString(), size);
+    if (index >= 0) {
+        mAttributes[index].location = location;
+        mLayoutRevision = ++lastLayoutRevision;
+    }
+    return index;
+}
+
+void InstanceBuffer::setAttributeData(int attribute, const float* data, int first, int count)
+{
+    Attribute& attr = mAttributes[attribute];
+    if (count < 0 || first + count > mInstanceCount) {
+        count = mInstanceCount - first;
+    }
+    if (count <= 0) {
+        return;
+    }
+    memcpy(attr.data.data() + first * attr.size, data, count * attr.size * sizeof(float));
+    mDirty = true;
+}
+
+float* InstanceBuffer::attributeData(int attribute)
+{
+    return mAttributes[attribute].data.data();
+}
+
+void InstanceBuffer::setProgram(Program* program)
+{
+    if (program != mProgram) {
+        mProgram = program;
+        mLocationsValid = false;
+    }
+}
+
+void InstanceBuffer::resolveLocations()
+{
+    for (int i = 0; i < mAttributes.count(); i++) {
+        Attribute& attr = mAttributes[i];
+        int location;
+        if (attr.name.isEmpty()) {
+            location = attr.location;
+        } else {
+            location = mProgram ? mProgram->attributeLocation(attr.name) : -1;
+        }
+        if (location != attr.boundLocation) {
+            attr.boundLocation = location;
+            mLayoutRevision = ++lastLayoutRevision;
+        }
+    }
+    mLocationsValid = true;
+}
+
+void InstanceBuffer::update()
+{
+    if (!mLocationsValid) {
+        resolveLocations();
+    }
+    if (!mDirty || !isDivisorSupported()) {
+        return;
+    }
+
+    // All attributes are stored one after another in a single buffer object
+    int size = 0;
+    for (int i = 0; i < mAttributes.count(); i++) {
+        size += mAttributes[i].data.count() * sizeof(float);
+    }
+    if (!mId) {
+        glGenBuffers(1, &mId);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, mId);
+    glBufferData(GL_ARRAY_BUFFER, size, 0, GL_DYNAMIC_DRAW);
+    int offset = 0;
+    for (int i = 0; i < mAttributes.count(); i++) {
+        int attrsize = mAttributes[i].data.count() * sizeof(float);
+        glBufferSubData(GL_ARRAY_BUFFER, offset, attrsize, mAttributes[i].data.constData());
+        offset += attrsize;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    mDirty = false;
+}
+
+void InstanceBuffer::enableArrays()
+{
+    if (!isDivisorSupported()) {
+        return;
+    }
+
+#ifdef GL_ARB_instanced_arrays
+    glBindBuffer(GL_ARRAY_BUFFER, mId);
+    char* base = 0;
+    for (int i = 0; i < mAttributes.count(); i++) {
+        const Attribute& attr = mAttributes[i];
+        if (attr.boundLocation >= 0) {
+            // Matrices take up four consecutive locations, one per column
+            int columns = (attr.size == 16) ? 4 : 1;
+            int columnsize = attr.size / columns;
+            for (int c = 0; c < columns; c++) {
+                GLuint location = attr.boundLocation + c;
+                glEnableVertexAttribArray(location);
+                glVertexAttribPointer(location, columnsize, GL_FLOAT, GL_FALSE, attr.size * sizeof(float),
+                                      base + c * columnsize * sizeof(float));
+                glVertexAttribDivisorARB(location, 1);
+            }
+        }
+        base += attr.data.count() * sizeof(float);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+#endif
+}
+
+void InstanceBuffer::disableArrays()
+{
+    if (!isDivisorSupported()) {
+        return;
+    }
+
+#ifdef GL_ARB_instanced_arrays
+    for (int i = 0; i < mAttributes.count(); i++) {
+        const Attribute& attr = mAttributes[i];
+        if (attr.boundLocation >= 0) {
+            int columns = (attr.size == 16) ? 4 : 1;
+            for (int c = 0; c < columns; c++) {
+                glVertexAttribDivisorARB(attr.boundLocation + c, 0);
+                glDisableVertexAttribArray(attr.boundLocation + c);
+            }
+        }
+    }
+#endif
+}
+
+void InstanceBuffer::setCurrentInstance(int index)
+{
+    if (!mLocationsValid) {
+        resolveLocations();
+    }
+
+    for (int i = 0; i < mAttributes.count(); i++) {
+        const Attribute& attr = mAttributes[i];
+        if (attr.boundLocation < 0) {
+            continue;
+        }
+        const float* value = attr.data.constData() + index * attr.size;
+        switch (attr.size) {
+            case 1:
+                glVertexAttrib1fv(attr.boundLocation, value);
+                break;
+            case 2:
+                glVertexAttrib2fv(attr.boundLocation, value);
+                break;
+            case 3:
+                glVertexAttrib3fv(attr.boundLocation, value);
+                break;
+            case 4:
+                glVertexAttrib4fv(attr.boundLocation, value);
+                break;
+            default:
+                for (int c = 0; c < 4; c++) {
+                    glVertexAttrib4fv(attr.boundLocation + c, value + c * 4);
+                }
+        }
+    }
+}
+
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KGLLIB_INSTANCEBUFFER_H
+#define KGLLIB_INSTANCEBUFFER_H
+
+#include "kgllib.h"
+
+#include <QtCore/QList>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+
+namespace KGLLib
+{
+class Program;
+
+/**
+ * @brief Per-instance vertex attributes for instanced rendering.
+ *
+ * InstanceBuffer stores attribute streams which have one value per instance
+ *  instead of one per vertex, e.g. a transformation matrix, a color or a
+ *  texture layer for every instance. It is used together with
+ *  @ref Batch::renderInstanced():
+ * @code
+ * InstanceBuffer* instances = new InstanceBuffer(propCount);
+ * int transform = instances->addAttribute("instanceTransform", 16);
+ * int color = instances->addAttribute("instanceColor", 4);
+ * instances->setAttributeData(transform, transforms);
+ * instances->setAttributeData(color, colors);
+ * propMesh->setInstanceBuffer(instances);
+ * ...
+ * // In your rendering loop:
+ * propMesh->renderInstanced(propCount);
+ * @endcode
+ *
+ * Attributes are generic vertex attributes which are accessed in the vertex
+ *  shader. Their locations are looked up by name from the @ref Program set
+ *  using setProgram() (@ref Mesh does this automatically) and cached until
+ *  the program changes. Attributes with 16 components are treated as 4x4
+ *  matrices and use four consecutive attribute locations.
+ *
+ * If ARB_instanced_arrays is supported, the attributes are stored in a buffer
+ *  object and advanced once per instance using glVertexAttribDivisor().
+ *  Otherwise the instances have to be rendered one by one, setting the
+ *  attributes using @ref setCurrentInstance() (Batch::renderInstanced() does
+ *  that automatically).
+ *
+ * The per-instance streams are deliberately kept separate from
+ *  @ref GeometryBuffer: they have their own element count and are usually
+ *  updated far more often than the geometry they're used with.
+ **/
+class KGLLIB_EXPORT InstanceBuffer
+{
+public:
+    /**
+     * Constructs new InstanceBuffer object for @p instanceCount instances.
+     **/
+    InstanceBuffer(int instanceCount = 0);
+    virtual ~InstanceBuffer();
+
+    /**
+     * @return whether per-instance attributes are supported by the hardware.
+     **/
+    static bool isDivisorSupported();
+
+    /**
+     * Sets the number of instances to @p count.
+     * Data of existing attributes is resized accordingly.
+     **/
+    void setInstanceCount(int count);
+    /**
+     * @return number of instances.
+     **/
+    int instanceCount() const  { return mInstanceCount; }
+
+    /**
+     * Adds new attribute with the given name and number of float components.
+     * @p size can be 1-4 or 16 (for 4x4 matrices).
+     *
+     * @return index of the new attribute.
+     **/
+    int addAttribute(const QString& name, int size);
+    /**
+     * Adds new attribute bound to the given attribute location.
+     *
+     * @return index of the new attribute.
+     **/
+    int addAttribute(int location, int size);
+    /**
+     * @return number of attributes.
+     **/
+    int attributeCount() const  { return mAttributes.count(); }
+
+    /**
+     * Copies data of @p count instances, starting from @p first, from
+     *  @p data into the attribute with the given index. If @p count is
+     *  negative, then data for all instances starting from @p first is
+     *  copied.
+     **/
+    void setAttributeData(int attribute, const float* data, int first = 0, int count = -1);
+    /**
+     * @return data of the given attribute.
+     * If you modify the data, you need to call @ref markDirty() afterwards.
+     **/
+    float* attributeData(int attribute);
+    /**
+     * Tells the buffer that the attribute data has changed.
+     **/
+    void markDirty()  { mDirty = true; }
+
+    /**
+     * Sets the Program used to look up attribute locations.
+     **/
+    void setProgram(Program* program);
+    /**
+     * @return Program used to look up attribute locations.
+     **/
+    Program* program() const  { return mProgram; }
+
+    /**
+     * Uploads the attribute data if it has changed.
+     * This is called automatically by @ref Batch::bind() before the
+     *  geometry is bound.
+     **/
+    void update();
+    /**
+     * Enables the per-instance attribute arrays and sets their divisors.
+     * Does nothing if per-instance attributes aren't supported.
+     *
+     * This is called by @ref GeometryBuffer while setting up its arrays, so
+     *  with vertex array objects it's only done when the buffer's VAO is
+     *  recorded, not for every draw. Leaves GL_ARRAY_BUFFER unbound.
+     **/
+    void enableArrays();
+    /**
+     * Resets the divisors and disables the per-instance attribute arrays.
+     **/
+    void disableArrays();
+    /**
+     * @return number which changes whenever the attribute arrays have to be
+     *  set up again, i.e. when attributes are added, the instance count
+     *  changes or the attribute locations change.
+     **/
+    int layoutRevision() const  { return mLayoutRevision; }
+
+    /**
+     * Sets the current values of the attributes to the ones of the instance
+     *  with the given index.
+     *
+     * This is used to render instances one by one if per-instance attributes
+     *  aren't supported.
+     **/
+    void setCurrentInstance(int index);
+
+protected:
+    struct Attribute
+    {
+        QString name;
+        // Explicitly given location, -1 if it's looked up by name
+        int location;
+        // Number of float components per instance
+        int size;
+        QVector<float> data;
+        // Location used for binding, -1 if the attribute isn't used by the program
+        int boundLocation;
+    };
+
+    void resolveLocations();
+
+private:
+    QList<Attribute> mAttributes;
+    int mInstanceCount;
+    Program* mProgram;
+    bool mLocationsValid;
+    bool mDirty;
+    int mLayoutRevision;
+    GLuint mId;
+};
+
+}
+
+#endif
@@ -47,6 +47,11 @@ bool init(Renderer* r)
 
 bool checkGLError(const QString& desc)
 {
+    // Errors are checked elsewhere unless the renderer checks them after
+    //  every call
+    if (renderer && renderer->errorCheckMode() != Renderer::ImmediateErrorChecks) {
+        return true;
+    }
     GLenum error = glGetError();
     if (error == GL_NO_ERROR) {
         return true;
@@ -49,6 +49,8 @@ KGLLIB_EXPORT bool init(Renderer* r = 0);
  * Checks if any OpenGL errors have occurred.
  * If an error has occurred, the error is printed out along with the given
  * description.
+ * Does nothing unless the renderer's error check mode is
+ *  @ref Renderer::ImmediateErrorChecks.
  * @return whether error has _not_ occurred (i.e. if error has occurred, return false)
  * TODO: maybe change it to return whether errors _has_ occurred?
  **/
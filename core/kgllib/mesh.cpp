@@ -17,8 +17,11 @@
 
 #include "mesh.h"
 
+#include "camera.h"
 #include "texture.h"
 #include "program.h"
+#include "renderer.h"
+#include "renderqueue.h"
 
 
 namespace KGLLib
@@ -27,12 +30,24 @@ namespace KGLLib
 Mesh::Mesh() : Batch()
 {
     mProgram = 0;
+    mCamera = 0;
+    mFrustumCulling = false;
+    mRestoreState = true;
+    mRenderQueue = 0;
+    mRenderPass = 0;
+    mTransparent = false;
 }
 
 Mesh::Mesh(GeometryBuffer* buffer, int offset, int indexOffset) :
     Batch(buffer, offset, indexOffset)
 {
     mProgram = 0;
+    mCamera = 0;
+    mFrustumCulling = false;
+    mRestoreState = true;
+    mRenderQueue = 0;
+    mRenderPass = 0;
+    mTransparent = false;
 }
 
 Mesh::~Mesh()
@@ -59,6 +74,30 @@ KGLLib::Texture* Mesh::texture(int index) const
 void Mesh::setProgram(KGLLib::Program* program)
 {
     mProgram = program;
+    setAttributeProgram(program);
+}
+
+bool Mesh::isVisible() const
+{
+    if (!mCamera) {
+        return true;
+    }
+    return mCamera->isBoxVisible(boundingBoxMin(), boundingBoxMax());
+}
+
+void Mesh::render()
+{
+    if (mFrustumCulling && !isVisible()) {
+        return;
+    }
+    if (mCamera && lodCount() > 1) {
+        selectLod(mCamera->projectedSize(boundingSphereCenter(), boundingSphereRadius()));
+    }
+    if (mRenderQueue) {
+        mRenderQueue->submit(this);
+        return;
+    }
+    Batch::render();
 }
 
 void Mesh::bind()
@@ -66,7 +105,7 @@ void Mesh::bind()
     // Bind texture and program if they're set
     for (int i = mTextures.count()-1; i >= 0; i--) {
         if (mTextures[i]) {
-            glActiveTexture(GL_TEXTURE0 + i);
+            renderer->setActiveTextureUnit(i);
             mTextures[i]->enable();
         }
     }
@@ -80,11 +119,13 @@ void Mesh::bind()
 void Mesh::unbind()
 {
     Batch::unbind();
+    if (!mRestoreState) {
+        return;
+    }
 
     for (int i = mTextures.count()-1; i >= 0; i--) {
         if (mTextures[i]) {
-            // TODO: maybe just unbind? Maybe do nothing? Maybe have an option?
-            glActiveTexture(GL_TEXTURE0 + i);
+            renderer->setActiveTextureUnit(i);
             mTextures[i]->disable();
         }
     }
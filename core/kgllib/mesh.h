@@ -25,6 +25,8 @@
 
 namespace KGLLib
 {
+class Camera;
+class RenderQueue;
 class Texture;
 class Program;
 
@@ -35,6 +37,17 @@ class Program;
  *
  * You can specify a Program object and one or multiple Texture objects that
  *  are used when rendering the Mesh. Both of those features are optional.
+ *
+ * The program is also used to look up the locations of generic and
+ *  per-instance vertex attributes (see @ref setAttributeProgram()).
+ *
+ * If a camera is set using @ref setCamera() and the mesh has levels of
+ *  detail (see @ref Batch::generateLods()), then render() selects the level
+ *  based on the mesh's size on screen. The camera is also used for frustum
+ *  culling if it's enabled using @ref setFrustumCulling().
+ *
+ * If a render queue is set using @ref setRenderQueue(), render() submits
+ *  the mesh to the queue instead of rendering it immediately.
  **/
 class KGLLIB_EXPORT Mesh : public Batch
 {
@@ -49,6 +62,7 @@ public:
     Mesh(GeometryBuffer* buffer, int offset, int indexOffset);
     virtual ~Mesh();
 
+    virtual void render();
     virtual void bind();
     virtual void unbind();
 
@@ -63,13 +77,20 @@ public:
     /**
     * Uses given texture in given texture unit for rendering.
     *
-    * Maximum allowed texture unit depends on hardware.
+    * Maximum allowed texture unit depends on hardware. Each texture unit
+    *  can have its own texture coordinates, see
+    *  @ref Batch::setTexcoords(int, Eigen::Vector2f*).
     **/
     virtual void setTexture(int index, KGLLib::Texture* tex);
     /**
     * @return Texture used for the given texture unit
     **/
     KGLLib::Texture* texture(int index) const;
+    /**
+     * @return number of texture units used by the mesh, including units for
+     *  which no texture is set.
+     **/
+    int textureCount() const  { return mTextures.count(); }
 
     /**
      * Sets the Program used for rendering.
@@ -80,11 +101,94 @@ public:
      **/
     KGLLib::Program* program() const  { return mProgram; }
 
+    /**
+     * Sets the camera which is used to select the level of detail when the
+     *  mesh is rendered. The mesh's vertices are assumed to be in the world
+     *  coordinates of the camera.
+     **/
+    void setCamera(KGLLib::Camera* camera)  { mCamera = camera; }
+    /**
+     * @return camera used for selecting the level of detail
+     **/
+    KGLLib::Camera* camera() const  { return mCamera; }
+
+    /**
+     * Enables or disables frustum culling. If it's enabled and a camera is
+     *  set, render() does nothing when the mesh's bounding box (see
+     *  @ref Batch::boundingBoxMin()) is outside the camera's view frustum.
+     *
+     * Default value is false.
+     **/
+    void setFrustumCulling(bool enabled)  { mFrustumCulling = enabled; }
+    /**
+     * @return whether frustum culling is enabled.
+     **/
+    bool frustumCulling() const  { return mFrustumCulling; }
+    /**
+     * @return whether the mesh is possibly visible to its camera. Returns
+     *  true if no camera is set.
+     **/
+    bool isVisible() const;
+
+    /**
+     * Sets whether unbind() disables the mesh's textures and unbinds its
+     *  program.
+     *
+     * If many meshes are rendered in a row, leaving the state in place avoids
+     *  GL calls which the next mesh would just undo. The state is then left
+     *  set after the last mesh, so only disable this if the following
+     *  rendering code doesn't depend on it. Also note that textures in units
+     *  which the next mesh doesn't use stay enabled.
+     *
+     * Default value is true.
+     **/
+    void setRestoreState(bool restore)  { mRestoreState = restore; }
+    /**
+     * @return whether unbind() restores the texture and program state.
+     **/
+    bool restoreState() const  { return mRestoreState; }
+
+    /**
+     * Sets the queue which the mesh is submitted to when it's rendered. Set
+     *  it to 0 to render the mesh immediately.
+     *
+     * The current modelview matrix and level of detail are recorded with
+     *  the submission and used when the queue renders the mesh.
+     **/
+    void setRenderQueue(KGLLib::RenderQueue* queue)  { mRenderQueue = queue; }
+    /**
+     * @return render queue which the mesh is submitted to
+     **/
+    KGLLib::RenderQueue* renderQueue() const  { return mRenderQueue; }
+    /**
+     * Sets the render pass of the mesh. Meshes in lower passes are rendered
+     *  first by @ref RenderQueue. Values from 0 to 15 can be used.
+     *
+     * Default value is 0.
+     **/
+    void setRenderPass(int pass)  { mRenderPass = pass; }
+    int renderPass() const  { return mRenderPass; }
+    /**
+     * Sets whether the mesh is transparent. @ref RenderQueue renders
+     *  transparent meshes after the opaque ones of the same pass, sorted
+     *  from back to front.
+     *
+     * Default value is false.
+     **/
+    void setTransparent(bool transparent)  { mTransparent = transparent; }
+    bool isTransparent() const  { return mTransparent; }
+
 protected:
 
 private:
     QVector<KGLLib::Texture*> mTextures;
     KGLLib::Program* mProgram;
+    KGLLib::Camera* mCamera;
+    bool mFrustumCulling;
+    bool mRestoreState;
+    KGLLib::RenderQueue* mRenderQueue;
+    int mRenderPass;
+    bool mTransparent;
 };
 
 }
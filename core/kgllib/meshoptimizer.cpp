@@ -0,0 +1,553 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "meshoptimizer.h"
+
+#include "batch.h"
+
+#include <QtCore/QtAlgorithms>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+
+#include <Eigen/Geometry>
+
+#include <math.h>
+#include <string.h>
+
+using namespace Eigen;
+
+
+namespace KGLLib
+{
+
+namespace
+{
+// Triangles which use each vertex, stored as one array with per-vertex offsets
+struct Adjacency
+{
+    Adjacency(const unsigned int* indices, int indexCount, int vertexCount)
+    {
+        counts.fill(0, vertexCount);
+        offsets.resize(vertexCount + 1);
+        triangles.resize(indexCount);
+
+        for (int i = 0; i < indexCount; i++) {
+            counts[indices[i]]++;
+        }
+        offsets[0] = 0;
+        for (int v = 0; v < vertexCount; v++) {
+            offsets[v+1] = offsets[v] + counts[v];
+        }
+        QVector<int> fill(offsets);
+        for (int i = 0; i < indexCount; i++) {
+            triangles[fill[indices[i]]++] = i / 3;
+        }
+    }
+
+    QVector<int> counts;
+    QVector<int> offsets;
+    QVector<int> triangles;
+};
+
+struct Cluster
+{
+    int offset;
+    int count;
+    float sortKey;
+};
+
+bool clusterLessThan(const Cluster& a, const Cluster& b)
+{
+    return a.sortKey > b.sortKey;
+}
+
+// Sum of squared distances to a set of planes, stored as a symmetric 4x4
+//  matrix. Planes are weighted by the area of their triangles.
+struct Quadric
+{
+    Quadric()
+    {
+        a2 = ab = ac = ad = b2 = bc = bd = c2 = cd = d2 = weight = 0;
+    }
+
+    void addPlane(const Vector3f& n, double d, double w)
+    {
+        a2 += w * n.x() * n.x();  ab += w * n.x() * n.y();  ac += w * n.x() * n.z();  ad += w * n.x() * d;
+        b2 += w * n.y() * n.y();  bc += w * n.y() * n.z();  bd += w * n.y() * d;
+        c2 += w * n.z() * n.z();  cd += w * n.z() * d;
+        d2 += w * d * d;
+        weight += w;
+    }
+
+    void add(const Quadric& q)
+    {
+        a2 += q.a2;  ab += q.ab;  ac += q.ac;  ad += q.ad;
+        b2 += q.b2;  bc += q.bc;  bd += q.bd;
+        c2 += q.c2;  cd += q.cd;
+        d2 += q.d2;
+        weight += q.weight;
+    }
+
+    // Weighted sum of squared distances from p to the planes
+    double evaluate(const Vector3f& p) const
+    {
+        double x = p.x(), y = p.y(), z = p.z();
+        return a2*x*x + 2*ab*x*y + 2*ac*x*z + 2*ad*x +
+                b2*y*y + 2*bc*y*z + 2*bd*y +
+                c2*z*z + 2*cd*z + d2;
+    }
+
+    double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+    double weight;
+};
+
+struct Collapse
+{
+    unsigned int from;
+    unsigned int to;
+    // Mean squared distance to the original surface after the collapse
+    float cost;
+};
+
+bool collapseLessThan(const Collapse& a, const Collapse& b)
+{
+    return a.cost < b.cost;
+}
+
+float collapseCost(const Quadric& from, const Quadric& to, const Vector3f& target)
+{
+    double weight = from.weight + to.weight;
+    if (weight <= 0) {
+        return 0;
+    }
+    return qMax(0.0, (from.evaluate(target) + to.evaluate(target)) / weight);
+}
+
+quint64 edgeKey(unsigned int a, unsigned int b)
+{
+    return (quint64(qMin(a, b)) << 32) | qMax(a, b);
+}
+
+// Whether moving vertex from to the position of vertex to would flip any of
+//  the triangles which remain after the collapse
+bool collapseFlips(const Adjacency& adjacency, const QVector<unsigned int>& indices, const Vector3f* positions,
+                   unsigned int from, unsigned int to)
+{
+    for (int i = adjacency.offsets[from]; i < adjacency.offsets[from+1]; i++) {
+        const unsigned int* tri = indices.constData() + adjacency.triangles[i] * 3;
+        if (tri[0] == to || tri[1] == to || tri[2] == to) {
+            // This triangle is removed by the collapse
+            continue;
+        }
+        Vector3f before[3], after[3];
+        for (int j = 0; j < 3; j++) {
+            before[j] = positions[tri[j]];
+            after[j] = (tri[j] == from) ? positions[to] : positions[tri[j]];
+        }
+        Vector3f n0 = (before[1] - before[0]).cross(before[2] - before[0]);
+        Vector3f n1 = (after[1] - after[0]).cross(after[2] - after[0]);
+        if (n0.dot(n1) <= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns next vertex from the dead-end stack or the input which still has
+//  triangles left, or -1 if all triangles have been emitted.
+int skipDeadEnd(QVector<int>& deadEnds, const QVector<int>& liveCounts, int& cursor)
+{
+    while (!deadEnds.isEmpty()) {
+        int v = deadEnds.last();
+        deadEnds.pop_back();
+        if (liveCounts[v] > 0) {
+            return v;
+        }
+    }
+    while (cursor < liveCounts.count()) {
+        if (liveCounts[cursor] > 0) {
+            return cursor;
+        }
+        cursor++;
+    }
+    return -1;
+}
+}
+
+
+MeshOptimizer::CacheStatistics MeshOptimizer::analyzeVertexCache(const unsigned int* indices, int indexCount, int vertexCount, int cacheSize)
+{
+    CacheStatistics stats;
+    stats.transformedVertices = 0;
+    stats.acmr = 0;
+    stats.atvr = 0;
+    if (!indexCount || !vertexCount) {
+        return stats;
+    }
+
+    // A vertex is in the FIFO if fewer than cacheSize vertices have been
+    //  inserted after it.
+    QVector<int> insertedAt(vertexCount, -cacheSize - 1);
+    QVector<bool> referenced(vertexCount, false);
+    int referencedCount = 0;
+    for (int i = 0; i < indexCount; i++) {
+        unsigned int v = indices[i];
+        if (stats.transformedVertices - insertedAt[v] > cacheSize) {
+            insertedAt[v] = stats.transformedVertices;
+            stats.transformedVertices++;
+        }
+        if (!referenced[v]) {
+            referenced[v] = true;
+            referencedCount++;
+        }
+    }
+
+    stats.acmr = float(stats.transformedVertices) / (indexCount / 3);
+    stats.atvr = float(stats.transformedVertices) / referencedCount;
+    return stats;
+}
+
+void MeshOptimizer::optimizeVertexCache(unsigned int* indices, int indexCount, int vertexCount, int cacheSize,
+                                        QVector<int>* clusters)
+{
+    if (clusters) {
+        clusters->clear();
+    }
+    int triangleCount = indexCount / 3;
+    if (!triangleCount) {
+        return;
+    }
+
+    Adjacency adjacency(indices, triangleCount * 3, vertexCount);
+    QVector<int> liveCounts(adjacency.counts);
+    QVector<int> cacheTimes(vertexCount, 0);
+    QVector<bool> emitted(triangleCount, false);
+    QVector<int> deadEnds;
+    QVector<unsigned int> output;
+    output.reserve(triangleCount * 3);
+    QVector<int> candidates;
+
+    int fanVertex = 0;
+    int timeStamp = cacheSize + 1;
+    int cursor = 1;
+    if (clusters) {
+        clusters->append(0);
+    }
+    while (fanVertex >= 0) {
+        // Emit all remaining triangles around the fanning vertex
+        candidates.clear();
+        for (int i = adjacency.offsets[fanVertex]; i < adjacency.offsets[fanVertex+1]; i++) {
+            int t = adjacency.triangles[i];
+            if (emitted[t]) {
+                continue;
+            }
+            for (int j = 0; j < 3; j++) {
+                unsigned int v = indices[t*3 + j];
+                output.append(v);
+                deadEnds.append(v);
+                candidates.append(v);
+                liveCounts[v]--;
+                if (timeStamp - cacheTimes[v] > cacheSize) {
+                    cacheTimes[v] = timeStamp++;
+                }
+            }
+            emitted[t] = true;
+        }
+
+        // Continue with the candidate which will be in the cache for the
+        //  longest time once all of its triangles have been emitted.
+        int next = -1;
+        int best = -1;
+        foreach (int v, candidates) {
+            if (liveCounts[v] <= 0) {
+                continue;
+            }
+            int priority = 0;
+            if (timeStamp - cacheTimes[v] + 2 * liveCounts[v] <= cacheSize) {
+                priority = timeStamp - cacheTimes[v];
+            }
+            if (priority > best) {
+                best = priority;
+                next = v;
+            }
+        }
+        if (next < 0) {
+            next = skipDeadEnd(deadEnds, liveCounts, cursor);
+            // Continuing from a vertex which isn't in the cache anymore
+            //  starts a new cluster
+            if (clusters && next >= 0 && !output.isEmpty() && timeStamp - cacheTimes[next] > cacheSize) {
+                clusters->append(output.count());
+            }
+        }
+        fanVertex = next;
+    }
+
+    memcpy(indices, output.constData(), output.count() * sizeof(unsigned int));
+}
+
+void MeshOptimizer::optimizeOverdraw(unsigned int* indices, int indexCount, const Eigen::Vector3f* positions,
+                                     const QVector<int>& clusters)
+{
+    if (clusters.count() < 2) {
+        return;
+    }
+
+    // Centroid of the whole mesh
+    int triangleCount = indexCount / 3;
+    Vector3f meshCenter(0, 0, 0);
+    for (int i = 0; i < triangleCount * 3; i++) {
+        meshCenter += positions[indices[i]];
+    }
+    meshCenter /= float(triangleCount * 3);
+
+    // Clusters which face away from the mesh's center are on its outside and
+    //  should be drawn first.
+    QList<Cluster> sorted;
+    for (int i = 0; i < clusters.count(); i++) {
+        Cluster cluster;
+        cluster.offset = clusters[i];
+        cluster.count = ((i + 1 < clusters.count()) ? clusters[i+1] : triangleCount * 3) - cluster.offset;
+
+        Vector3f center(0, 0, 0);
+        Vector3f normal(0, 0, 0);
+        for (int j = cluster.offset; j < cluster.offset + cluster.count; j += 3) {
+            const Vector3f& a = positions[indices[j]];
+            const Vector3f& b = positions[indices[j+1]];
+            const Vector3f& c = positions[indices[j+2]];
+            center += a + b + c;
+            // Area weighted normal
+            normal += (b - a).cross(c - a);
+        }
+        center /= float(cluster.count);
+        cluster.sortKey = (center - meshCenter).dot(normal);
+        sorted.append(cluster);
+    }
+    qStableSort(sorted.begin(), sorted.end(), clusterLessThan);
+
+    QVector<unsigned int> output;
+    output.reserve(indexCount);
+    foreach (const Cluster& cluster, sorted) {
+        for (int i = cluster.offset; i < cluster.offset + cluster.count; i++) {
+            output.append(indices[i]);
+        }
+    }
+    memcpy(indices, output.constData(), output.count() * sizeof(unsigned int));
+}
+
+QVector<unsigned int> MeshOptimizer::optimizeVertexFetch(unsigned int* indices, int indexCount, int vertexCount)
+{
+    const unsigned int unassigned = ~0u;
+    QVector<unsigned int> remap(vertexCount, unassigned);
+    unsigned int next = 0;
+    for (int i = 0; i < indexCount; i++) {
+        unsigned int& newIndex = remap[indices[i]];
+        if (newIndex == unassigned) {
+            newIndex = next++;
+        }
+        indices[i] = newIndex;
+    }
+    // Keep unused vertices, so that the number of vertices doesn't change
+    for (int v = 0; v < vertexCount; v++) {
+        if (remap[v] == unassigned) {
+            remap[v] = next++;
+        }
+    }
+    return remap;
+}
+
+QVector<unsigned int> MeshOptimizer::simplify(const unsigned int* indices, int indexCount, const Eigen::Vector3f* positions,
+                                               int vertexCount, int targetIndexCount, float* error)
+{
+    QVector<unsigned int> result(indexCount / 3 * 3);
+    memcpy(result.data(), indices, result.count() * sizeof(unsigned int));
+
+    QVector<Quadric> quadrics(vertexCount);
+    for (int i = 0; i < result.count(); i += 3) {
+        const Vector3f& a = positions[result[i]];
+        Vector3f normal = (positions[result[i+1]] - a).cross(positions[result[i+2]] - a);
+        float length = normal.norm();
+        if (length <= 0) {
+            continue;
+        }
+        normal /= length;
+        for (int j = 0; j < 3; j++) {
+            quadrics[result[i+j]].addPlane(normal, -normal.dot(a), length * 0.5);
+        }
+    }
+
+    QVector<unsigned int> remap(vertexCount);
+    for (int v = 0; v < vertexCount; v++) {
+        remap[v] = v;
+    }
+    float maxCost = 0;
+
+    // Every pass collapses the cheapest edges which don't affect each other
+    while (result.count() > targetIndexCount) {
+        // Vertices on open or non-manifold edges are kept in place
+        QHash<quint64, int> edgeUses;
+        for (int i = 0; i < result.count(); i += 3) {
+            for (int j = 0; j < 3; j++) {
+                edgeUses[edgeKey(result[i+j], result[i + (j+1) % 3])]++;
+            }
+        }
+        QVector<bool> locked(vertexCount, false);
+        foreach (quint64 key, edgeUses.keys()) {
+            if (edgeUses[key] != 2) {
+                locked[key >> 32] = true;
+                locked[key & 0xffffffff] = true;
+            }
+        }
+
+        // Find the cheapest collapse for every vertex
+        QVector<Collapse> best(vertexCount);
+        for (int v = 0; v < vertexCount; v++) {
+            best[v].cost = -1;
+        }
+        for (int i = 0; i < result.count(); i += 3) {
+            for (int j = 0; j < 3; j++) {
+                unsigned int from = result[i+j];
+                for (int k = 1; k < 3; k++) {
+                    unsigned int to = result[i + (j+k) % 3];
+                    if (locked[from]) {
+                        continue;
+                    }
+                    float cost = collapseCost(quadrics[from], quadrics[to], positions[to]);
+                    if (best[from].cost < 0 || cost < best[from].cost) {
+                        best[from].from = from;
+                        best[from].to = to;
+                        best[from].cost = cost;
+                    }
+                }
+            }
+        }
+        QVector<Collapse> collapses;
+        foreach (const Collapse& c, best) {
+            if (c.cost >= 0) {
+                collapses.append(c);
+            }
+        }
+        qSort(collapses.begin(), collapses.end(), collapseLessThan);
+
+        Adjacency adjacency(result.constData(), result.count(), vertexCount);
+        QVector<bool> touched(vertexCount, false);
+        int trianglesToRemove = (result.count() - targetIndexCount + 2) / 3;
+        int removed = 0;
+        int collapsed = 0;
+        foreach (const Collapse& c, collapses) {
+            if (removed >= trianglesToRemove) {
+                break;
+            }
+            if (touched[c.from] || touched[c.to] ||
+                    collapseFlips(adjacency, result, positions, c.from, c.to)) {
+                continue;
+            }
+            // All triangles around the removed vertex change, so their
+            //  vertices can't be collapsed again in this pass
+            for (int i = adjacency.offsets[c.from]; i < adjacency.offsets[c.from+1]; i++) {
+                const unsigned int* tri = result.constData() + adjacency.triangles[i] * 3;
+                if (tri[0] == c.to || tri[1] == c.to || tri[2] == c.to) {
+                    removed++;
+                }
+                touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = true;
+            }
+            remap[c.from] = c.to;
+            quadrics[c.to].add(quadrics[c.from]);
+            maxCost = qMax(maxCost, c.cost);
+            collapsed++;
+        }
+        if (!collapsed) {
+            break;
+        }
+
+        // Remove the triangles which have become degenerate
+        QVector<unsigned int> simplified;
+        simplified.reserve(result.count());
+        for (int i = 0; i < result.count(); i += 3) {
+            unsigned int a = remap[result[i]];
+            unsigned int b = remap[result[i+1]];
+            unsigned int c = remap[result[i+2]];
+            if (a != b && b != c && a != c) {
+                simplified.append(a);
+                simplified.append(b);
+                simplified.append(c);
+            }
+        }
+        result = simplified;
+    }
+
+    if (error) {
+        *error = sqrt(maxCost);
+    }
+    return result;
+}
+
+bool MeshOptimizer::optimizeBatch(Batch* batch, bool reduceOverdraw, int cacheSize,
+                                  CacheStatistics* before, CacheStatistics* after)
+{
+    if (batch->primitiveType() != GL_TRIANGLES || !batch->indicesArray() || batch->primitiveRestart()) {
+        return false;
+    }
+
+    const int vertexCount = batch->vertexCount();
+    QVector<unsigned int> indices(batch->indicesCount());
+    memcpy(indices.data(), batch->indicesArray(), indices.count() * sizeof(unsigned int));
+    // Levels of detail are stored one after another and optimized separately
+    const QList<Batch::LodLevel> lodLevels = batch->lodLevels();
+    QList<Batch::LodLevel> levels = lodLevels;
+    if (levels.isEmpty()) {
+        Batch::LodLevel level;
+        level.indexOffset = 0;
+        level.indexCount = indices.count();
+        level.error = 0;
+        levels.append(level);
+    }
+
+    if (before) {
+        *before = analyzeVertexCache(indices.constData() + levels[0].indexOffset, levels[0].indexCount, vertexCount, cacheSize);
+    }
+
+    const Vector3f* positions = 0;
+    if (reduceOverdraw && batch->vertexSize() == 3) {
+        positions = reinterpret_cast<const Vector3f*>(batch->verticesArray());
+    }
+    foreach (const Batch::LodLevel& level, levels) {
+        QVector<int> clusters;
+        unsigned int* levelIndices = indices.data() + level.indexOffset;
+        optimizeVertexCache(levelIndices, level.indexCount, vertexCount, cacheSize, positions ? &clusters : 0);
+        if (positions) {
+            optimizeOverdraw(levelIndices, level.indexCount, positions, clusters);
+        }
+    }
+
+    // All levels share the vertices, so they're renumbered in one go, the
+    //  full detail level first
+    QVector<unsigned int> fetchIndices = indices;
+    QVector<unsigned int> remap = optimizeVertexFetch(fetchIndices.data(), fetchIndices.count(), vertexCount);
+    if (batch->remapVertices(remap)) {
+        indices = fetchIndices;
+    }
+
+    if (after) {
+        *after = analyzeVertexCache(indices.constData() + levels[0].indexOffset, levels[0].indexCount, vertexCount, cacheSize);
+    }
+
+    batch->setIndices(indices);
+    batch->setLodLevels(lodLevels);
+    return true;
+}
+
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KGLLIB_MESHOPTIMIZER_H
+#define KGLLIB_MESHOPTIMIZER_H
+
+#include "kgllib.h"
+
+#include <QtCore/QVector>
+
+#include <Eigen/Core>
+
+
+namespace KGLLib
+{
+class Batch;
+
+/**
+ * @brief Reorders indexed triangle lists for faster rendering.
+ *
+ * Index arrays of loaded models usually list triangles in file order, which
+ *  makes poor use of the GPU's post-transform vertex cache: the same vertex is
+ *  transformed many times because it has been evicted from the cache before
+ *  it is referenced again.
+ *
+ * MeshOptimizer provides the following passes, which are meant to be run
+ *  once on static geometry, e.g. after loading a model:
+ * @li @ref optimizeVertexCache() reorders triangles so that vertices are
+ *  reused while they're still in the cache. It uses the Tipsify algorithm
+ *  (Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality
+ *  and Reduced Overdraw"), which runs in linear time.
+ * @li @ref optimizeOverdraw() reorders the clusters found by the previous pass
+ *  so that triangles which are likely to occlude others are drawn first.
+ * @li @ref optimizeVertexFetch() renumbers the vertices in the order in which
+ *  they're first used, so that vertex data is fetched sequentially.
+ *
+ * @ref simplify() reduces the number of triangles of a mesh and is used to
+ *  create levels of detail, see @ref Batch::generateLods().
+ *
+ * @ref analyzeVertexCache() simulates a FIFO cache and can be used to measure
+ *  the effect of the passes.
+ *
+ * All methods work on triangle lists, i.e. index arrays which are rendered
+ *  using GL_TRIANGLES.
+ *
+ * @see ModelLoader::optimizeModel()
+ **/
+class KGLLIB_EXPORT MeshOptimizer
+{
+public:
+    /**
+     * Results of a vertex cache simulation.
+     **/
+    struct CacheStatistics
+    {
+        /**
+         * Number of vertex shader invocations, i.e. cache misses.
+         **/
+        int transformedVertices;
+        /**
+         * Average cache miss ratio: transformed vertices per triangle. The
+         *  best possible value is about 0.5 for regular meshes, the worst 3.
+         **/
+        float acmr;
+        /**
+         * Average transform to vertex ratio: transformed vertices per
+         *  referenced vertex. The best possible value is 1.
+         **/
+        float atvr;
+    };
+
+    /**
+     * Simulates rendering the given triangle list with a FIFO post-transform
+     *  cache of @p cacheSize entries.
+     **/
+    static CacheStatistics analyzeVertexCache(const unsigned int* indices, int indexCount, int vertexCount, int cacheSize = 16);
+
+    /**
+     * Reorders the triangles of the given triangle list to improve the use of
+     *  a post-transform cache of @p cacheSize entries. Vertices aren't
+     *  changed.
+     *
+     * @param clusters if not null, it's filled with the index offsets where
+     *  the cache is expected to be flushed. These split the triangles into
+     *  clusters which can be reordered without affecting cache efficiency,
+     *  see @ref optimizeOverdraw().
+     **/
+    static void optimizeVertexCache(unsigned int* indices, int indexCount, int vertexCount, int cacheSize = 16,
+                                    QVector<int>* clusters = 0);
+    /**
+     * Reorders the clusters of the given triangle list so that clusters on
+     *  the outside of the mesh, which are likely to occlude the rest of it,
+     *  are drawn first. This reduces overdraw independently of the viewing
+     *  direction.
+     *
+     * @param clusters cluster offsets created by @ref optimizeVertexCache().
+     **/
+    static void optimizeOverdraw(unsigned int* indices, int indexCount, const Eigen::Vector3f* positions,
+                                 const QVector<int>& clusters);
+    /**
+     * Renumbers the vertices in the order in which the indices first
+     *  reference them and updates @p indices accordingly. Vertices which
+     *  aren't referenced at all are moved to the end.
+     *
+     * @return remapping table, where element i is the new index of old vertex
+     *  i. Use @ref remapVertices() to reorder vertex data with it.
+     **/
+    static QVector<unsigned int> optimizeVertexFetch(unsigned int* indices, int indexCount, int vertexCount);
+    /**
+     * Reorders @p data using the table returned by optimizeVertexFetch().
+     **/
+    template<typename T> static void remapVertices(QVector<T>& data, const QVector<unsigned int>& remap);
+
+    /**
+     * Simplifies the given triangle list by collapsing edges, choosing the
+     *  collapses which change the surface least according to quadric error
+     *  metrics (Garland and Heckbert, "Surface Simplification Using Quadric
+     *  Error Metrics").
+     *
+     * Vertices are never moved or created: a removed vertex is merged into
+     *  one of its neighbours, so the result can be rendered using the original
+     *  vertex data. Vertices on open edges aren't removed, so that no cracks
+     *  appear. Note that this includes seams where vertices have been
+     *  duplicated because of differing normals or texture coordinates.
+     *
+     * @param targetIndexCount number of indices to aim for. The result has
+     *  more indices if the mesh can't be simplified that much.
+     * @param error if not null, it's set to the estimated largest distance
+     *  between the simplified and the original surface.
+     * @return simplified index list.
+     **/
+    static QVector<unsigned int> simplify(const unsigned int* indices, int indexCount, const Eigen::Vector3f* positions,
+                                          int vertexCount, int targetIndexCount, float* error = 0);
+
+    /**
+     * Runs all passes on the given batch: the triangles of every level of
+     *  detail are reordered for the vertex cache and optionally to reduce
+     *  overdraw, then the vertices are renumbered for sequential fetching.
+     *
+     * The overdraw pass needs 3-component vertices. Vertices are only
+     *  reordered if the batch owns all of its vertex arrays (see
+     *  @ref Batch::remapVertices()), otherwise only the indices change.
+     *
+     * @param before if not null, it's set to the cache statistics of the full
+     *  detail level before the optimization.
+     * @param after if not null, it's set to the cache statistics afterwards.
+     * @return whether the batch could be optimized. Only indexed batches which
+     *  are rendered as GL_TRIANGLES without primitive restart can be.
+     **/
+    static bool optimizeBatch(Batch* batch, bool reduceOverdraw = false, int cacheSize = 16,
+                              CacheStatistics* before = 0, CacheStatistics* after = 0);
+};
+
+template<typename T> void MeshOptimizer::remapVertices(QVector<T>& data, const QVector<unsigned int>& remap)
+{
+    if (data.count() != remap.count()) {
+        return;
+    }
+    QVector<T> remapped(data.count());
+    for (int i = 0; i < data.count(); i++) {
+        remapped[remap[i]] = data[i];
+    }
+    data = remapped;
+}
+
+}
+
+#endif
@@ -57,6 +57,7 @@ Program::Program(const QString& vertexshaderfile, const QString& fragmentshaderf
 
 Program::~Program()
 {
+    renderer->programDeleted(this);
     glDeleteProgram(glId());
     delete[] mLinkLog;
     delete mUniformLocations;
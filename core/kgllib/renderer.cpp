@@ -26,11 +26,63 @@
 namespace KGLLib
 {
 
+namespace
+{
+// Marks texture bindings which aren't known
+const GLuint UnknownTexture = ~0u;
+
+#if defined(GL_KHR_debug) || defined(GL_ARB_debug_output)
+void GLAPIENTRY debugOutputCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length,
+                                    const GLchar* message, const void* userParam)
+{
+    Q_UNUSED(source);
+    Q_UNUSED(id);
+    Q_UNUSED(length);
+    Q_UNUSED(userParam);
+    if (type == GL_DEBUG_TYPE_ERROR_ARB || severity == GL_DEBUG_SEVERITY_HIGH_ARB) {
+        qCritical() << "GL error:" << message;
+    } else {
+        qWarning() << "GL:" << message;
+    }
+}
+#endif
+
+void enableDebugOutput(bool enable)
+{
+#ifdef GL_KHR_debug
+    if (GLEW_KHR_debug) {
+        if (enable) {
+            glDebugMessageCallback((GLDEBUGPROC)debugOutputCallback, 0);
+            // Notifications are only informational and can be very frequent
+            glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, 0, GL_FALSE);
+            glEnable(GL_DEBUG_OUTPUT);
+        } else {
+            glDisable(GL_DEBUG_OUTPUT);
+            glDebugMessageCallback(0, 0);
+        }
+        return;
+    }
+#endif
+#ifdef GL_ARB_debug_output
+    if (GLEW_ARB_debug_output) {
+        glDebugMessageCallbackARB(enable ? (GLDEBUGPROCARB)debugOutputCallback : 0, 0);
+    }
+#else
+    Q_UNUSED(enable);
+#endif
+}
+}
+
 Renderer::Renderer()
 {
     mDefaultTextureFilter = GL_LINEAR_MIPMAP_LINEAR;
     mDefaultTextureWrapMode = GL_CLAMP;
-    mAutoDebugOutput = false;
+    mErrorCheckMode = defaultErrorCheckMode();
+    mStateCaching = true;
+    // Initial GL state
+    mActiveTextureUnit = 0;
+    mCurrentProgram = 0;
+    mCurrentProgramKnown = true;
 }
 
 Renderer::~Renderer()
@@ -42,38 +94,233 @@ bool Renderer::init()
     return true;
 }
 
+int Renderer::targetIndex(GLenum target)
+{
+    switch (target) {
+        case GL_TEXTURE_1D:
+            return 0;
+        case GL_TEXTURE_2D:
+            return 1;
+        case GL_TEXTURE_3D:
+            return 2;
+        case GL_TEXTURE_CUBE_MAP:
+            return 3;
+        case GL_TEXTURE_RECTANGLE_ARB:
+            return 4;
+        default:
+            return -1;
+    }
+}
+
+Renderer::TextureUnit* Renderer::trackedUnit(GLenum target, int* index)
+{
+    if (!mStateCaching || mActiveTextureUnit < 0) {
+        return 0;
+    }
+    *index = targetIndex(target);
+    if (*index < 0) {
+        return 0;
+    }
+    if (mActiveTextureUnit >= mTextureUnits.count()) {
+        int oldcount = mTextureUnits.count();
+        mTextureUnits.resize(mActiveTextureUnit + 1);
+        for (int i = oldcount; i < mTextureUnits.count(); i++) {
+            for (int t = 0; t < TargetCount; t++) {
+                mTextureUnits[i].boundTextures[t] = UnknownTexture;
+                mTextureUnits[i].enabledTargets[t] = -1;
+            }
+        }
+    }
+    return &mTextureUnits[mActiveTextureUnit];
+}
+
 bool Renderer::bindTexture(const TextureBase* tex)
 {
+    int target;
+    TextureUnit* unit = trackedUnit(tex->glTarget(), &target);
+    if (unit) {
+        if (unit->boundTextures[target] == tex->glId()) {
+            return true;
+        }
+        unit->boundTextures[target] = tex->glId();
+    }
     glBindTexture(tex->glTarget(), tex->glId());
-    return checkGLError("Renderer::bindTexture(" + tex->debugString() + ')');
+    return checkError("Renderer::bindTexture", tex);
 }
 
 bool Renderer::unbindTexture(const TextureBase* tex)
 {
+    int target;
+    TextureUnit* unit = trackedUnit(tex->glTarget(), &target);
+    if (unit) {
+        if (unit->boundTextures[target] == 0) {
+            return true;
+        }
+        unit->boundTextures[target] = 0;
+    }
     glBindTexture(tex->glTarget(), 0);
-    return checkGLError("Renderer::unbindTexture(" + tex->debugString() + ')');
+    return checkError("Renderer::unbindTexture", tex);
 }
 bool Renderer::enableTexture(const TextureBase* tex)
 {
+    int target;
+    TextureUnit* unit = trackedUnit(tex->glTarget(), &target);
+    if (unit) {
+        if (unit->enabledTargets[target] == 1) {
+            return true;
+        }
+        unit->enabledTargets[target] = 1;
+    }
     glEnable(tex->glTarget());
-    return checkGLError("Renderer::enableTexture(" + tex->debugString() + ')');
+    return checkError("Renderer::enableTexture", tex);
 }
 
 bool Renderer::disableTexture(const TextureBase* tex)
 {
+    int target;
+    TextureUnit* unit = trackedUnit(tex->glTarget(), &target);
+    if (unit) {
+        if (unit->enabledTargets[target] == 0) {
+            return true;
+        }
+        unit->enabledTargets[target] = 0;
+    }
     glDisable(tex->glTarget());
-    return checkGLError("Renderer::disableTexture(" + tex->debugString() + ')');
+    return checkError("Renderer::disableTexture", tex);
+}
+
+bool Renderer::setActiveTextureUnit(int unit)
+{
+    if (mStateCaching && unit == mActiveTextureUnit) {
+        return true;
+    }
+    mActiveTextureUnit = unit;
+    glActiveTexture(GL_TEXTURE0 + unit);
+    return checkError("Renderer::setActiveTextureUnit");
 }
 
 bool Renderer::bindProgram(const Program* prog)
 {
+    GLuint id = prog ? prog->glId() : 0;
+    if (mStateCaching && mCurrentProgramKnown && mCurrentProgram == id) {
+        return true;
+    }
+    mCurrentProgram = id;
+    mCurrentProgramKnown = true;
     if (prog) {
-        glUseProgram(prog->glId());
-        return checkGLError("Renderer::bindProgram()");
+        glUseProgram(id);
+        return checkError("Renderer::bindProgram");
     } else {
         glUseProgram(0);
-        return checkGLError("Renderer::bindProgram(0)");
+        return checkError("Renderer::bindProgram(0)");
+    }
+}
+
+void Renderer::textureDeleted(const TextureBase* tex)
+{
+    // GL unbinds deleted textures from all units
+    int target = targetIndex(tex->glTarget());
+    if (target < 0) {
+        return;
+    }
+    for (int i = 0; i < mTextureUnits.count(); i++) {
+        if (mTextureUnits[i].boundTextures[target] == tex->glId()) {
+            mTextureUnits[i].boundTextures[target] = 0;
+        }
+    }
+}
+
+void Renderer::programDeleted(const Program* prog)
+{
+    if (mCurrentProgramKnown && mCurrentProgram == prog->glId()) {
+        mCurrentProgramKnown = false;
+    }
+}
+
+void Renderer::invalidateState()
+{
+    mTextureUnits.clear();
+    // The active unit is queried since most code never changes it
+    GLint unit = GL_TEXTURE0;
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &unit);
+    mActiveTextureUnit = unit - GL_TEXTURE0;
+    mCurrentProgram = 0;
+    mCurrentProgramKnown = false;
+}
+
+void Renderer::setStateCaching(bool caching)
+{
+    mStateCaching = caching;
+    invalidateState();
+}
+
+Renderer::ErrorCheckMode Renderer::defaultErrorCheckMode()
+{
+#ifdef QT_NO_DEBUG
+    return DeferredErrorChecks;
+#else
+    return ImmediateErrorChecks;
+#endif
+}
+
+bool Renderer::isDebugOutputSupported()
+{
+#ifdef GL_KHR_debug
+    if (GLEW_KHR_debug) {
+        return true;
+    }
+#endif
+#ifdef GL_ARB_debug_output
+    if (GLEW_ARB_debug_output) {
+        return true;
+    }
+#endif
+    return false;
+}
+
+void Renderer::setErrorCheckMode(ErrorCheckMode mode)
+{
+    if (mode == DebugOutputErrorChecks && !isDebugOutputSupported()) {
+        qWarning() << "Renderer::setErrorCheckMode(): debug output isn't supported, using deferred error checks";
+        mode = DeferredErrorChecks;
+    }
+    if (mode == mErrorCheckMode) {
+        return;
+    }
+    if (mErrorCheckMode == DebugOutputErrorChecks) {
+        enableDebugOutput(false);
+    } else if (mode == DebugOutputErrorChecks) {
+        enableDebugOutput(true);
+    }
+    mErrorCheckMode = mode;
+}
+
+bool Renderer::reportError(const char* function, const TextureBase* tex) const
+{
+    GLenum error = glGetError();
+    if (error == GL_NO_ERROR) {
+        return true;
+    }
+    if (tex) {
+        qCritical() << function << "(" << qPrintable(tex->debugString()) << "):" << glErrorString(error);
+    } else {
+        qCritical() << function << ":" << glErrorString(error);
+    }
+    return false;
+}
+
+bool Renderer::checkFrameErrors()
+{
+    if (mErrorCheckMode == NoErrorChecks || mErrorCheckMode == DebugOutputErrorChecks) {
+        return true;
+    }
+    // Several errors may have been recorded since the last check
+    bool ok = true;
+    for (GLenum error = glGetError(); error != GL_NO_ERROR; error = glGetError()) {
+        qCritical() << "Error during frame:" << glErrorString(error);
+        ok = false;
     }
+    return ok;
 }
 
 void Renderer::setDefaultTextureFilter(GLenum filter)
@@ -88,7 +335,7 @@ void Renderer::setDefaultTextureWrapMode(GLenum mode)
 
 void Renderer::setAutoDebugOutput(bool output)
 {
-    mAutoDebugOutput = output;
+    setErrorCheckMode(output ? DebugOutputErrorChecks : defaultErrorCheckMode());
 }
 
 
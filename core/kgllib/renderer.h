@@ -20,14 +20,48 @@
 
 #include "kgllib.h"
 
+#include <QtCore/QVector>
+
 namespace KGLLib
 {
 class TextureBase;
 class Program;
 
+/**
+ * @brief Issues state changing GL calls on behalf of other classes.
+ *
+ * Renderer keeps track of the texture bound to each target of each texture
+ *  unit, the enabled texture targets, the active texture unit and the
+ *  current program, and skips calls which wouldn't change any of them.
+ *
+ * This only works if these states aren't changed behind Renderer's back.
+ *  Code which calls e.g. glBindTexture() or glPopAttrib() directly, or
+ *  switches to another GL context, should call @ref invalidateState()
+ *  afterwards. Alternatively, the tracking can be disabled completely using
+ *  @ref setStateCaching().
+ *
+ * Renderer also decides how GL errors are detected, see
+ *  @ref setErrorCheckMode().
+ **/
 class KGLLIB_EXPORT Renderer
 {
 public:
+    /**
+     * Ways of detecting GL errors.
+     **/
+    enum ErrorCheckMode {
+        /// Errors aren't checked at all
+        NoErrorChecks,
+        /// glGetError() is called after every call which changes GL state.
+        ///  This stalls the pipeline but identifies the failing call.
+        ImmediateErrorChecks,
+        /// glGetError() is called once per frame by @ref checkFrameErrors()
+        DeferredErrorChecks,
+        /// Errors are reported by the driver using KHR_debug or
+        ///  ARB_debug_output, without any glGetError() calls
+        DebugOutputErrorChecks
+    };
+
     Renderer();
     virtual ~Renderer();
 
@@ -37,22 +71,120 @@ public:
     virtual bool unbindTexture(const TextureBase* tex);
     virtual bool enableTexture(const TextureBase* tex);
     virtual bool disableTexture(const TextureBase* tex);
+    /**
+     * Makes @p unit the active texture unit, i.e. the one affected by the
+     *  texture methods.
+     **/
+    virtual bool setActiveTextureUnit(int unit);
 
     virtual bool bindProgram(const Program* prog);
 
+    /**
+     * Must be called when a texture is deleted, so that a new texture reusing
+     *  its id isn't assumed to be bound.
+     **/
+    void textureDeleted(const TextureBase* tex);
+    /**
+     * Must be called when a program is deleted.
+     **/
+    void programDeleted(const Program* prog);
+
+    /**
+     * Forgets all tracked state, so that the next calls are issued
+     *  unconditionally. Only the active texture unit is queried from GL.
+     **/
+    void invalidateState();
+    /**
+     * Enables or disables tracking of the GL state. If it's disabled, all
+     *  calls are passed to GL.
+     *
+     * Default value is true.
+     **/
+    void setStateCaching(bool caching);
+    bool stateCaching() const  { return mStateCaching; }
+    /**
+     * @return index of the active texture unit.
+     **/
+    int activeTextureUnit() const  { return mActiveTextureUnit; }
+
+    /**
+     * Sets how GL errors are detected. @ref DebugOutputErrorChecks requires a
+     *  current GL context; if neither KHR_debug nor ARB_debug_output is
+     *  supported, @ref DeferredErrorChecks is used instead. Note that some
+     *  drivers only report errors this way in debug contexts.
+     *
+     * Default value is @ref DeferredErrorChecks in release builds and
+     *  @ref ImmediateErrorChecks in debug builds.
+     **/
+    void setErrorCheckMode(ErrorCheckMode mode);
+    ErrorCheckMode errorCheckMode() const  { return mErrorCheckMode; }
+    /**
+     * @return whether errors can be reported using
+     *  @ref DebugOutputErrorChecks.
+     **/
+    static bool isDebugOutputSupported();
+    /**
+     * Reports all errors which have occurred since the last call, unless
+     *  errors aren't checked at all or are reported by the driver. GLWidget
+     *  calls this after rendering each frame.
+     *
+     * @return whether no errors have occurred.
+     **/
+    bool checkFrameErrors();
+
     // The highly experimental API follows:
     void setDefaultTextureFilter(GLenum filter);
     void setDefaultTextureWrapMode(GLenum mode);
+    /**
+     * Same as setting the error check mode to @ref DebugOutputErrorChecks or
+     *  back to the default value.
+     **/
     void setAutoDebugOutput(bool output);
 
     GLenum defaultTextureFilter() const  { return mDefaultTextureFilter; }
     GLenum defaultTextureWrapMode() const  { return mDefaultTextureWrapMode; }
-    bool autoDebugOutput() const  { return mAutoDebugOutput; }
+    bool autoDebugOutput() const  { return mErrorCheckMode == DebugOutputErrorChecks; }
+
+protected:
+    /**
+     * Checks for errors after a state change made by @p function, if errors
+     *  are checked immediately. The description of the error is only created
+     *  if an error has occurred.
+     *
+     * @return whether error has not occurred.
+     **/
+    bool checkError(const char* function, const TextureBase* tex = 0) const
+    {
+        return mErrorCheckMode != ImmediateErrorChecks || reportError(function, tex);
+    }
 
 private:
+    bool reportError(const char* function, const TextureBase* tex) const;
+    static ErrorCheckMode defaultErrorCheckMode();
+
+    // Tracked state of a single texture unit. Targets are indexed using
+    //  targetIndex().
+    enum { TargetCount = 5 };
+    struct TextureUnit
+    {
+        GLuint boundTextures[TargetCount];
+        // 1 if the target is enabled, 0 if disabled, -1 if unknown
+        signed char enabledTargets[TargetCount];
+    };
+    static int targetIndex(GLenum target);
+    // Returns the tracked state of the active unit and the target's index in
+    //  it, or 0 if the state can't be tracked.
+    TextureUnit* trackedUnit(GLenum target, int* index);
+
     GLenum mDefaultTextureFilter;
     GLenum mDefaultTextureWrapMode;
-    bool mAutoDebugOutput;
+    ErrorCheckMode mErrorCheckMode;
+
+    bool mStateCaching;
+    QVector<TextureUnit> mTextureUnits;
+    int mActiveTextureUnit;
+    GLuint mCurrentProgram;
+    bool mCurrentProgramKnown;
 };
 
 }
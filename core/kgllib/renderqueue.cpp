@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "renderqueue.h"
+
+#include "mesh.h"
+#include "program.h"
+#include "renderer.h"
+#include "texture.h"
+
+#include <QtCore/QtAlgorithms>
+
+#include <string.h>
+
+
+namespace KGLLib
+{
+
+namespace
+{
+// Widths of the fields of the sort key
+const int PassBits = 4;
+const int ProgramBits = 10;
+const int TextureBits = 12;
+const int BufferBits = 12;
+const int DepthBits = 24;
+
+quint64 field(quint64 value, int bits)
+{
+    return value & ((quint64(1) << bits) - 1);
+}
+
+// Quantizes a non-negative distance so that the order is kept. The bit
+//  patterns of positive floats are ordered the same way as the values, so
+//  the highest bits can be used directly.
+quint64 depthBits(float depth)
+{
+    if (!(depth > 0)) {
+        return 0;
+    }
+    quint32 bits;
+    memcpy(&bits, &depth, sizeof(bits));
+    return bits >> (31 - DepthBits);
+}
+
+// Whether the geometry of two meshes can be rendered without rebinding
+bool canShareBinding(const Mesh* a, const Mesh* b)
+{
+    return a->buffer() == b->buffer() && a->attributeProgram() == b->attributeProgram() &&
+            !a->instanceBuffer() && !b->instanceBuffer();
+}
+}
+
+
+RenderQueue::RenderQueue()
+{
+    mCamera = 0;
+}
+
+RenderQueue::~RenderQueue()
+{
+}
+
+int RenderQueue::stateId(const void* object)
+{
+    if (!object) {
+        return 0;
+    }
+    int id = mStateIds.value(object);
+    if (!id) {
+        id = mStateIds.count() + 1;
+        mStateIds.insert(object, id);
+    }
+    return id;
+}
+
+quint64 RenderQueue::sortKey(const Mesh* mesh, const Eigen::Transform3f& modelview)
+{
+    float depth = 0;
+    if (mCamera) {
+        depth = -(modelview * mesh->boundingSphereCenter()).z();
+    }
+    quint64 program = field(stateId(mesh->program()), ProgramBits);
+    quint64 texture = field(stateId(mesh->texture(0)), TextureBits);
+    quint64 buffer = field(stateId(mesh->buffer()), BufferBits);
+    quint64 state = (program << (TextureBits + BufferBits)) | (texture << BufferBits) | buffer;
+    const int stateBits = ProgramBits + TextureBits + BufferBits;
+
+    quint64 key = field(mesh->renderPass(), PassBits) << 1;
+    if (mesh->isTransparent()) {
+        // Farthest meshes first
+        quint64 distance = field(~depthBits(depth), DepthBits);
+        key = ((key | 1) << (DepthBits + stateBits)) | (distance << stateBits) | state;
+    } else {
+        key = (key << (DepthBits + stateBits)) | (state << DepthBits) | depthBits(depth);
+    }
+    return key;
+}
+
+void RenderQueue::submit(Mesh* mesh)
+{
+    Eigen::Transform3f modelview;
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview.data());
+    submit(mesh, modelview);
+}
+
+void RenderQueue::submit(Mesh* mesh, const Eigen::Transform3f& modelview)
+{
+    Item item;
+    item.key = sortKey(mesh, modelview);
+    item.mesh = mesh;
+    item.lod = mesh->currentLod();
+    memcpy(item.modelview, modelview.data(), sizeof(item.modelview));
+    mItems.append(item);
+}
+
+void RenderQueue::render()
+{
+    if (mItems.isEmpty()) {
+        return;
+    }
+    // Meshes with equal keys are rendered in the order of submission
+    qStableSort(mItems.begin(), mItems.end());
+
+    // Uploading data may bind buffers, so it's done before anything is bound
+    for (int i = 0; i < mItems.count(); i++) {
+        mItems[i].mesh->update();
+    }
+
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    const float* modelview = 0;
+
+    Program* program = 0;
+    QVector<Texture*> textures;
+    Mesh* bound = 0;
+    for (int i = 0; i < mItems.count(); i++) {
+        const Item& item = mItems[i];
+        Mesh* mesh = item.mesh;
+
+        if (i == 0 || mesh->program() != program) {
+            program = mesh->program();
+            renderer->bindProgram(program);
+        }
+
+        if (mesh->textureCount() > textures.count()) {
+            textures.resize(mesh->textureCount());
+        }
+        for (int unit = 0; unit < textures.count(); unit++) {
+            Texture* tex = mesh->texture(unit);
+            Texture* old = textures[unit];
+            if (tex == old) {
+                continue;
+            }
+            renderer->setActiveTextureUnit(unit);
+            if (old && (!tex || old->glTarget() != tex->glTarget())) {
+                old->disable();
+            }
+            if (tex) {
+                tex->enable();
+            }
+            textures[unit] = tex;
+        }
+
+        // Batch::bind() only binds the geometry, unlike Mesh::bind()
+        if (bound && !canShareBinding(bound, mesh)) {
+            bound->Batch::unbind();
+            bound = 0;
+        }
+        if (!bound) {
+            mesh->Batch::bind();
+            bound = mesh;
+        }
+        // Consecutive submissions often share the transform
+        if (!modelview || memcmp(modelview, item.modelview, sizeof(item.modelview))) {
+            modelview = item.modelview;
+            glLoadMatrixf(modelview);
+        }
+        mesh->setCurrentLod(item.lod);
+        mesh->renderOnce();
+    }
+
+    if (bound) {
+        bound->Batch::unbind();
+    }
+    glPopMatrix();
+    for (int unit = textures.count()-1; unit >= 0; unit--) {
+        if (textures[unit]) {
+            renderer->setActiveTextureUnit(unit);
+            textures[unit]->disable();
+        }
+    }
+    if (program) {
+        renderer->bindProgram(0);
+    }
+    mItems.clear();
+}
+
+void RenderQueue::clear()
+{
+    mItems.clear();
+}
+
+}
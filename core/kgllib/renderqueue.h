@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KGLLIB_RENDERQUEUE_H
+#define KGLLIB_RENDERQUEUE_H
+
+#include "kgllib.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QVector>
+
+#include <Eigen/Geometry>
+
+
+namespace KGLLib
+{
+class Camera;
+class Mesh;
+
+/**
+ * @brief Collects meshes during a frame and renders them in state order.
+ *
+ * Rendering every mesh as soon as it's visited binds and unbinds its
+ *  program, textures and geometry buffer for each draw. RenderQueue instead
+ *  collects the meshes which are submitted to it and renders them all in
+ *  @ref render(), ordered by a 64-bit sort key. From the most to the least
+ *  significant bits, the key contains:
+ * @li the render pass (see @ref Mesh::setRenderPass()), so that e.g. a sky
+ *  box can be rendered before everything else
+ * @li whether the mesh is transparent (see @ref Mesh::setTransparent()).
+ *  Transparent meshes are rendered after the opaque ones.
+ * @li for opaque meshes: the program, the texture in unit 0, the geometry
+ *  buffer and finally the distance from the camera, front to back. This
+ *  changes state only once per distinct material and lets early depth
+ *  testing reject hidden fragments.
+ * @li for transparent meshes: the distance from the camera, back to front,
+ *  as needed for correct blending, followed by the state.
+ *
+ * Consecutive meshes only change the state which differs between them. The
+ *  changes are made through the global @ref Renderer.
+ *
+ * A mesh is submitted to the queue when it's rendered while the queue is
+ *  set using @ref Mesh::setRenderQueue(), or explicitly using @ref submit():
+ * @code
+ * RenderQueue* queue = new RenderQueue;
+ * queue->setCamera(camera());
+ * foreach (Mesh* m, meshes) {
+ *     m->setRenderQueue(queue);
+ * }
+ * ...
+ * // In your rendering loop:
+ * foreach (Mesh* m, meshes) {
+ *     m->render();
+ * }
+ * queue->render();
+ * @endcode
+ *
+ * Every submission records the modelview matrix and the level of detail
+ *  which are current at that point. They're restored right before the mesh
+ *  is drawn, so meshes can be positioned using the usual matrix calls and
+ *  the same mesh can be submitted several times with different transforms.
+ *  The matrices are loaded into the GL_MODELVIEW matrix stack, which is
+ *  restored afterwards.
+ *
+ * Frustum culling and level of detail selection are done by
+ *  @ref Mesh::render() before the mesh is submitted. Instanced rendering
+ *  isn't supported by the queue.
+ **/
+class KGLLIB_EXPORT RenderQueue
+{
+public:
+    /**
+     * Constructs an empty RenderQueue.
+     **/
+    RenderQueue();
+    virtual ~RenderQueue();
+
+    /**
+     * Sets the camera used for sorting by distance. The distances are
+     *  computed in eye space using the modelview matrix recorded for each
+     *  submission. If no camera is set, meshes aren't sorted by distance.
+     **/
+    void setCamera(KGLLib::Camera* camera)  { mCamera = camera; }
+    /**
+     * @return camera used for sorting by distance
+     **/
+    KGLLib::Camera* camera() const  { return mCamera; }
+
+    /**
+     * Adds @p mesh to the queue. The mesh is rendered by the next
+     *  @ref render() call, using the current GL modelview matrix and the
+     *  mesh's current level of detail.
+     *
+     * This reads the modelview matrix back from GL. Use the other overload
+     *  if you already know it.
+     **/
+    void submit(Mesh* mesh);
+    /**
+     * Adds @p mesh to the queue, to be rendered with the given modelview
+     *  matrix and the mesh's current level of detail.
+     **/
+    void submit(Mesh* mesh, const Eigen::Transform3f& modelview);
+    /**
+     * @return number of meshes submitted since the last render() call.
+     **/
+    int count() const  { return mItems.count(); }
+
+    /**
+     * Sorts and renders all submitted meshes and clears the queue.
+     *
+     * Afterwards no program is bound and the textures used by the meshes are
+     *  disabled.
+     **/
+    virtual void render();
+    /**
+     * Removes all submitted meshes without rendering them.
+     **/
+    void clear();
+
+    /**
+     * @return sort key of @p mesh rendered with the given modelview matrix,
+     *  computed as described above.
+     **/
+    quint64 sortKey(const Mesh* mesh, const Eigen::Transform3f& modelview);
+
+private:
+    struct Item
+    {
+        quint64 key;
+        Mesh* mesh;
+        int lod;
+        // Stored as a plain array as QVector doesn't keep Eigen's alignment
+        float modelview[16];
+        bool operator<(const Item& other) const  { return key < other.key; }
+    };
+
+    // Returns a small number identifying the given state object
+    int stateId(const void* object);
+
+    KGLLib::Camera* mCamera;
+    QVector<Item> mItems;
+    // Ids of programs, textures and buffers, assigned in the order in which
+    //  they're first seen
+    QHash<const void*, int> mStateIds;
+};
+
+}
+
+#endif
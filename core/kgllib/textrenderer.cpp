@@ -27,6 +27,7 @@
 #include "textrenderer.h"
 
 #include "glwidget.h"
+#include "renderer.h"
 
 #include <QPainter>
 #include <QHash>
@@ -496,6 +497,7 @@ namespace KGLLib {
       glPopMatrix();
       glMatrixMode( GL_MODELVIEW );
       glPopAttrib();
+      renderer->invalidateState();
       d->textmode = false;
       d->glwidget = 0;
     }
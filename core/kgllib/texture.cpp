@@ -181,6 +181,7 @@ TextureBase::TextureBase(const QString& name)
 TextureBase::~TextureBase()
 {
     if (mGLId) {
+        renderer->textureDeleted(this);
         glDeleteTextures(1, &mGLId);
     }
 }
@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "uploadqueue.h"
+
+#include "batch.h"
+#include "geometrybuffer.h"
+
+#include <QtCore/QMutexLocker>
+#include <QtCore/QRunnable>
+#include <QtCore/QThreadPool>
+#include <QtCore/QVector>
+
+#include <string.h>
+
+
+namespace KGLLib
+{
+
+namespace
+{
+// Records the writes made to a buffer instead of passing them to GL, so that
+//  the data can be prepared without a GL context.
+class StagingBuffer : public GeometryBuffer
+{
+public:
+    struct Chunk
+    {
+        int offset;
+        // Size of a single element and number of elements
+        int size;
+        int count;
+        // Distance between the elements in the buffer
+        int stride;
+        QVector<char> data;
+    };
+
+    StagingBuffer(const GeometryBufferFormat& format) : GeometryBuffer(format)  {}
+
+    virtual void renderIndexedSubset(int, int, int)  {}
+    virtual void renderSubset(int, int)  {}
+    virtual void renderIndexedSubsetInstanced(int, int, int, int)  {}
+    virtual void renderSubsetInstanced(int, int, int)  {}
+
+    void coalesce();
+    int byteCount() const;
+
+    QList<Chunk> vertexChunks;
+    QList<Chunk> indexChunks;
+
+protected:
+    virtual void addData(void* data, int size, int offset)
+    {
+        record(vertexChunks, data, size, 1, offset, size);
+    }
+    virtual void addIndexData(void* data, int size, int offset)
+    {
+        record(indexChunks, data, size, 1, offset, size);
+    }
+    virtual void addStridedData(void* data, int size, int count, int offset, int stride)
+    {
+        record(vertexChunks, data, size, count, offset, stride);
+    }
+
+    void record(QList<Chunk>& chunks, void* data, int size, int count, int offset, int stride)
+    {
+        Chunk chunk;
+        chunk.offset = offset;
+        chunk.size = size;
+        chunk.count = count;
+        chunk.stride = stride;
+        chunk.data.resize(size * count);
+        memcpy(chunk.data.data(), data, size * count);
+        chunks.append(chunk);
+    }
+};
+
+void StagingBuffer::coalesce()
+{
+    // With interleaved layout, an update of all attributes writes one strided
+    //  chunk per attribute. If together they cover whole vertex records, they
+    //  are merged into a single contiguous image.
+    if (vertexChunks.count() < 2) {
+        return;
+    }
+    const Chunk& head = vertexChunks.first();
+    if (head.stride == head.size) {
+        return;
+    }
+    int covered = 0;
+    foreach (const Chunk& c, vertexChunks) {
+        if (c.count != head.count || c.stride != head.stride || c.offset != head.offset + covered) {
+            return;
+        }
+        covered += c.size;
+    }
+    if (covered != head.stride) {
+        return;
+    }
+
+    Chunk merged;
+    merged.offset = head.offset;
+    merged.size = head.count * head.stride;
+    merged.count = 1;
+    merged.stride = merged.size;
+    merged.data.resize(merged.size);
+    char* dst = merged.data.data();
+    int attroffset = 0;
+    foreach (const Chunk& c, vertexChunks) {
+        for (int i = 0; i < c.count; i++) {
+            memcpy(dst + i * c.stride + attroffset, c.data.constData() + i * c.size, c.size);
+        }
+        attroffset += c.size;
+    }
+    vertexChunks.clear();
+    vertexChunks.append(merged);
+}
+
+int StagingBuffer::byteCount() const
+{
+    int bytes = 0;
+    foreach (const Chunk& c, vertexChunks) {
+        bytes += c.data.count();
+    }
+    foreach (const Chunk& c, indexChunks) {
+        bytes += c.data.count();
+    }
+    return bytes;
+}
+}
+
+
+struct UploadQueue::Job
+{
+    Batch* batch;
+    Batch::UploadRange range;
+    // Format of the batch's buffer, which determines the data layout
+    GeometryBufferFormat format;
+    // Set by the worker thread
+    StagingBuffer* staging;
+    bool ready;
+};
+
+class UploadQueue::Task : public QRunnable
+{
+public:
+    Task(UploadQueue* queue, Job* job) : mQueue(queue), mJob(job)  {}
+    virtual void run()  { mQueue->prepare(mJob); }
+
+private:
+    UploadQueue* mQueue;
+    Job* mJob;
+};
+
+
+UploadQueue::UploadQueue(int frameBudget)
+{
+    mFrameBudget = frameBudget;
+}
+
+UploadQueue::~UploadQueue()
+{
+    while (!mJobs.isEmpty()) {
+        cancel(mJobs.first()->batch);
+    }
+}
+
+bool UploadQueue::enqueue(Batch* batch)
+{
+    if (batch->mUploadQueue) {
+        return batch->mUploadQueue == this;
+    }
+
+    Job* job = new Job;
+    if (!batch->beginUpload(&job->range)) {
+        delete job;
+        return false;
+    }
+    job->batch = batch;
+    job->format = batch->buffer()->format();
+    job->staging = 0;
+    job->ready = false;
+    batch->mUploadQueue = this;
+    mJobs.append(job);
+
+    QThreadPool::globalInstance()->start(new Task(this, job));
+    return true;
+}
+
+void UploadQueue::prepare(Job* job)
+{
+    StagingBuffer* staging = new StagingBuffer(job->format);
+    job->batch->writeData(staging, job->range);
+    staging->coalesce();
+
+    QMutexLocker locker(&mMutex);
+    job->staging = staging;
+    job->ready = true;
+    mReady.wakeAll();
+}
+
+void UploadQueue::waitUntilReady(Job* job)
+{
+    QMutexLocker locker(&mMutex);
+    while (!job->ready) {
+        mReady.wait(&mMutex);
+    }
+}
+
+int UploadQueue::processUploads()
+{
+    int uploaded = 0;
+    int i = 0;
+    while (i < mJobs.count()) {
+        Job* job = mJobs[i];
+        bool ready;
+        {
+            QMutexLocker locker(&mMutex);
+            ready = job->ready;
+        }
+        if (!ready) {
+            i++;
+            continue;
+        }
+        // At least one batch is uploaded per call, even if it's over budget
+        if (uploaded && uploaded + job->staging->byteCount() > mFrameBudget) {
+            break;
+        }
+        uploaded += apply(job);
+    }
+    return uploaded;
+}
+
+void UploadQueue::finish(Batch* batch)
+{
+    Job* job = findJob(batch);
+    if (!job) {
+        return;
+    }
+    waitUntilReady(job);
+    apply(job);
+}
+
+void UploadQueue::finishAll()
+{
+    while (!mJobs.isEmpty()) {
+        Job* job = mJobs.first();
+        waitUntilReady(job);
+        apply(job);
+    }
+}
+
+void UploadQueue::cancel(Batch* batch)
+{
+    Job* job = findJob(batch);
+    if (!job) {
+        return;
+    }
+    // The worker might still be reading the batch's arrays
+    waitUntilReady(job);
+
+    const Batch::UploadRange& range = job->range;
+    if (range.count > 0) {
+        batch->markDirty(range.attributes & ~Batch::Indices, range.first, range.count);
+    }
+    if (range.indexCount > 0) {
+        batch->markDirty(range.attributes & Batch::Indices, range.indexFirst, range.indexCount);
+    }
+    removeJob(job);
+}
+
+int UploadQueue::apply(Job* job)
+{
+    Batch* batch = job->batch;
+    GeometryBuffer* target = batch->buffer();
+    StagingBuffer* staging = job->staging;
+
+    target->bind();
+    if (job->range.orphan) {
+        target->orphan();
+    }
+    for (int i = 0; i < staging->vertexChunks.count(); i++) {
+        StagingBuffer::Chunk& c = staging->vertexChunks[i];
+        if (c.count == 1 || c.stride == c.size) {
+            target->addData(c.data.data(), c.data.count(), c.offset);
+        } else {
+            target->addStridedData(c.data.data(), c.size, c.count, c.offset, c.stride);
+        }
+    }
+    for (int i = 0; i < staging->indexChunks.count(); i++) {
+        StagingBuffer::Chunk& c = staging->indexChunks[i];
+        target->addIndexData(c.data.data(), c.data.count(), c.offset);
+    }
+    target->unbind();
+
+    int bytes = staging->byteCount();
+    removeJob(job);
+    batch->uploadDone();
+    batch->uploadFinished();
+    return bytes;
+}
+
+UploadQueue::Job* UploadQueue::findJob(Batch* batch) const
+{
+    foreach (Job* job, mJobs) {
+        if (job->batch == batch) {
+            return job;
+        }
+    }
+    return 0;
+}
+
+void UploadQueue::removeJob(Job* job)
+{
+    job->batch->mUploadQueue = 0;
+    mJobs.removeAll(job);
+    delete job->staging;
+    delete job;
+}
+
+}
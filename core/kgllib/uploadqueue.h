@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2008 Rivo Laks <rivolaks@hot.ee>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KGLLIB_UPLOADQUEUE_H
+#define KGLLIB_UPLOADQUEUE_H
+
+#include "kgllib.h"
+
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+
+
+namespace KGLLib
+{
+class Batch;
+
+/**
+ * @brief Prepares geometry data in worker threads and uploads it over several frames.
+ *
+ * Normally all the work of @ref Batch::update(), such as converting the
+ *  attributes to compact types and offsetting the indices, is done in the
+ *  rendering thread when the batch is first bound. For big models this
+ *  causes a noticeable hitch in the frame where they first appear.
+ *
+ * UploadQueue moves that work into worker threads. @ref enqueue() only
+ *  creates the batch's buffer and takes its dirty ranges. A worker thread
+ *  then writes the data into a final byte image which has exactly the layout
+ *  of the buffer. @ref processUploads(), which should be called once per
+ *  frame, copies the finished images into the buffers until the per-frame
+ *  byte budget is used up, and calls @ref Batch::uploadFinished() for every
+ *  uploaded batch.
+ * @code
+ * UploadQueue* uploads = new UploadQueue(2 * 1024 * 1024);
+ * foreach (Mesh* m, loadedModels) {
+ *     uploads->enqueue(m);
+ * }
+ * ...
+ * // In your rendering loop:
+ * uploads->processUploads();
+ * foreach (Mesh* m, loadedModels) {
+ *     if (!m->isUploadPending()) {
+ *         m->render();
+ *     }
+ * }
+ * @endcode
+ *
+ * The worker threads read the arrays of the batch, so these must not be
+ *  modified or deleted while @ref Batch::isUploadPending() returns true.
+ *  Rendering a pending batch makes it wait for its data and upload it
+ *  immediately.
+ *
+ * All methods must be called from the rendering thread.
+ **/
+class KGLLIB_EXPORT UploadQueue
+{
+public:
+    /**
+     * Constructs new UploadQueue object.
+     *
+     * @param frameBudget maximum number of bytes uploaded by a single
+     *  processUploads() call.
+     **/
+    UploadQueue(int frameBudget = 4 * 1024 * 1024);
+    /**
+     * Deletes the queue. Batches whose data hasn't been uploaded yet are
+     *  marked dirty again, so that they're updated the usual way.
+     **/
+    virtual ~UploadQueue();
+
+    /**
+     * Sets the maximum number of bytes uploaded by a single processUploads()
+     *  call. A batch is never split, so a batch bigger than the budget is
+     *  uploaded in a frame of its own.
+     **/
+    void setFrameBudget(int bytes)  { mFrameBudget = bytes; }
+    /**
+     * @return maximum number of bytes uploaded per frame.
+     **/
+    int frameBudget() const  { return mFrameBudget; }
+
+    /**
+     * Starts preparing the changed data of @p batch in a worker thread.
+     *
+     * If the batch is already pending, this does nothing. Changes made in the
+     *  meantime are uploaded by the next enqueue() or @ref Batch::update().
+     *
+     * @return whether the batch has data pending in this queue.
+     **/
+    bool enqueue(Batch* batch);
+    /**
+     * @return number of batches whose data hasn't been uploaded yet.
+     **/
+    int pendingCount() const  { return mJobs.count(); }
+
+    /**
+     * Uploads the data which has been prepared by the worker threads, up to
+     *  the per-frame budget.
+     *
+     * @return number of uploaded bytes.
+     **/
+    int processUploads();
+    /**
+     * Waits until the data of @p batch is prepared and uploads it.
+     **/
+    void finish(Batch* batch);
+    /**
+     * Waits for all pending batches and uploads their data.
+     **/
+    void finishAll();
+    /**
+     * Drops the pending data of @p batch. The batch is marked dirty again.
+     **/
+    void cancel(Batch* batch);
+
+protected:
+    struct Job;
+    class Task;
+
+    // Called in a worker thread
+    void prepare(Job* job);
+    void waitUntilReady(Job* job);
+    int apply(Job* job);
+    Job* findJob(Batch* batch) const;
+    void removeJob(Job* job);
+
+private:
+    // Only the ready flag and staged data of a job are shared with the
+    //  workers, everything else is used from the rendering thread.
+    QList<Job*> mJobs;
+    int mFrameBudget;
+    QMutex mMutex;
+    QWaitCondition mReady;
+};
+
+}
+
+#endif
@@ -19,6 +19,7 @@
 
 #include "rendertarget.h"
 #include "program.h"
+#include "renderer.h"
 #include "shader.h"
 #include "texture.h"
 #include "fpscounter.h"
@@ -293,7 +294,7 @@ void HdrGLWidget::calculateHdrExposure()
 void HdrGLWidget::hdrTonemapping()
 {
     // Bind scene texture
-    glActiveTexture(GL_TEXTURE0);
+    renderer->setActiveTextureUnit(0);
     mSceneRenderTarget->texture()->enable();
     // Bind tonemapping shader
     mTonemappingProgram->bind();
@@ -303,7 +304,7 @@ void HdrGLWidget::hdrTonemapping()
     render2DQuad(width(), height());
     // Unbind everything
     mTonemappingProgram->unbind();
-    glActiveTexture(GL_TEXTURE0);
+    renderer->setActiveTextureUnit(0);
     mSceneRenderTarget->texture()->disable();
 }
 
@@ -334,7 +335,7 @@ void HdrGLWidget::hdrBloom()
     // First the horizontal blur pass
     activateRenderTarget(mBloomHTarget);
     // Bind scene texture
-    glActiveTexture(GL_TEXTURE0);
+    renderer->setActiveTextureUnit(0);
     sourceTarget->texture()->enable();
     // Bind tonemapping shader
     mBloomHProgram->bind();
@@ -350,7 +351,7 @@ void HdrGLWidget::hdrBloom()
     render2DQuad(blurw, blurh);
     // Unbind everything
     mBloomHProgram->unbind();
-    glActiveTexture(GL_TEXTURE0);
+    renderer->setActiveTextureUnit(0);
     sourceTarget->texture()->disable();
     deactivateRenderTarget(mBloomHTarget);
 
@@ -374,7 +375,7 @@ void HdrGLWidget::hdrBloom()
         glBlendFunc(GL_ONE, GL_ONE);
     }
     // Bind scene texture
-    glActiveTexture(GL_TEXTURE0);
+    renderer->setActiveTextureUnit(0);
     mBloomHTarget->texture()->enable();
     // Bind tonemapping shader
     mBloomVProgram->bind();
@@ -384,7 +385,7 @@ void HdrGLWidget::hdrBloom()
     render2DQuad(blurw, blurh);
     // Unbind everything
     mBloomVProgram->unbind();
-    glActiveTexture(GL_TEXTURE0);
+    renderer->setActiveTextureUnit(0);
     mBloomHTarget->texture()->disable();
 
     if (mBloomDownsize != 1) {
@@ -447,6 +448,7 @@ void HdrGLWidget::deactivateRenderTarget(RenderTarget* target) const
 {
     target->disable();
     glPopAttrib();
+    renderer->invalidateState();
 }
 
 float* HdrGLWidget::calculateBlurKernel(float sigma, int radius)
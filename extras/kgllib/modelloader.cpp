@@ -18,12 +18,14 @@
 #include "modelloader.h"
 
 #include "batch.h"
+#include "meshoptimizer.h"
 #include "mesh.h"
 
 #include <QString>
 #include <QFile>
 #include <QByteArray>
 #include <QList>
+#include <QVector>
 #include <QtDebug>
 
 #include <Eigen/Geometry>
@@ -74,20 +76,6 @@ uint qHash(const ModelLoader::FaceVertex& v)
     return qHash(qMakePair(v.vertex, qMakePair(v.texcoord, v.normal)));
 }
 
-namespace
-{
-template<typename T> T* listToArray(const QList<T>& list)
-{
-    T* array = new T[list.count()];
-    int index = 0;
-    foreach (T element, list) {
-        array[index++] = element;
-    }
-    return array;
-}
-}
-
-
 QDebug& operator<<(QDebug& debug, const Vector3f& v)
 {
     return debug << "(" << v.x() << "," << v.y() << "," << v.z() << ")";
@@ -101,11 +89,13 @@ QDebug& operator<<(QDebug& debug, const Vector2f& v)
 ModelLoader::ModelLoader()
 {
     mValid = false;
+    mLodCount = 1;
 }
 
 ModelLoader::ModelLoader(const QString& filename)
 {
     mValid = false;
+    mLodCount = 1;
     load(filename);
 }
 
@@ -187,21 +177,26 @@ void ModelLoader::loadIntoBatch(Batch* batch)
         return;
     }
 
+    // The vectors are implicitly shared with the batch, which owns them from
+    //  now on, so nothing is copied
     // Indices
-    batch->setIndices(listToArray(mIndices), mIndices.count());
+    batch->setIndices(mIndices);
 
-    // Vertices
-    batch->setVertexCount(mVertices.count());
-    batch->setVertices(listToArray(mVertices));
+    // Vertices (this also sets the vertex count)
+    batch->setVertices(mVertices);
 
     // Normals
     if (!mNormals.isEmpty()) {
-        batch->setNormals(listToArray(mNormals));
+        batch->setNormals(mNormals);
     }
 
     // Texcoords
     if (!mTexcoords.isEmpty()) {
-        batch->setTexcoords(listToArray(mTexcoords));
+        batch->setTexcoords(mTexcoords);
+    }
+
+    if (mLodCount > 1) {
+        batch->generateLods(mLodCount);
     }
 }
 
@@ -253,9 +248,9 @@ bool ModelLoader::loadFromObj(const QString& filename)
 
 void ModelLoader::createDuplicateVertices()
 {
-    QList<Vector3f> dupVertices;
-    QList<Vector3f> dupNormals;
-    QList<Vector2f> dupTexcoords;
+    QVector<Vector3f> dupVertices;
+    QVector<Vector3f> dupNormals;
+    QVector<Vector2f> dupTexcoords;
     QHash<FaceVertex, int> faceVertex2Index;
 
     mIndices.clear();
@@ -342,6 +337,30 @@ void ModelLoader::recalcNormals()
     }
 }
 
+void ModelLoader::optimizeModel(bool reduceOverdraw, int cacheSize,
+                                MeshOptimizer::CacheStatistics* before, MeshOptimizer::CacheStatistics* after)
+{
+    if (mVertices.isEmpty() || mIndices.isEmpty()) {
+        return;
+    }
+
+    if (before) {
+        *before = MeshOptimizer::analyzeVertexCache(mIndices.constData(), mIndices.count(), mVertices.count(), cacheSize);
+    }
+    QVector<int> clusters;
+    MeshOptimizer::optimizeVertexCache(mIndices.data(), mIndices.count(), mVertices.count(), cacheSize, reduceOverdraw ? &clusters : 0);
+    if (reduceOverdraw) {
+        MeshOptimizer::optimizeOverdraw(mIndices.data(), mIndices.count(), mVertices.constData(), clusters);
+    }
+    QVector<unsigned int> remap = MeshOptimizer::optimizeVertexFetch(mIndices.data(), mIndices.count(), mVertices.count());
+    MeshOptimizer::remapVertices(mVertices, remap);
+    MeshOptimizer::remapVertices(mNormals, remap);
+    MeshOptimizer::remapVertices(mTexcoords, remap);
+    if (after) {
+        *after = MeshOptimizer::analyzeVertexCache(mIndices.constData(), mIndices.count(), mVertices.count(), cacheSize);
+    }
+}
+
 void ModelLoader::scaleModel(float scale)
 {
     for (int i = 0; i < mVertices.count(); i++) {
@@ -19,10 +19,12 @@
 #define KGLLIB_MODELLOADER_H
 
 #include "kgllib.h"
+#include "meshoptimizer.h"
 
 #include <Eigen/Core>
 
 #include <QtCore/QList>
+#include <QtCore/QVector>
 
 class QString;
 
@@ -52,6 +54,29 @@ public:
     void recalcNormals();
     void scaleModel(float scale);
     void translateModel(const Eigen::Vector3f& trans);
+    /**
+     * Reorders the triangles and vertices of the model for the GPU's vertex
+     *  cache.
+     *
+     * @param reduceOverdraw whether triangle clusters should additionally be
+     *  sorted to reduce overdraw.
+     * @param cacheSize number of entries in the simulated vertex cache.
+     * @param before if not null, it's set to the cache statistics of the
+     *  model before the optimization.
+     * @param after if not null, it's set to the cache statistics afterwards.
+     *
+     * @see MeshOptimizer
+     **/
+    void optimizeModel(bool reduceOverdraw = false, int cacheSize = 16,
+                       MeshOptimizer::CacheStatistics* before = 0, MeshOptimizer::CacheStatistics* after = 0);
+
+    /**
+     * Sets the number of levels of detail which are generated for batches
+     *  created by this loader (see @ref Batch::generateLods()).
+     * Default value is 1, which means that only the full detail is used.
+     **/
+    void setLodCount(int count)  { mLodCount = count; }
+    int lodCount() const  { return mLodCount; }
 
     int vertexCount() const;
     int indexCount() const;
@@ -65,11 +90,12 @@ protected:
 
 private:
     bool mValid;
+    int mLodCount;
 
-    QList<Eigen::Vector3f> mVertices;
-    QList<Eigen::Vector3f> mNormals;
-    QList<Eigen::Vector2f> mTexcoords;
-    QList<unsigned int> mIndices;
+    QVector<Eigen::Vector3f> mVertices;
+    QVector<Eigen::Vector3f> mNormals;
+    QVector<Eigen::Vector2f> mTexcoords;
+    QVector<unsigned int> mIndices;
 
     QList<FaceVertex> mFaceVertices;
 };
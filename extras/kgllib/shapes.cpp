@@ -19,6 +19,7 @@
 
 #include "batch.h"
 
+#include <QtCore/QVector>
 #include <QtDebug>
 
 #ifndef M_PI
@@ -30,7 +31,29 @@ using namespace Eigen;
 namespace KGLLib
 {
 
+namespace
+{
+template<typename T> T* vectorToArray(const QVector<T>& vector)
+{
+    T* array = new T[vector.count()];
+    for (int i = 0; i < vector.count(); i++) {
+        array[i] = vector[i];
+    }
+    return array;
+}
+}
+
 void Shapes::createSphereGeometry(int& vertexcount, Vector3f*& vertices, Vector2f*& texcoords, int detail)
+{
+    QVector<Vector3f> v;
+    QVector<Vector2f> t;
+    createSphereGeometry(v, t, detail);
+    vertexcount = v.count();
+    vertices = vectorToArray(v);
+    texcoords = vectorToArray(t);
+}
+
+void Shapes::createSphereGeometry(QVector<Vector3f>& vertices, QVector<Vector2f>& texcoords, int detail)
 {
     Vector3f xp( 1,  0,  0);
     Vector3f xn(-1,  0,  0);
@@ -49,14 +72,14 @@ void Shapes::createSphereGeometry(int& vertexcount, Vector3f*& vertices, Vector2
         yn, xn, zn,
     };
 
-    vertexcount = 8*3;
-    vertices = new Vector3f[vertexcount];
+    int vertexcount = 8*3;
+    vertices.resize(vertexcount);
     for (int i = 0; i < vertexcount; i++) {
         vertices[i] = octahedron[i];
     }
     for (int d = 0; d < detail; d++) {
         int vc = vertexcount*4;
-        Vector3f* newv = new Vector3f[vc];
+        QVector<Vector3f> newv(vc);
         int j = 0;
         for (int i = 0; i < vertexcount; i += 3) {
             // Calculate midpoints of each side
@@ -85,13 +108,12 @@ void Shapes::createSphereGeometry(int& vertexcount, Vector3f*& vertices, Vector2
             newv[j++] = vertices[i+2];
             newv[j++] = c;
         }
-        delete[] vertices;
         vertices = newv;
         vertexcount = vc;
     }
 
     // Calculate texcoords
-    texcoords = new Vector2f[vertexcount];
+    texcoords.resize(vertexcount);
     for (int i = 0; i < vertexcount; i += 3) {
 //         qDebug() << "  Processing face" << i;
         for (int j = 0; j < 3; j++) {
@@ -116,17 +138,16 @@ void Shapes::createSphereGeometry(int& vertexcount, Vector3f*& vertices, Vector2
 
 void Shapes::createSphere(Batch* batch, int detail)
 {
-    int vertexcount = 0;
-    Vector3f* vertices = 0;
-    Vector2f* texcoords = 0;
+    QVector<Vector3f> vertices;
+    QVector<Vector2f> texcoords;
 
-    createSphereGeometry(vertexcount, vertices, texcoords, detail);
+    createSphereGeometry(vertices, texcoords, detail);
 
+    // The batch takes over the arrays
     batch->setVertices(vertices);
     batch->setTexcoords(texcoords);
-    batch->setVertexCount(vertexcount);
 //     batch->setPrimitiveType(GL_TRIANGLES);
-    qDebug() << "Sphere mesh has" << vertexcount << "vertices (" << vertexcount/3 << "faces)";
+    qDebug() << "Sphere mesh has" << vertices.count() << "vertices (" << vertices.count()/3 << "faces)";
 }
 
 Batch* Shapes::createSphere(int detail)
@@ -140,9 +161,18 @@ Batch* Shapes::createSphere(int detail)
 
 void Shapes::createCubeGeometry(int& vertexcount, Vector3f*& vertices, Vector2f*& texcoords)
 {
-    vertices = new Vector3f[6*4];
-    texcoords = new Vector2f[6*4];
-    vertexcount = 24;
+    QVector<Vector3f> v;
+    QVector<Vector2f> t;
+    createCubeGeometry(v, t);
+    vertexcount = v.count();
+    vertices = vectorToArray(v);
+    texcoords = vectorToArray(t);
+}
+
+void Shapes::createCubeGeometry(QVector<Vector3f>& vertices, QVector<Vector2f>& texcoords)
+{
+    vertices.resize(6*4);
+    texcoords.resize(6*4);
 
     int i = 0;
     vertices[i++] = Vector3f(-1, -1, -1);
@@ -185,15 +215,14 @@ void Shapes::createCubeGeometry(int& vertexcount, Vector3f*& vertices, Vector2f*
 
 void Shapes::createCube(Batch* batch)
 {
-    int vertexcount = 0;
-    Vector3f* vertices = 0;
-    Vector2f* texcoords = 0;
+    QVector<Vector3f> vertices;
+    QVector<Vector2f> texcoords;
 
-    createCubeGeometry(vertexcount, vertices, texcoords);
+    createCubeGeometry(vertices, texcoords);
 
+    // The batch takes over the arrays
     batch->setVertices(vertices);
     batch->setTexcoords(texcoords);
-    batch->setVertexCount(vertexcount);
     batch->setPrimitiveType(GL_QUADS);
 }
 
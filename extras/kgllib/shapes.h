@@ -22,6 +22,8 @@
 
 #include <Eigen/Core>
 
+#include <QtCore/QVector>
+
 
 namespace KGLLib
 {
@@ -38,9 +40,12 @@ class Batch;
  * Currently spheres and cubes can be created.
  *
  * For each object type, there are 3 methods: the first only creates arrays of vertices and texture
- *  coordinates. This can be useful if you want to do further processing on the data.
+ *  coordinates. This can be useful if you want to do further processing on the data. The arrays
+ *  are returned either as QVectors or as arrays allocated with new[], which must be deleted by
+ *  the caller.
  *
- * The second one also adds the created data to a specified Batch object. This is useful when you
+ * The second one also adds the created data to a specified Batch object, which takes ownership
+ *  of the data. This is useful when you
  *  actually want to create a Mesh object or other subclass of Batch. In that case you'll need to
  *  first create the Mesh object yourself and then use the Shapes function to add geometry to it:
  * @code
@@ -65,6 +70,7 @@ public:
     static Batch* createSphere(int detail = 3);
     static void createSphere(Batch* batch, int detail = 3);
     static void createSphereGeometry(int& vertexcount, Eigen::Vector3f*& vertices, Eigen::Vector2f*& texcoords, int detail = 3);
+    static void createSphereGeometry(QVector<Eigen::Vector3f>& vertices, QVector<Eigen::Vector2f>& texcoords, int detail = 3);
 
     /**
      * Creates a Batch object with cube geometry.
@@ -72,6 +78,7 @@ public:
     static Batch* createCube();
     static void createCube(Batch* batch);
     static void createCubeGeometry(int& vertexcount, Eigen::Vector3f*& vertices, Eigen::Vector2f*& texcoords);
+    static void createCubeGeometry(QVector<Eigen::Vector3f>& vertices, QVector<Eigen::Vector2f>& texcoords);
 };
 
 }
@@ -18,6 +18,7 @@
 #include "simpleterrain.h"
 
 #include <kgllib.h>
+#include <geometrybuffer.h>
 
 #include <QImage>
 #include <QColor>
@@ -187,8 +188,15 @@ void SimpleTerrain::cookMesh(bool useIndices)
     delete[] mNormals;
     delete[] mIndices;
 
+    // With primitive restart, the strips are separated by a restart index
+    //  instead of being stitched together using degenerate triangles.
+    bool restart = useIndices && GeometryBuffer::isPrimitiveRestartSupported();
     int vcount = mWidth * mHeight;
     int icount = (mWidth-1) * (2 + 2*mHeight);
+    if (restart) {
+        // One separator between each pair of strips, none for a single column
+        icount = (mWidth-1) * 2*mHeight + qMax(mWidth-2, 0);
+    }
 
     if (useIndices) {
         mIndices = new unsigned int[icount];
@@ -217,18 +225,25 @@ void SimpleTerrain::cookMesh(bool useIndices)
         }
         index = 0;
         for (int x = 1; x < mWidth; x++) {
-            mIndices[index++] = (x-1)*mHeight + 0;
+            if (!restart) {
+                mIndices[index++] = (x-1)*mHeight + 0;
+            } else if (x > 1) {
+                mIndices[index++] = GeometryBufferFormat::RestartIndex;
+            }
             for (int z = 0; z < mHeight; z++) {
                 mIndices[index++] = (x-1)*mHeight + z;
                 mIndices[index++] = (x  )*mHeight + z;
             }
-            mIndices[index++] = (x  )*mHeight + mHeight-1;
+            if (!restart) {
+                mIndices[index++] = (x  )*mHeight + mHeight-1;
+            }
         }
     }
 
     setVertexCount(vcount);
     setVertices(mVertices);
     setNormals(mNormals);
+    setPrimitiveRestart(restart);
     if (useIndices) {
         setIndices(mIndices, icount);
     }
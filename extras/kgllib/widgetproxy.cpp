@@ -18,6 +18,7 @@
 #include "widgetproxy.h"
 
 #include "glwidget.h"
+#include "renderer.h"
 
 #include <QGraphicsView>
 #include <QGraphicsScene>
@@ -58,6 +59,7 @@ public:
 
         // Pop the state
         glPopAttrib();
+        renderer->invalidateState();
         // paintGL() might change the matrices so we load the same ones as
         //  the OpenGL paintengine does
         glMatrixMode(GL_PROJECTION);